@@ -0,0 +1,640 @@
+// Microbenchmarks for the intersection kernels
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <chrono>
+#include <random>
+#include <algorithm>
+
+#include <glm/glm.hpp>
+#include <common/object.h>
+#include <common/image.h>
+#include <common/threadpool.h>
+#include <common/objloader.hpp>
+#include <common/scenecache.h>
+#include <common/spheretable.h>
+#include <common/objectlist.h>
+#include <common/raytracing.h>
+#include <common/lighttable.h>
+
+static double seconds(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static void report(const char* name, size_t tests, size_t hits, double time) {
+  printf("%-28s %10.2f Mtests/s  (%zu hits, %.3fs)\n", name, tests / time / 1.0e6, hits, time);
+}
+
+// Triangle::intersect as it was before the Moller-Trumbore kernel, kept as the baseline
+static std::experimental::optional<glm::vec3> legacyIntersect(const glm::vec3* vertices, glm::vec3 normal, const Ray& r) {
+  double s = glm::dot(normal, vertices[0] - r.origin) / glm::dot(normal, r.direction);
+  if (s < EPSILON) return {};
+  glm::vec3 p = r.origin + s * r.direction;
+  glm::vec3 n = glm::normalize(glm::cross(vertices[1] - vertices[0], p - vertices[0]));
+  for (int i = 0; i < 3; ++i) {
+    if (!EQUAL(glm::normalize(glm::cross(vertices[(i+1) % 3] - vertices[i], p - vertices[i])), n)) return {};
+  }
+  return p;
+}
+
+static void benchTriangles() {
+  const int ntriangles = 4096;
+  const int nrays = 2048;
+  std::mt19937 rng(817);
+  std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+
+  std::vector<glm::vec3> vertices;
+  std::vector<glm::vec3> normals;
+  std::vector<Triangle> triangles;
+  for (int i = 0; i < ntriangles; ++i) {
+    glm::vec3 c = glm::vec3(unit(rng), unit(rng), unit(rng)) * 10.0f;
+    glm::vec3 a = c + glm::vec3(unit(rng), unit(rng), unit(rng));
+    glm::vec3 b = c + glm::vec3(unit(rng), unit(rng), unit(rng));
+    glm::vec3 d = c + glm::vec3(unit(rng), unit(rng), unit(rng));
+    vertices.push_back(a);
+    vertices.push_back(b);
+    vertices.push_back(d);
+    normals.push_back(glm::normalize(glm::cross(b - a, d - a)));
+    triangles.push_back(Triangle(a, b, d));
+  }
+  std::vector<TrianglePack> packs((ntriangles + SIMD_WIDTH - 1) / SIMD_WIDTH);
+  for (int i = 0; i < ntriangles; ++i) {
+    packs[i / SIMD_WIDTH].set(i % SIMD_WIDTH, triangles[i], i);
+  }
+  std::vector<Ray> rays;
+  for (int i = 0; i < nrays; ++i) {
+    glm::vec3 origin = glm::vec3(unit(rng), unit(rng), unit(rng)) * 20.0f;
+    glm::vec3 target = glm::vec3(unit(rng), unit(rng), unit(rng)) * 5.0f;
+    rays.push_back(Ray(origin, target - origin, 1.0));
+  }
+  size_t tests = (size_t)ntriangles * nrays;
+
+  auto start = std::chrono::steady_clock::now();
+  size_t hits = 0;
+  for (auto const & r: rays) {
+    for (int i = 0; i < ntriangles; ++i) {
+      if (legacyIntersect(&vertices[i * 3], normals[i], r)) hits++;
+    }
+  }
+  report("triangle legacy", tests, hits, seconds(start));
+
+  start = std::chrono::steady_clock::now();
+  hits = 0;
+  for (auto const & r: rays) {
+    for (auto const & t: triangles) {
+      float d, u, v;
+      if (t.intersect(r, d, u, v)) hits++;
+    }
+  }
+  report("triangle moller-trumbore", tests, hits, seconds(start));
+
+  // The pack kernel returns the nearest lane only, so count rays that hit anything
+  start = std::chrono::steady_clock::now();
+  hits = 0;
+  size_t scalarHits = 0;
+  for (auto const & r: rays) {
+    float tmax = INFINITY;
+    bool hit = false;
+    for (auto const & p: packs) {
+      float u, v;
+      if (p.intersect(r, tmax, u, v) >= 0) hit = true;
+    }
+    if (hit) hits++;
+  }
+  double time = seconds(start);
+  for (auto const & r: rays) {
+    for (auto const & t: triangles) {
+      float d, u, v;
+      if (t.intersect(r, d, u, v)) {
+        scalarHits++;
+        break;
+      }
+    }
+  }
+  char name[64];
+  snprintf(name, sizeof(name), "triangle pack x%d", SIMD_WIDTH);
+  report(name, tests, hits, time);
+  printf("%-28s %zu rays hit, scalar kernel agrees: %s\n", "", hits, hits == scalarHits ? "yes" : "no");
+}
+
+// Camera-like rays: SIMD_WIDTH eye samples converging on each pixel of a view of the mesh
+static void benchPackets() {
+  const int grid = 64;
+  const int resolution = 128;
+  std::mt19937 rng(817);
+  std::uniform_real_distribution<float> jitter(-0.1f, 0.1f);
+
+  // A bumpy height field, two triangles per cell
+  std::vector<glm::vec3> vertices;
+  auto height = [&](int i, int j) { return glm::vec3(i - grid / 2, j - grid / 2, 2.0f * sinf(i * 0.3f) * cosf(j * 0.2f)); };
+  for (int i = 0; i < grid; ++i) {
+    for (int j = 0; j < grid; ++j) {
+      glm::vec3 a = height(i, j), b = height(i + 1, j), c = height(i + 1, j + 1), d = height(i, j + 1);
+      vertices.insert(vertices.end(), {a, b, c, a, c, d});
+    }
+  }
+  Polygon mesh(vertices, glm::vec3(0), glm::vec3(0), glm::vec3(0), 1.0, 1.0, false, false);
+
+  std::vector<Ray> rays;
+  glm::vec3 eye = glm::vec3(0.0f, -60.0f, 40.0f);
+  for (int y = 0; y < resolution; ++y) {
+    for (int x = 0; x < resolution; ++x) {
+      glm::vec3 target = glm::vec3((x - resolution / 2) * 0.6f, (y - resolution / 2) * 0.6f, 0.0f);
+      for (int k = 0; k < SIMD_WIDTH; ++k) {
+        glm::vec3 origin = eye + glm::vec3(jitter(rng), jitter(rng), jitter(rng)) * 15.0f;
+        rays.push_back(Ray(origin, target - origin, 1.0));
+      }
+    }
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  size_t hits = 0;
+  double depth = 0.0;
+  for (auto const & r: rays) {
+    auto hit = mesh.intersect(r);
+    if (hit) {
+      hits++;
+      depth += hit->distance;
+    }
+  }
+  report("packet single rays", rays.size(), hits, seconds(start));
+
+  start = std::chrono::steady_clock::now();
+  size_t packetHits = 0;
+  double packetDepth = 0.0;
+  for (size_t i = 0; i < rays.size(); i += SIMD_WIDTH) {
+    RayPacket packet;
+    for (int k = 0; k < SIMD_WIDTH; ++k) {
+      packet.set(k, rays[i + k].origin, rays[i + k].direction);
+    }
+    packet.prepare();
+    mesh.intersectPacket(packet, packet.active);
+    for (int k = 0; k < SIMD_WIDTH; ++k) {
+      if (packet.object[k]) {
+        packetHits++;
+        packetDepth += packet.tmax[k];
+      }
+    }
+  }
+  char name[64];
+  snprintf(name, sizeof(name), "packet x%d", SIMD_WIDTH);
+  report(name, rays.size(), packetHits, seconds(start));
+  printf("%-28s single rays agree: %s\n", "", hits == packetHits && depth == packetDepth ? "yes" : "no");
+}
+
+// The PNG encoding as it was before ImageWriter, one libpng stream on one thread
+static void legacyWritePNG(const char* path, int width, int height, const png_byte* image) {
+  FILE *fp = fopen(path, "wb");
+  png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+  png_infop info_ptr = png_create_info_struct(png_ptr);
+  png_init_io(png_ptr, fp);
+  png_set_IHDR(png_ptr, info_ptr, width, height, 8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
+               PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+  png_write_info(png_ptr, info_ptr);
+  for (int y = 0; y < height; ++y) {
+    png_write_row(png_ptr, &image[y * width * 3]);
+  }
+  png_write_end(png_ptr, NULL);
+  png_destroy_write_struct(&png_ptr, &info_ptr);
+  fclose(fp);
+}
+
+static long fileSize(const char* path) {
+  FILE* fp = fopen(path, "rb");
+  fseek(fp, 0, SEEK_END);
+  long size = ftell(fp);
+  fclose(fp);
+  return size;
+}
+
+// A smooth gradient with noise, compressible about as well as a render
+static void benchEncode() {
+  const int width = 4096, height = 2048, band = 16;
+  std::mt19937 rng(817);
+  std::uniform_int_distribution<int> noise(-4, 4);
+  std::vector<png_byte> image((size_t)width * height * 3);
+  for (int y = 0; y < height; ++y) {
+    for (int x = 0; x < width; ++x) {
+      for (int c = 0; c < 3; ++c) {
+        image[((size_t)y * width + x) * 3 + c] = cut(x * 255.0 / width * (c + 1) / 3 + y * 64.0 / height + noise(rng));
+      }
+    }
+  }
+  double megabytes = image.size() / 1.0e6;
+
+  auto start = std::chrono::steady_clock::now();
+  legacyWritePNG("/tmp/bench_legacy.png", width, height, image.data());
+  double time = seconds(start);
+  printf("%-28s %10.2f MB/s  (%ld bytes, %.3fs)\n", "encode libpng", megabytes / time, fileSize("/tmp/bench_legacy.png"), time);
+
+  ThreadPool pool;
+  const int levels[3] = {1, 6, 9};
+  for (int level: levels) {
+    start = std::chrono::steady_clock::now();
+    ImageWriter writer("/tmp/bench_parallel.png", width, height, ImageFormat::PNG, level);
+    int bands = height / band;
+    std::vector<EncodedRows> encoded(bands);
+    for (int b = 0; b < bands; ++b) {
+      pool.submit([&, b](int) {
+        encoded[b] = writer.encode(&image[(size_t)b * band * width * 3], band, b == bands - 1);
+      });
+    }
+    pool.wait();
+    for (int b = 0; b < bands; ++b) {
+      writer.write(encoded[b], band);
+    }
+    time = seconds(start);
+    char name[64];
+    snprintf(name, sizeof(name), "encode x%d level %d", pool.size(), level);
+    printf("%-28s %10.2f MB/s  (%ld bytes, %.3fs)\n", name, megabytes / time, fileSize("/tmp/bench_parallel.png"), time);
+  }
+
+  start = std::chrono::steady_clock::now();
+  {
+    ImageWriter writer("/tmp/bench.ppm", width, height, ImageFormat::PPM);
+    writer.writeRows(image.data(), height);
+  }
+  time = seconds(start);
+  printf("%-28s %10.2f MB/s  (%ld bytes, %.3fs)\n", "encode ppm", megabytes / time, fileSize("/tmp/bench.ppm"), time);
+}
+
+// loadOBJ as it was before the parallel parser: fscanf token by token, v//vn faces only
+static bool legacyLoadOBJ(const char* path, std::vector<glm::vec3>& out_vertices, std::vector<glm::vec3>& out_normals) {
+  std::vector<unsigned int> vertexIndices, normalIndices;
+  std::vector<glm::vec3> temp_vertices;
+  std::vector<glm::vec3> temp_normals;
+  FILE* file = fopen(path, "r");
+  if (file == NULL) return false;
+  while (true) {
+    char lineHeader[128];
+    if (fscanf(file, "%s", lineHeader) == EOF) break;
+    if (strcmp(lineHeader, "v") == 0) {
+      glm::vec3 vertex;
+      fscanf(file, "%f %f %f\n", &vertex.x, &vertex.y, &vertex.z);
+      temp_vertices.push_back(vertex);
+    }
+    else if (strcmp(lineHeader, "vn") == 0) {
+      glm::vec3 normal;
+      fscanf(file, "%f %f %f\n", &normal.x, &normal.y, &normal.z);
+      temp_normals.push_back(normal);
+    }
+    else if (strcmp(lineHeader, "f") == 0) {
+      unsigned int v[3], n[3];
+      if (fscanf(file, "%d//%d %d//%d %d//%d\n", &v[0], &n[0], &v[1], &n[1], &v[2], &n[2]) != 6) {
+        fclose(file);
+        return false;
+      }
+      for (int i = 0; i < 3; ++i) {
+        vertexIndices.push_back(v[i]);
+        normalIndices.push_back(n[i]);
+      }
+    }
+    else {
+      char buffer[1000];
+      fgets(buffer, 1000, file);
+    }
+  }
+  for (size_t i = 0; i < vertexIndices.size(); ++i) {
+    out_vertices.push_back(temp_vertices[vertexIndices[i] - 1]);
+    out_normals.push_back(temp_normals[normalIndices[i] - 1]);
+  }
+  fclose(file);
+  return true;
+}
+
+// A wavy height field of 2 * 600 * 600 triangles with v//vn faces, which both loaders read
+static void writeBenchOBJ(const char* path) {
+  const int n = 600;
+  FILE* fp = fopen(path, "w");
+  fprintf(fp, "# bench mesh\no grid\n");
+  for (int y = 0; y <= n; ++y) {
+    for (int x = 0; x <= n; ++x) {
+      fprintf(fp, "v %f %f %f\n", x * 0.1, sin(x * 0.05) * cos(y * 0.07), y * -0.1);
+    }
+  }
+  for (int y = 0; y <= n; ++y) {
+    for (int x = 0; x <= n; ++x) {
+      glm::vec3 normal = glm::normalize(glm::vec3(-0.05 * cos(x * 0.05), 1.0, 0.07 * sin(y * 0.07)));
+      fprintf(fp, "vn %.6f %.6f %.6f\n", normal.x, normal.y, normal.z);
+    }
+  }
+  for (int y = 0; y < n; ++y) {
+    for (int x = 0; x < n; ++x) {
+      int a = y * (n + 1) + x + 1, b = a + 1, c = a + n + 1, d = c + 1;
+      fprintf(fp, "f %d//%d %d//%d %d//%d\n", a, a, b, b, d, d);
+      fprintf(fp, "f %d//%d %d//%d %d//%d\n", a, a, d, d, c, c);
+    }
+  }
+  fclose(fp);
+}
+
+static void benchOBJ() {
+  const char* path = "/tmp/bench.obj";
+  writeBenchOBJ(path);
+  double megabytes = fileSize(path) / 1.0e6;
+
+  std::vector<glm::vec3> vertices, normals;
+  auto start = std::chrono::steady_clock::now();
+  legacyLoadOBJ(path, vertices, normals);
+  double time = seconds(start);
+  printf("%-28s %10.2f MB/s  (%zu triangles, %.3fs)\n", "obj fscanf", megabytes / time, vertices.size() / 3, time);
+
+  const int threads[2] = {1, 0};
+  for (int t: threads) {
+    Mesh mesh;
+    start = std::chrono::steady_clock::now();
+    bool ok = loadOBJ(path, mesh, t);
+    time = seconds(start);
+    bool agree = ok && mesh.triangles() * 3 == vertices.size();
+    for (size_t i = 0; agree && i < vertices.size(); ++i) {
+      agree = mesh.positions[mesh.positionIndices[i]] == vertices[i] && mesh.normals[mesh.normalIndices[i]] == normals[i];
+    }
+    char name[64];
+    snprintf(name, sizeof(name), "obj parallel x%d", t > 0 ? t : ThreadPool().size());
+    printf("%-28s %10.2f MB/s  (%zu triangles, %.3fs, agrees: %s)\n", name, megabytes / time, mesh.triangles(), time, agree ? "yes" : "no");
+  }
+}
+
+// Particle cloud traced as one Sphere object per particle behind a BVH, called through Object and
+// called directly as the world lists them, and as one sphere table
+static void benchSpheres() {
+  const int nspheres = 200000;
+  const int nrays = 200000;
+  std::mt19937 rng(817);
+  std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+
+  std::vector<glm::vec3> centers;
+  std::vector<float> radii;
+  std::vector<Sphere> spheres;
+  glm::vec3 material(0.5f);
+  for (int i = 0; i < nspheres; ++i) {
+    glm::vec3 c = glm::vec3(unit(rng), unit(rng), unit(rng)) * 30.0f;
+    float r = 0.4f + 0.2f * unit(rng);
+    centers.push_back(c);
+    radii.push_back(r);
+    spheres.push_back(Sphere(c, r, material, material, material, 10.0, 1.0, false, false));
+  }
+  // The same spheres called through Object and called as Sphere
+  ObjectList<Object> objects;
+  ObjectList<Sphere> typed;
+  for (auto & sphere: spheres) {
+    objects.add(&sphere);
+    typed.add(&sphere);
+  }
+  objects.build();
+  typed.build();
+  SphereTable table(centers, radii, material, material, material, 10.0, 1.0, false, false);
+
+  std::vector<Ray> rays;
+  for (int i = 0; i < nrays; ++i) {
+    glm::vec3 origin = glm::normalize(glm::vec3(unit(rng), unit(rng), unit(rng))) * 80.0f;
+    glm::vec3 target = glm::vec3(unit(rng), unit(rng), unit(rng)) * 20.0f;
+    rays.push_back(Ray(origin, target - origin, 1.0));
+  }
+
+  std::vector<std::experimental::optional<Hit>> expected(nrays);
+  auto start = std::chrono::steady_clock::now();
+  size_t hits = 0;
+  for (int i = 0; i < nrays; ++i) {
+    float tmax = INFINITY;
+    objects.intersect(rays[i], tmax, expected[i]);
+    if (expected[i]) hits++;
+  }
+  report("spheres through Object", nrays, hits, seconds(start));
+
+  start = std::chrono::steady_clock::now();
+  hits = 0;
+  for (int i = 0; i < nrays; ++i) {
+    float tmax = INFINITY;
+    std::experimental::optional<Hit> hit;
+    typed.intersect(rays[i], tmax, hit);
+    if (hit) hits++;
+  }
+  report("spheres as Sphere", nrays, hits, seconds(start));
+  for (auto & hit: expected) {
+    if (hit) hit->primitive = (uint32_t)((const Sphere*)hit->object - spheres.data());
+  }
+
+  std::vector<std::experimental::optional<Hit>> found(nrays);
+  start = std::chrono::steady_clock::now();
+  hits = 0;
+  for (int i = 0; i < nrays; ++i) {
+    found[i] = table.intersect(rays[i]);
+    if (found[i]) hits++;
+  }
+  char name[64];
+  snprintf(name, sizeof(name), "spheres table x%d", SIMD_WIDTH);
+  report(name, nrays, hits, seconds(start));
+
+  // Sphere squares single precision dot products in its discriminant, so far from the origin it
+  // drifts from the table and flips some rays that graze a sphere
+  size_t differ = 0;
+  float error = 0.0f;
+  for (int i = 0; i < nrays; ++i) {
+    if ((bool)expected[i] != (bool)found[i] || (found[i] && expected[i]->primitive != found[i]->primitive)) differ++;
+    else if (found[i]) error = std::max(error, glm::abs(expected[i]->distance - found[i]->distance));
+  }
+  printf("%-28s %zu rays differ, distances within %.2e\n", "", differ, error);
+}
+
+// Bytes per triangle of the height field polygon, against the three vertices, three normals, face
+// normal and two edges every triangle used to hold
+static void benchMesh() {
+  const char* path = "/tmp/bench.obj";
+  writeBenchOBJ(path);
+  Mesh mesh;
+  if (!loadOBJ(path, mesh)) return;
+  glm::vec3 material(0.5f);
+  Polygon polygon(mesh, material, material, material, 10.0, 1.0, false, false);
+  size_t triangles = mesh.triangles();
+  size_t compact = mesh.positions.size() * sizeof(glm::vec3) + mesh.normals.size() * sizeof(uint32_t) +
+                   mesh.uvs.size() * sizeof(glm::vec2) + triangles * 2 * sizeof(glm::uvec3);
+  size_t legacy = polygon.memory() - compact + triangles * 9 * sizeof(glm::vec3);
+  printf("%-28s %10.1f B/triangle  (%zu triangles, %.1f MB)\n", "mesh per-triangle arrays", (double)legacy / triangles, triangles, legacy / 1.0e6);
+  printf("%-28s %10.1f B/triangle  (%zu triangles, %.1f MB)\n", "mesh indexed", (double)polygon.memory() / triangles, triangles, polygon.memory() / 1.0e6);
+  printf("%-28s %10.1f B/triangle\n", "mesh attributes only", (double)compact / triangles);
+
+  float worst = 0.0f;
+  for (auto const & n: mesh.normals) {
+    glm::vec3 unit = glm::normalize(n);
+    worst = std::max(worst, glm::length(unit - decodeNormal(encodeNormal(unit))));
+  }
+  printf("%-28s %10.2e rad\n", "mesh normal encoding error", worst);
+}
+
+// Startup of the height field polygon, parsed and built from the OBJ file, then from its compiled file
+static void benchScene() {
+  const char* path = "/tmp/bench.obj";
+  const char* directory = "/tmp/bench-scenes";
+  writeBenchOBJ(path);
+  glm::mat4 transform = glm::scale(glm::vec3(2.0f));
+  SceneCache cache(directory);
+  std::string command = std::string("rm -rf ") + directory;
+  if (system(command.c_str()) != 0) return;
+
+  glm::vec3 material(0.5f);
+  Polygon cold(material, material, material, 10.0, 1.0, false, false);
+  auto start = std::chrono::steady_clock::now();
+  bool ok = cache.loadPolygon(path, transform, cold);
+  double time = seconds(start);
+  printf("%-28s %10.3f s  (%s)\n", "scene parse, build, write", time, ok ? "ok" : "failed");
+
+  Polygon warm(material, material, material, 10.0, 1.0, false, false);
+  start = std::chrono::steady_clock::now();
+  ok = cache.loadPolygon(path, transform, warm);
+  time = seconds(start);
+
+  // Both must hit the same triangles at the same distances
+  std::mt19937 rng(7);
+  std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+  bool agree = ok;
+  for (int i = 0; agree && i < 10000; ++i) {
+    Ray r(glm::vec3(unit(rng) * 120.0f, 10.0f, unit(rng) * -120.0f), glm::vec3(unit(rng) - 0.5f, -1.0f, unit(rng) - 0.5f), 1.0);
+    auto a = cold.intersect(r);
+    auto b = warm.intersect(r);
+    agree = (bool)a == (bool)b && (!a || (a->distance == b->distance && a->primitive == b->primitive));
+  }
+  printf("%-28s %10.3f s  (agrees: %s)\n", "scene compiled", time, agree ? "yes" : "no");
+}
+
+// Phong terms of one light as World::lightContribution computes them in double, kept as the baseline
+static glm::vec3 legacyLightContribution(glm::vec3 position, double power, glm::vec3 q, glm::vec3 N, glm::vec3 V, glm::vec3 diffuse, glm::vec3 specular, double gloss) {
+  glm::vec3 L = glm::normalize(position - q);
+  double nl = glm::dot(N, L);
+  double distance = glm::distance(position, q);
+  glm::vec3 c = glm::vec3(0);
+  if (nl > EPSILON) {
+    c += diffuse * power / (distance*distance) * nl;
+  }
+  glm::vec3 R = glm::dot(2.0 * L, N) * N - L;
+  if (glm::dot(R, V) > EPSILON) {
+    c += specular * power / (distance*distance) * pow(glm::dot(R, V), gloss);
+  }
+  return c;
+}
+
+// Unshadowed shading of the 78 lights of the hw5 rig at random points, one light at a time and from the light table
+static void benchLights() {
+  std::vector<glm::vec3> positions;
+  std::vector<float> powers;
+  for (int i = -3; i <= 3; ++i) {
+    for (int j = -3; j <= 3; ++j) {
+      positions.push_back(glm::vec3(i * 5.0f, 50.0f, j * 5.0f));
+      powers.push_back(5000.0f / 49);
+    }
+  }
+  for (int i = 0; i < 27; ++i) {
+    positions.push_back(glm::vec3(-40.0f + (i / 9 - 1) * 5.0f, 20.0f + (i / 3 % 3 - 1) * 5.0f, -30.0f + (i % 3 - 1) * 5.0f));
+    powers.push_back(1000.0f / 9);
+  }
+  positions.push_back(glm::vec3(0.0f, 50.0f, 0.0f));
+  powers.push_back(5000.0f);
+  positions.push_back(glm::vec3(0.0f, 50.0f, 0.0f));
+  powers.push_back(5000.0f);
+  LightTable table;
+  table.build(positions, powers);
+
+  std::mt19937 rng(13);
+  std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+  struct Point { glm::vec3 q, N, V; };
+  std::vector<Point> points;
+  for (int i = 0; i < 100000; ++i) {
+    Point p;
+    p.q = glm::vec3(unit(rng), unit(rng), unit(rng)) * 40.0f;
+    p.N = glm::normalize(glm::vec3(unit(rng), unit(rng) + 1.2f, unit(rng)));
+    p.V = glm::normalize(glm::vec3(140.0f, 40.0f, -140.0f) - p.q);
+    points.push_back(p);
+  }
+  glm::vec3 diffuse(0.61424f, 0.04136f, 0.04136f), specular(0.727811f, 0.626959f, 0.626959f);
+  double gloss = 78.6;
+
+  std::vector<glm::vec3> legacy(points.size(), glm::vec3(0));
+  auto start = std::chrono::steady_clock::now();
+  for (size_t p = 0; p < points.size(); ++p) {
+    for (size_t i = 0; i < positions.size(); ++i) {
+      legacy[p] += legacyLightContribution(positions[i], powers[i], points[p].q, points[p].N, points[p].V, diffuse, specular, gloss);
+    }
+  }
+  double time = seconds(start);
+  printf("%-28s %10.1f ns/hit  (%zu lights)\n", "lights one at a time", time / points.size() * 1.0e9, positions.size());
+
+  float worst = 0.0f;
+  start = std::chrono::steady_clock::now();
+  for (size_t p = 0; p < points.size(); ++p) {
+    glm::vec3 c(0.0f);
+    float wd[SIMD_WIDTH], ws[SIMD_WIDTH];
+    for (size_t first = 0; first < table.size(); first += SIMD_WIDTH) {
+      int lit = table.weights(first, points[p].q, points[p].N, points[p].V, (float)gloss, wd, ws);
+      for (int lane = firstLane(lit); lane >= 0; lit &= lit - 1, lane = firstLane(lit)) {
+        c += diffuse * wd[lane] + specular * ws[lane];
+      }
+    }
+    worst = std::max(worst, glm::length(c - legacy[p]) / std::max(glm::length(legacy[p]), 1.0e-6f));
+  }
+  time = seconds(start);
+  printf("%-28s %10.1f ns/hit  (worst relative error %.1e)\n", "lights from the table", time / points.size() * 1.0e9, worst);
+}
+
+// Rays of a plain diffuse scene through World::trace, shaded by the general kernel and by the one
+// picked for the scene
+static void benchShading() {
+  World world;
+  world.setThreadCount(1);
+  world.setOutputFormat(ImageFormat::PPM);
+  std::vector<std::unique_ptr<Sphere>> spheres;
+  for (int i = 0; i < 8; ++i) {
+    glm::vec3 center(20.0f * (i % 4) - 30.0f, 0.0f, 20.0f * (i / 4) - 10.0f);
+    spheres.emplace_back(new Sphere(center, 8.0, glm::vec3(0.1f), glm::vec3(0.6f), glm::vec3(0.3f), 20.0, 1.0, false, false));
+    world.addObject(spheres.back().get());
+  }
+  std::vector<glm::vec3> vertices = {
+      glm::vec3(60.0f, -8.0f, -60.0f), glm::vec3(-60.0f, -8.0f, -60.0f), glm::vec3(-60.0f, -8.0f, 60.0f),
+      glm::vec3(60.0f, -8.0f, -60.0f), glm::vec3(-60.0f, -8.0f, 60.0f), glm::vec3(60.0f, -8.0f, 60.0f),
+  };
+  Polygon floor(vertices, glm::vec3(0.2f), glm::vec3(0.5f), glm::vec3(0.0f), 1.0, 1.0, false, false);
+  world.addObject(&floor);
+  for (int i = -1; i <= 1; ++i) {
+    for (int j = -1; j <= 1; ++j) {
+      Light light(glm::vec3(i * 20.0f, 60.0f, j * 20.0f), 5000.0 / 9);
+      world.addLight(light);
+    }
+  }
+
+  std::mt19937 rng(11);
+  std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+  std::vector<Ray> rays;
+  for (int i = 0; i < 200000; ++i) {
+    glm::vec3 eye(0.0f, 40.0f, -120.0f);
+    rays.push_back(Ray(eye, glm::vec3(unit(rng) * 50.0f, -8.0f, 0.0f) - eye + glm::vec3(0.0f, 0.0f, unit(rng) * 40.0f), 1.0));
+  }
+  const char* names[] = {"shading general double", "shading scene kernel", "shading scene kernel float"};
+  for (int pass = 0; pass < 3; ++pass) {
+    // A one pixel render builds the scene and picks the kernel
+    world.setExtraFeatures(pass == 0 ? SHADE_ALL : 0);
+    world.setSinglePrecision(pass == 2);
+    world.renderBatch(std::vector<View>(1, View(glm::vec3(0.0f, 40.0f, -120.0f), glm::vec3(0.0f, -0.3f, 1.0f), glm::vec3(0, 1, 0), 1.0, 1, 1, "/tmp/bench-shading.ppm")));
+    glm::vec3 sum(0.0f);
+    auto start = std::chrono::steady_clock::now();
+    for (auto const & ray: rays) {
+      sum += world.trace(ray, 0, ray.origin);
+    }
+    double time = seconds(start);
+    printf("%-28s %10.2f Mrays/s  (%.3fs, color sum %.6g)\n", names[pass], rays.size() / time / 1.0e6, time, sum.x + sum.y + sum.z);
+  }
+}
+
+int main(int argc, char** argv)
+{
+  const char* filter = argc > 1 ? argv[1] : "";
+  if (strstr("triangle", filter)) benchTriangles();
+  if (strstr("packet", filter)) benchPackets();
+  if (strstr("encode", filter)) benchEncode();
+  if (strstr("obj", filter)) benchOBJ();
+  if (strstr("spheres", filter)) benchSpheres();
+  if (strstr("mesh", filter)) benchMesh();
+  if (strstr("scene", filter)) benchScene();
+  if (strstr("shading", filter)) benchShading();
+  if (strstr("lights", filter)) benchLights();
+  return 0;
+}
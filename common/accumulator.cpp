@@ -0,0 +1,113 @@
+#include "accumulator.h"
+
+#include <cstring>
+#include <atomic>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define ACCUMULATOR_MAGIC "RTACCUM"
+#define ACCUMULATOR_VERSION 1
+// Tile state while its pixels are being updated
+#define TILE_IN_PROGRESS 0xFFFFFFFFu
+
+Accumulator::~Accumulator() {
+  if (map) {
+    flush(true);
+    munmap(map, size);
+  }
+  if (fd >= 0) close(fd);
+}
+
+int Accumulator::open(const char *path, int width, int height, int tileSize, uint64_t key) {
+  tilesX = (width + tileSize - 1) / tileSize;
+  uint32_t tiles = (uint32_t)(tilesX * ((height + tileSize - 1) / tileSize));
+  size_t tableSize = (tiles * sizeof(uint32_t) + 15) / 16 * 16;
+  size = sizeof(Header) + tableSize + (size_t)width * height * sizeof(Pixel);
+
+  fd = ::open(path, O_RDWR | O_CREAT, 0644);
+  if (fd < 0) return -1;
+  struct stat st;
+  bool resume = fstat(fd, &st) == 0 && (size_t)st.st_size == size;
+  if (!resume && (ftruncate(fd, 0) != 0 || ftruncate(fd, size) != 0)) return -1;
+  map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    map = nullptr;
+    return -1;
+  }
+  header = (Header*)map;
+  tileSamples = (uint32_t*)((char*)map + sizeof(Header));
+  pixels = (Pixel*)((char*)map + sizeof(Header) + tableSize);
+
+  if (resume) {
+    resume = memcmp(header->magic, ACCUMULATOR_MAGIC, 8) == 0 && header->version == ACCUMULATOR_VERSION &&
+             header->width == (uint32_t)width && header->height == (uint32_t)height &&
+             header->tileSize == (uint32_t)tileSize && header->key == key && header->tiles == tiles;
+    if (!resume) memset(map, 0, size);
+  }
+  if (!resume) {
+    memcpy(header->magic, ACCUMULATOR_MAGIC, 8);
+    header->version = ACCUMULATOR_VERSION;
+    header->width = (uint32_t)width;
+    header->height = (uint32_t)height;
+    header->tileSize = (uint32_t)tileSize;
+    header->key = key;
+    header->tiles = tiles;
+    return 0;
+  }
+  int resumed = 0;
+  for (uint32_t t = 0; t < tiles; ++t) {
+    if (tileSamples[t] == TILE_IN_PROGRESS) clearTile((int)t);
+    if (tileSamples[t] > 0) resumed++;
+  }
+  return resumed;
+}
+
+int Accumulator::tileAt(int x, int y) const {
+  return (y / (int)header->tileSize) * tilesX + x / (int)header->tileSize;
+}
+
+uint32_t Accumulator::samples(int tile) const {
+  return tileSamples[tile];
+}
+
+void Accumulator::clearTile(int tile) {
+  int tileSize = (int)header->tileSize;
+  int x0 = (tile % tilesX) * tileSize;
+  int y0 = (tile / tilesX) * tileSize;
+  for (int y = y0; y < y0 + tileSize && y < (int)header->height; ++y) {
+    for (int x = x0; x < x0 + tileSize && x < (int)header->width; ++x) {
+      memset(&pixels[(size_t)y * header->width + x], 0, sizeof(Pixel));
+    }
+  }
+  tileSamples[tile] = 0;
+}
+
+void Accumulator::beginTile(int tile) {
+  tileSamples[tile] = TILE_IN_PROGRESS;
+  std::atomic_thread_fence(std::memory_order_release);
+}
+
+void Accumulator::add(int x, int y, glm::vec3 sum, uint32_t count) {
+  Pixel& pixel = pixels[(size_t)y * header->width + x];
+  for (int c = 0; c < 3; ++c) {
+    pixel.sum[c] += sum[c];
+  }
+  pixel.count += count;
+}
+
+void Accumulator::endTile(int tile, uint32_t samples) {
+  std::atomic_thread_fence(std::memory_order_release);
+  tileSamples[tile] = samples;
+}
+
+glm::vec3 Accumulator::mean(int x, int y) const {
+  const Pixel& pixel = pixels[(size_t)y * header->width + x];
+  if (pixel.count == 0) return glm::vec3(0);
+  return glm::vec3(pixel.sum[0], pixel.sum[1], pixel.sum[2]) / (float)pixel.count;
+}
+
+void Accumulator::flush(bool sync) {
+  if (map) msync(map, size, sync ? MS_SYNC : MS_ASYNC);
+}
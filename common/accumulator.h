@@ -0,0 +1,62 @@
+#ifndef GRAPHICS_ACCUMULATOR_H
+#define GRAPHICS_ACCUMULATOR_H
+
+#include <cstdint>
+#include <cstddef>
+
+#include <glm/glm.hpp>
+
+/**
+ * HDR accumulation buffer holding the color sum and sample count of every pixel, plus the number
+ * of samples per pixel every tile has finished. It lives in a memory-mapped checkpoint file, so a
+ * render that is killed keeps its finished tiles and a finished frame can take more samples later.
+ */
+class Accumulator {
+private:
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t width, height;
+        uint32_t tileSize;
+        uint64_t key;
+        uint32_t tiles;
+        uint32_t reserved[5];
+    };
+    struct Pixel {
+        float sum[3];
+        uint32_t count;
+    };
+    int fd;
+    void* map;
+    size_t size;
+    Header* header;
+    uint32_t* tileSamples;
+    Pixel* pixels;
+    int tilesX;
+    void clearTile(int tile);
+public:
+    Accumulator() : fd(-1), map(nullptr), size(0), header(nullptr), tileSamples(nullptr), pixels(nullptr), tilesX(0) {};
+    ~Accumulator();
+    /**
+     * Map the checkpoint at path, creating it when it is missing or belongs to another frame
+     * @param path
+     * @param width
+     * @param height
+     * @param tileSize
+     * @param key identifies the frame, a checkpoint with another key is started over
+     * @return number of tiles with samples to resume from, or -1 when the file cannot be mapped
+     */
+    int open(const char* path, int width, int height, int tileSize, uint64_t key);
+    int tileAt(int x, int y) const;
+    // Samples per pixel the tile has finished
+    uint32_t samples(int tile) const;
+    // A tile is marked in progress while its pixels change, so a kill in between restarts it from scratch
+    void beginTile(int tile);
+    void add(int x, int y, glm::vec3 sum, uint32_t count);
+    void endTile(int tile, uint32_t samples);
+    glm::vec3 mean(int x, int y) const;
+    // Write dirty pages back, waiting for the disk when sync is set
+    void flush(bool sync);
+};
+
+#endif //GRAPHICS_ACCUMULATOR_H
@@ -0,0 +1,200 @@
+#include "bvh.h"
+
+#include <algorithm>
+
+#define SAH_TRAVERSAL_COST 1.0f
+#define SAH_INTERSECT_COST 1.0f
+#define BVH_MAX_DEPTH 32
+
+void AABB::extend(glm::vec3 p) {
+  min = glm::min(min, p);
+  max = glm::max(max, p);
+}
+
+void AABB::extend(const AABB &box) {
+  min = glm::min(min, box.min);
+  max = glm::max(max, box.max);
+}
+
+float AABB::area() const {
+  if (empty()) return 0.0f;
+  glm::vec3 d = max - min;
+  return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
+// Range of a*b for a in [a0, a1] and b in [b0, b1]
+static void intervalProduct(float a0, float a1, float b0, float b1, float& lo, float& hi) {
+  float p0 = a0 * b0, p1 = a0 * b1, p2 = a1 * b0, p3 = a1 * b1;
+  lo = std::min(std::min(p0, p1), std::min(p2, p3));
+  hi = std::max(std::max(p0, p1), std::max(p2, p3));
+}
+
+/**
+ * Slab test in interval arithmetic over the origins and inverse directions of the packet.
+ * The entry distance is bounded from below and the exit distance from above for every lane at once.
+ * @param packet a coherent packet
+ * @return
+ */
+bool AABB::mayIntersect(const RayPacket &packet) const {
+  float tnear = 0.0f;
+  float tfar = INFINITY;
+  for (int a = 0; a < 3; ++a) {
+    bool positive = packet.invMin[a] > 0.0f;
+    float entry = positive ? min[a] : max[a];
+    float exit = positive ? max[a] : min[a];
+    float lo, hi, unused;
+    intervalProduct(entry - packet.originMax[a], entry - packet.originMin[a], packet.invMin[a], packet.invMax[a], lo, unused);
+    intervalProduct(exit - packet.originMax[a], exit - packet.originMin[a], packet.invMin[a], packet.invMax[a], unused, hi);
+    tnear = std::max(tnear, lo);
+    tfar = std::min(tfar, hi);
+  }
+  return tnear <= tfar;
+}
+
+void BVH::build(const std::vector<AABB> &boxes, size_t maxLeafSize, size_t packSize) {
+  this->maxLeafSize = maxLeafSize;
+  this->packSize = packSize;
+  nodes.clear();
+  indices.resize(boxes.size());
+  builtCost = 0.0f;
+  if (boxes.empty()) return;
+  std::vector<glm::vec3> centers;
+  centers.reserve(boxes.size());
+  for (uint32_t i = 0; i < boxes.size(); ++i) {
+    indices[i] = i;
+    centers.push_back(boxes[i].center());
+  }
+  nodes.reserve(boxes.size() * 2);
+  BVHNode root;
+  root.first = 0;
+  root.count = (uint32_t)boxes.size();
+  nodes.push_back(root);
+  subdivide(0, boxes, centers, 0);
+  builtCost = cost();
+}
+
+// Children come after their parent, so one backward pass sees every child before its parent
+void BVH::refit(const std::vector<AABB> &boxes) {
+  for (size_t n = nodes.size(); n-- > 0;) {
+    BVHNode& node = nodes[n];
+    AABB bounds;
+    if (node.leaf()) {
+      for (uint32_t i = node.first; i < node.first + node.count; ++i) {
+        bounds.extend(boxes[indices[i]]);
+      }
+    }
+    else {
+      bounds.extend(nodes[n + 1].bounds);
+      bounds.extend(nodes[node.first].bounds);
+    }
+    node.bounds = bounds;
+  }
+}
+
+float BVH::cost() const {
+  if (nodes.empty()) return 0.0f;
+  float root = nodes[0].bounds.area();
+  if (root <= 0.0f) return 0.0f;
+  float sum = 0.0f;
+  for (auto const & node: nodes) {
+    sum += node.bounds.area() * (node.leaf() ? SAH_INTERSECT_COST * packs(node.count) : SAH_TRAVERSAL_COST);
+  }
+  return sum / root;
+}
+
+/**
+ * Split a leaf node with the binned surface area heuristic
+ * @param node index of a leaf node covering indices [first, first + count)
+ * @param boxes primitive bounds
+ * @param centers primitive centroids
+ * @param depth
+ */
+void BVH::subdivide(uint32_t node, const std::vector<AABB> &boxes, const std::vector<glm::vec3> &centers, int depth) {
+  uint32_t first = nodes[node].first;
+  uint32_t count = nodes[node].count;
+  AABB bounds, centroidBounds;
+  for (uint32_t i = first; i < first + count; ++i) {
+    bounds.extend(boxes[indices[i]]);
+    centroidBounds.extend(centers[indices[i]]);
+  }
+  nodes[node].bounds = bounds;
+  if (count <= 1) return;
+
+  int axis = -1;
+  int split = 0;
+  float bestCost = INFINITY;
+  glm::vec3 extent = centroidBounds.max - centroidBounds.min;
+  for (int a = 0; a < 3; ++a) {
+    if (extent[a] <= 0.0f) continue;
+    AABB binBounds[BVH_BINS];
+    uint32_t binCount[BVH_BINS] = {0};
+    float scale = BVH_BINS / extent[a];
+    for (uint32_t i = first; i < first + count; ++i) {
+      int b = std::min(BVH_BINS - 1, (int)((centers[indices[i]][a] - centroidBounds.min[a]) * scale));
+      binBounds[b].extend(boxes[indices[i]]);
+      binCount[b]++;
+    }
+    // Sweep from the right to get the cost of every right partition
+    float rightArea[BVH_BINS];
+    uint32_t rightCount[BVH_BINS];
+    AABB acc;
+    uint32_t n = 0;
+    for (int b = BVH_BINS - 1; b > 0; --b) {
+      acc.extend(binBounds[b]);
+      n += binCount[b];
+      rightArea[b] = acc.area();
+      rightCount[b] = n;
+    }
+    acc = AABB();
+    n = 0;
+    for (int b = 1; b < BVH_BINS; ++b) {
+      acc.extend(binBounds[b - 1]);
+      n += binCount[b - 1];
+      if (n == 0 || rightCount[b] == 0) continue;
+      float cost = acc.area() * packs(n) + rightArea[b] * packs(rightCount[b]);
+      if (cost < bestCost) {
+        bestCost = cost;
+        axis = a;
+        split = b;
+      }
+    }
+  }
+
+  uint32_t mid;
+  float leafCost = SAH_INTERSECT_COST * packs(count);
+  bestCost = SAH_TRAVERSAL_COST + SAH_INTERSECT_COST * bestCost / bounds.area();
+  if (axis >= 0 && depth < BVH_MAX_DEPTH) {
+    if (bestCost >= leafCost && count <= maxLeafSize) return;
+    float scale = BVH_BINS / extent[axis];
+    float lo = centroidBounds.min[axis];
+    auto it = std::partition(indices.begin() + first, indices.begin() + first + count, [&](uint32_t i) {
+      return std::min(BVH_BINS - 1, (int)((centers[i][axis] - lo) * scale)) < split;
+    });
+    mid = (uint32_t)(it - indices.begin());
+  }
+  else {
+    if (count <= maxLeafSize) return;
+    // Centroids coincide or the tree is too deep: fall back to a median split
+    int a = 0;
+    if (extent.y > extent[a]) a = 1;
+    if (extent.z > extent[a]) a = 2;
+    mid = first + count / 2;
+    std::nth_element(indices.begin() + first, indices.begin() + mid, indices.begin() + first + count,
+                     [&](uint32_t i, uint32_t j) { return centers[i][a] < centers[j][a]; });
+  }
+
+  BVHNode left, right;
+  left.first = first;
+  left.count = mid - first;
+  right.first = mid;
+  right.count = first + count - mid;
+
+  uint32_t l = (uint32_t)nodes.size();
+  nodes.push_back(left);
+  subdivide(l, boxes, centers, depth + 1);
+  uint32_t r = (uint32_t)nodes.size();
+  nodes.push_back(right);
+  subdivide(r, boxes, centers, depth + 1);
+  nodes[node].first = r;
+  nodes[node].count = 0;
+}
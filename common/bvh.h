@@ -0,0 +1,212 @@
+#ifndef GRAPHICS_BVH_H
+#define GRAPHICS_BVH_H
+
+#include <vector>
+#include <cstdint>
+#include <cmath>
+#include <utility>
+
+#include <glm/glm.hpp>
+
+#include "packet.h"
+
+#define BVH_STACK_SIZE 96
+#define BVH_BINS 16
+
+class AABB {
+public:
+    glm::vec3 min;
+    glm::vec3 max;
+    AABB() : min(INFINITY), max(-INFINITY) {};
+    AABB(glm::vec3 min, glm::vec3 max) : min(min), max(max) {};
+    void extend(glm::vec3 p);
+    void extend(const AABB& box);
+    glm::vec3 center() const { return (min + max) * 0.5f; }
+    float area() const;
+    bool empty() const { return min.x > max.x || min.y > max.y || min.z > max.z; }
+    // Slab test, returns the entry distance in tnear when the box is hit before tmax
+    inline bool intersect(glm::vec3 origin, glm::vec3 invDir, float tmax, float& tnear) const {
+      glm::vec3 t0 = (min - origin) * invDir;
+      glm::vec3 t1 = (max - origin) * invDir;
+      glm::vec3 lo = glm::min(t0, t1);
+      glm::vec3 hi = glm::max(t0, t1);
+      tnear = glm::max(glm::max(lo.x, lo.y), glm::max(lo.z, 0.0f));
+      float tfar = glm::min(glm::min(hi.x, hi.y), glm::min(hi.z, tmax));
+      return tnear <= tfar;
+    }
+    // Slab test of the lanes in mask, returns the lanes that hit the box before their tmax
+    inline int intersect(const RayPacket& packet, int mask) const {
+      floatv tnear(0.0f);
+      floatv tfar = floatv::load(packet.tmax);
+      for (int a = 0; a < 3; ++a) {
+        floatv o = floatv::load(packet.origin[a]);
+        floatv inv = floatv::load(packet.invDirection[a]);
+        floatv t0 = (floatv(min[a]) - o) * inv;
+        floatv t1 = (floatv(max[a]) - o) * inv;
+        tnear = vmax(tnear, vmin(t0, t1));
+        tfar = vmin(tfar, vmax(t0, t1));
+      }
+      return (tnear <= tfar).bits() & mask;
+    }
+    // Frustum test of a coherent packet from its bounds, false only when no lane can hit the box
+    bool mayIntersect(const RayPacket& packet) const;
+};
+
+// Interior nodes store their left child right after themselves and the right child at `first`.
+// Leaves store `count` primitives starting at `first` in BVH::indices.
+struct BVHNode {
+    AABB bounds;
+    uint32_t first;
+    uint32_t count;
+    bool leaf() const { return count != 0; }
+};
+
+class BVH {
+private:
+    void subdivide(uint32_t node, const std::vector<AABB>& boxes, const std::vector<glm::vec3>& centers, int depth);
+    size_t maxLeafSize;
+    size_t packSize;
+    float builtCost;
+    // Intersection tests for count primitives at a leaf
+    float packs(uint32_t count) const { return (float)((count + packSize - 1) / packSize); }
+public:
+    std::vector<BVHNode> nodes;
+    std::vector<uint32_t> indices;
+
+    BVH() : maxLeafSize(4), packSize(1), builtCost(0.0f) {};
+    // Leaves tested packSize primitives at a time are costed per pack by the surface area heuristic
+    void build(const std::vector<AABB>& boxes, size_t maxLeafSize = 4, size_t packSize = 1);
+    // Fit the bounds of every node to moved primitives, keeping the tree as it is
+    void refit(const std::vector<AABB>& boxes);
+    // Expected cost of a ray through the tree by the surface area heuristic, grows as refits loosen it
+    float cost() const;
+    // cost() right after the last build
+    float buildCost() const { return builtCost; }
+    bool empty() const { return nodes.empty(); }
+    AABB bounds() const { return nodes.empty() ? AABB() : nodes[0].bounds; }
+
+    // Closest-hit traversal. visit(primitive, tmax) tests one primitive and shrinks tmax on a hit.
+    template <typename F>
+    void traverse(glm::vec3 origin, glm::vec3 direction, float& tmax, F&& visit) const;
+    // Same, but visitLeaf(node, tmax) gets the index of each leaf node to test as a whole.
+    template <typename F>
+    void traverseLeaves(glm::vec3 origin, glm::vec3 direction, float& tmax, F&& visitLeaf) const;
+    // Any-hit traversal. visit(primitive, tmax) returns true when the primitive blocks the ray.
+    template <typename F>
+    bool any(glm::vec3 origin, glm::vec3 direction, float tmax, F&& visit) const;
+    template <typename F>
+    bool anyLeaves(glm::vec3 origin, glm::vec3 direction, float tmax, F&& visitLeaf) const;
+    // Closest-hit traversal of the lanes in mask. visitLeaf(node, mask) tests the lanes that reached
+    // the leaf and shrinks packet.tmax for the lanes it hits.
+    template <typename F>
+    void traversePacket(RayPacket& packet, int mask, F&& visitLeaf) const;
+};
+
+template <typename F>
+void BVH::traverseLeaves(glm::vec3 origin, glm::vec3 direction, float& tmax, F&& visitLeaf) const {
+  if (nodes.empty()) return;
+  glm::vec3 invDir = 1.0f / direction;
+  uint32_t stack[BVH_STACK_SIZE];
+  int top = 0;
+  float tnear;
+  if (!nodes[0].bounds.intersect(origin, invDir, tmax, tnear)) return;
+  stack[top++] = 0;
+  while (top > 0) {
+    uint32_t index = stack[--top];
+    const BVHNode& node = nodes[index];
+    if (node.leaf()) {
+      visitLeaf(index, tmax);
+      continue;
+    }
+    uint32_t left = index + 1;
+    uint32_t right = node.first;
+    float tl, tr;
+    bool hl = nodes[left].bounds.intersect(origin, invDir, tmax, tl);
+    bool hr = nodes[right].bounds.intersect(origin, invDir, tmax, tr);
+    // Push the farther child first so the nearer one is visited first
+    if (hl && hr) {
+      if (tl > tr) std::swap(left, right);
+      stack[top++] = right;
+      stack[top++] = left;
+    }
+    else if (hl) stack[top++] = left;
+    else if (hr) stack[top++] = right;
+  }
+}
+
+template <typename F>
+void BVH::traverse(glm::vec3 origin, glm::vec3 direction, float& tmax, F&& visit) const {
+  traverseLeaves(origin, direction, tmax, [&](uint32_t index, float& tmax) {
+    const BVHNode& node = nodes[index];
+    for (uint32_t i = node.first; i < node.first + node.count; ++i) {
+      visit(indices[i], tmax);
+    }
+  });
+}
+
+template <typename F>
+bool BVH::anyLeaves(glm::vec3 origin, glm::vec3 direction, float tmax, F&& visitLeaf) const {
+  if (nodes.empty()) return false;
+  glm::vec3 invDir = 1.0f / direction;
+  uint32_t stack[BVH_STACK_SIZE];
+  int top = 0;
+  float tnear;
+  stack[top++] = 0;
+  while (top > 0) {
+    uint32_t index = stack[--top];
+    const BVHNode& node = nodes[index];
+    if (!node.bounds.intersect(origin, invDir, tmax, tnear)) continue;
+    if (node.leaf()) {
+      if (visitLeaf(index, tmax)) return true;
+      continue;
+    }
+    stack[top++] = node.first;
+    stack[top++] = index + 1;
+  }
+  return false;
+}
+
+template <typename F>
+bool BVH::any(glm::vec3 origin, glm::vec3 direction, float tmax, F&& visit) const {
+  return anyLeaves(origin, direction, tmax, [&](uint32_t index, float tmax) {
+    const BVHNode& node = nodes[index];
+    for (uint32_t i = node.first; i < node.first + node.count; ++i) {
+      if (visit(indices[i], tmax)) return true;
+    }
+    return false;
+  });
+}
+
+template <typename F>
+void BVH::traversePacket(RayPacket& packet, int mask, F&& visitLeaf) const {
+  if (nodes.empty() || !mask) return;
+  uint32_t stack[BVH_STACK_SIZE];
+  int masks[BVH_STACK_SIZE];
+  int top = 0;
+  stack[top] = 0;
+  masks[top++] = mask;
+  while (top > 0) {
+    uint32_t index = stack[--top];
+    const BVHNode& node = nodes[index];
+    // Cull the whole packet before testing its lanes one by one
+    if (packet.coherent && !node.bounds.mayIntersect(packet)) continue;
+    int m = node.bounds.intersect(packet, masks[top]);
+    if (!m) continue;
+    if (node.leaf()) {
+      visitLeaf(index, m);
+      continue;
+    }
+    // Visit the child that lies first along the packet direction first
+    uint32_t left = index + 1;
+    uint32_t right = node.first;
+    if (glm::dot(nodes[right].bounds.center() - nodes[left].bounds.center(), packet.meanDirection) < 0.0f) {
+      std::swap(left, right);
+    }
+    stack[top] = right;
+    masks[top++] = m;
+    stack[top] = left;
+    masks[top++] = m;
+  }
+}
+
+#endif //GRAPHICS_BVH_H
@@ -0,0 +1,305 @@
+#include "distributed.h"
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <signal.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+static bool readAll(int fd, void* data, size_t size) {
+  char* p = (char*)data;
+  while (size > 0) {
+    ssize_t n = read(fd, p, size);
+    if (n <= 0) return false;
+    p += n;
+    size -= n;
+  }
+  return true;
+}
+
+// MSG_NOSIGNAL turns a closed peer into an error instead of SIGPIPE
+static bool writeAll(int fd, const void* data, size_t size) {
+  const char* p = (const char*)data;
+  while (size > 0) {
+    ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+    if (n <= 0) return false;
+    p += n;
+    size -= n;
+  }
+  return true;
+}
+
+Coordinator::~Coordinator() {
+  TileRequest quit = {};
+  quit.tile = -1;
+  for (auto & peer: peers) {
+    if (!peer.alive) continue;
+    // Only stragglers still hold tiles once the frame is done, their copies are not needed
+    if (!peer.inFlight.empty()) kill(peer.pid, SIGKILL);
+    else writeAll(peer.fd, &quit, sizeof(quit));
+    close(peer.fd);
+  }
+  for (auto & peer: peers) {
+    waitpid(peer.pid, NULL, 0);
+  }
+}
+
+bool Coordinator::start(int processes, int threads) {
+  fflush(stdout);
+  for (int i = 0; i < processes; ++i) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) break;
+    pid_t pid = fork();
+    if (pid < 0) {
+      close(fds[0]);
+      close(fds[1]);
+      break;
+    }
+    if (pid == 0) {
+      close(fds[0]);
+      for (auto & peer: peers) {
+        close(peer.fd);
+      }
+      serve(world, view, fds[1], threads);
+      close(fds[1]);
+      _exit(0);
+    }
+    close(fds[1]);
+    WorkerHello hello;
+    if (!readAll(fds[0], &hello, sizeof(hello))) {
+      close(fds[0]);
+      waitpid(pid, NULL, 0);
+      continue;
+    }
+    Peer peer;
+    peer.fd = fds[0];
+    peer.pid = pid;
+    peer.threads = hello.threads;
+    peer.alive = true;
+    peer.tiles = 0;
+    peer.pixels = 0;
+    peer.busy = 0.0;
+    peers.push_back(peer);
+  }
+  return !peers.empty();
+}
+
+/**
+ * Worker loop: renders every requested tile on a pool of threads and sends the sums back
+ * until the coordinator asks it to exit or goes away.
+ * @param world copy of the scene made by fork
+ * @param view
+ * @param fd socket to the coordinator
+ * @param threads
+ */
+void Coordinator::serve(const World& world, RenderJob view, int fd, int threads) {
+  view.accumulator = nullptr;
+  ThreadPool pool(threads);
+  std::mutex lock;
+  std::atomic<bool> broken(false);
+  WorkerHello hello = {pool.size()};
+  if (!writeAll(fd, &hello, sizeof(hello))) return;
+  TileRequest request;
+  while (!broken && readAll(fd, &request, sizeof(request)) && request.tile >= 0) {
+    pool.submit([&, request](int) {
+      auto begin = Clock::now();
+      const Tile& tile = request.bounds;
+      std::vector<glm::vec3> sums((size_t)(tile.x1 - tile.x0) * (tile.y1 - tile.y0));
+      RayStats::reset();
+      world.renderSums(view, tile, request.first, request.count, sums.data());
+      TileResult result;
+      result.tile = request.tile;
+      result.count = request.count;
+      result.seconds = std::chrono::duration<double>(Clock::now() - begin).count();
+      result.stats = RayStats::take();
+      std::lock_guard<std::mutex> guard(lock);
+      if (!writeAll(fd, &result, sizeof(result)) || !writeAll(fd, sums.data(), sums.size() * sizeof(glm::vec3))) {
+        broken = true;
+      }
+    });
+  }
+  pool.wait();
+}
+
+Coordinator::Band& Coordinator::band(int index) {
+  auto it = bands.find(index);
+  if (it != bands.end()) return it->second;
+  Band& band = bands[index];
+  band.image.resize(TILE_SIZE * view.width * 3);
+  band.job = view;
+  band.job.y0 = index * TILE_SIZE;
+  band.job.image = band.image.data();
+  band.remaining = (view.width + TILE_SIZE - 1) / TILE_SIZE;
+  return band;
+}
+
+void Coordinator::finish(int tile, const glm::vec3 *sums, int count) {
+  TileState& state = tiles[tile];
+  Band& b = band(state.bounds.y0 / TILE_SIZE);
+  world.finishTile(b.job, state.bounds, sums, count);
+  state.done = true;
+  b.remaining--;
+}
+
+bool Coordinator::send(Peer &peer, int tile) {
+  TileState& state = tiles[tile];
+  TileRequest request;
+  request.tile = tile;
+  request.bounds = state.bounds;
+  request.first = state.first;
+  request.count = world.samplesPerPixel - state.first;
+  if (!writeAll(peer.fd, &request, sizeof(request))) return false;
+  state.copies++;
+  state.sent = Clock::now();
+  peer.inFlight.push_back(tile);
+  return true;
+}
+
+bool Coordinator::receive(Peer &peer) {
+  TileResult result;
+  if (!readAll(peer.fd, &result, sizeof(result))) return false;
+  auto it = std::find(peer.inFlight.begin(), peer.inFlight.end(), result.tile);
+  if (it == peer.inFlight.end()) return false;
+  TileState& state = tiles[result.tile];
+  const Tile& bounds = state.bounds;
+  std::vector<glm::vec3> sums((size_t)(bounds.x1 - bounds.x0) * (bounds.y1 - bounds.y0));
+  if (!readAll(peer.fd, sums.data(), sums.size() * sizeof(glm::vec3))) return false;
+  peer.inFlight.erase(it);
+  state.copies--;
+  peer.busy += result.seconds;
+  peer.stats.add(result.stats);
+  tileSeconds += result.seconds;
+  results++;
+  // A duplicate of a tile that another worker already returned
+  if (state.done) return true;
+  finish(result.tile, sums.data(), result.count);
+  peer.tiles++;
+  peer.pixels += (long)sums.size();
+  return true;
+}
+
+// Oldest tile held by a single other worker for four times the average tile time, or -1
+int Coordinator::straggler(const Peer& peer, Clock::time_point now) const {
+  if (results == 0) return -1;
+  double threshold = 4.0 * tileSeconds / results;
+  int oldest = -1;
+  for (size_t t = 0; t < tiles.size(); ++t) {
+    const TileState& state = tiles[t];
+    if (state.done || state.copies != 1) continue;
+    if (std::find(peer.inFlight.begin(), peer.inFlight.end(), (int)t) != peer.inFlight.end()) continue;
+    if (std::chrono::duration<double>(now - state.sent).count() < threshold) continue;
+    if (oldest < 0 || state.sent < tiles[oldest].sent) oldest = (int)t;
+  }
+  return oldest;
+}
+
+// Keeps two tiles per worker thread in flight, so workers never wait for the next request
+void Coordinator::dispatch() {
+  Clock::time_point now = Clock::now();
+  for (auto & peer: peers) {
+    while (peer.alive && (int)peer.inFlight.size() < 2 * peer.threads) {
+      int tile = -1;
+      while (tile < 0 && !queue.empty()) {
+        tile = queue.front();
+        queue.pop_front();
+        if (tiles[tile].done) tile = -1;
+      }
+      if (tile < 0) tile = straggler(peer, now);
+      if (tile < 0) break;
+      if (!send(peer, tile)) drop(peer);
+    }
+  }
+}
+
+void Coordinator::drop(Peer &peer) {
+  peer.alive = false;
+  close(peer.fd);
+  kill(peer.pid, SIGKILL);
+  for (int tile: peer.inFlight) {
+    TileState& state = tiles[tile];
+    state.copies--;
+    if (!state.done && state.copies == 0) queue.push_front(tile);
+  }
+  printf("Worker %d stopped, %zu tiles handed to the others\n", (int)peer.pid, peer.inFlight.size());
+  peer.inFlight.clear();
+}
+
+void Coordinator::render(ImageWriter &writer, RayStats &stats) {
+  int width = view.width, height = view.height;
+  int tilesX = (width + TILE_SIZE - 1) / TILE_SIZE;
+  int bandCount = (height + TILE_SIZE - 1) / TILE_SIZE;
+  auto start = Clock::now();
+  RayStats::reset();
+  for (int b = 0; b < bandCount; ++b) {
+    for (int i = 0; i < tilesX; ++i) {
+      TileState state;
+      state.bounds = {i * TILE_SIZE, b * TILE_SIZE, std::min((i + 1) * TILE_SIZE, width), std::min((b + 1) * TILE_SIZE, height)};
+      state.first = world.tileProgress(view, state.bounds);
+      state.copies = 0;
+      state.done = false;
+      tiles.push_back(state);
+    }
+  }
+  for (size_t t = 0; t < tiles.size(); ++t) {
+    const Tile& bounds = tiles[t].bounds;
+    if (tiles[t].first < world.samplesPerPixel) {
+      queue.push_back((int)t);
+      continue;
+    }
+    // Checkpointed tiles that are already complete
+    std::vector<glm::vec3> sums((size_t)(bounds.x1 - bounds.x0) * (bounds.y1 - bounds.y0), glm::vec3(0));
+    finish((int)t, sums.data(), 0);
+  }
+
+  int next = 0;
+  std::vector<pollfd> fds;
+  std::vector<Peer*> polled;
+  while (next < bandCount) {
+    dispatch();
+    fds.clear();
+    polled.clear();
+    for (auto & peer: peers) {
+      if (!peer.alive) continue;
+      fds.push_back({peer.fd, POLLIN, 0});
+      polled.push_back(&peer);
+    }
+    if (fds.empty()) {
+      // Every worker is gone, the rest is rendered here
+      for (size_t t = 0; t < tiles.size(); ++t) {
+        TileState& state = tiles[t];
+        if (state.done) continue;
+        std::vector<glm::vec3> sums((size_t)(state.bounds.x1 - state.bounds.x0) * (state.bounds.y1 - state.bounds.y0));
+        int count = world.samplesPerPixel - state.first;
+        world.renderSums(view, state.bounds, state.first, count, sums.data());
+        finish((int)t, sums.data(), count);
+      }
+    }
+    else if (poll(fds.data(), fds.size(), 100) > 0) {
+      for (size_t i = 0; i < fds.size(); ++i) {
+        if (fds[i].revents && !receive(*polled[i])) drop(*polled[i]);
+      }
+    }
+    for (auto it = bands.find(next); it != bands.end() && it->second.remaining == 0; it = bands.find(next)) {
+      writer.writeRows(it->second.image.data(), std::min(TILE_SIZE, height - next * TILE_SIZE));
+      if (view.accumulator) view.accumulator->flush(false);
+      bands.erase(it);
+      next++;
+      if (next * 20 / bandCount > (next - 1) * 20 / bandCount) {
+        printf("%d%%\tdone...\n", next * 20 / bandCount * 5);
+      }
+    }
+  }
+  double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+
+  stats.add(RayStats::take());
+  for (size_t i = 0; i < peers.size(); ++i) {
+    const Peer& peer = peers[i];
+    printf("Worker %zu (pid %d, %d threads):\t%d tiles, %.0f pixels/s, busy %.0f%%%s\n", i, (int)peer.pid, peer.threads,
+           peer.tiles, elapsed > 0.0 ? peer.pixels / elapsed : 0.0,
+           elapsed > 0.0 ? 100.0 * peer.busy / (elapsed * peer.threads) : 0.0, peer.alive ? "" : ", stopped");
+    stats.add(peer.stats);
+  }
+}
@@ -0,0 +1,99 @@
+#ifndef GRAPHICS_DISTRIBUTED_H
+#define GRAPHICS_DISTRIBUTED_H
+
+#include <vector>
+#include <deque>
+#include <map>
+#include <chrono>
+#include <cstdint>
+#include <sys/types.h>
+
+#include <glm/glm.hpp>
+
+#include "raytracing.h"
+
+// Messages between the coordinator and its workers. Both ends run the same binary, so they are sent as laid out in memory.
+struct WorkerHello {
+    int32_t threads;
+};
+
+// Eye samples [first, first + count) of a tile, tile -1 asks the worker to exit
+struct TileRequest {
+    int32_t tile;
+    Tile bounds;
+    int32_t first, count;
+};
+
+// Followed by the sums of the tile, three floats per pixel row by row
+struct TileResult {
+    int32_t tile;
+    int32_t count;
+    double seconds;
+    RayStats stats;
+};
+
+/**
+ * Renders a frame on worker processes. Each worker is forked with a copy of the scene and talks to
+ * the coordinator over a local socket, so a worker on another node only needs the scene and the
+ * same stream. Workers render the tiles they are sent on their own thread pool and send back the
+ * float sums, which the coordinator merges, checkpoints and writes out band by band in order.
+ * Tiles of a worker that dies are sent to the others, and once no tile is left to hand out, tiles
+ * held by a worker for much longer than the average are duplicated to idle ones; the first
+ * result wins.
+ */
+class Coordinator {
+private:
+    typedef std::chrono::steady_clock Clock;
+    struct Peer {
+        int fd;
+        pid_t pid;
+        int threads;
+        bool alive;
+        std::vector<int> inFlight;
+        int tiles;
+        long pixels;
+        double busy;
+        RayStats stats;
+    };
+    struct TileState {
+        Tile bounds;
+        int first;
+        int copies;
+        bool done;
+        Clock::time_point sent;
+    };
+    struct Band {
+        RenderJob job;
+        std::vector<png_byte> image;
+        int remaining;
+    };
+    const World& world;
+    RenderJob view;
+    std::vector<Peer> peers;
+    std::vector<TileState> tiles;
+    std::deque<int> queue;
+    std::map<int, Band> bands;
+    double tileSeconds;
+    int results;
+    Band& band(int index);
+    void finish(int tile, const glm::vec3* sums, int count);
+    bool send(Peer& peer, int tile);
+    bool receive(Peer& peer);
+    int straggler(const Peer& peer, Clock::time_point now) const;
+    void dispatch();
+    void drop(Peer& peer);
+    static void serve(const World& world, RenderJob view, int fd, int threads);
+public:
+    Coordinator(const World& world, const RenderJob& view) : world(world), view(view), tileSeconds(0.0), results(0) {};
+    ~Coordinator();
+    // Fork the workers, false when none could be started
+    bool start(int processes, int threads);
+    /**
+     * Render the frame and write it out
+     * @param writer
+     * @param stats sum of the ray counters of every worker
+     */
+    void render(ImageWriter& writer, RayStats& stats);
+};
+
+#endif //GRAPHICS_DISTRIBUTED_H
@@ -0,0 +1,200 @@
+#include "image.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+
+png_byte cut(double value) {
+  if (value < 0.0) return 0;
+  else if (value > 255) return 255;
+  else return (png_byte)value;
+}
+
+static void putBigEndian(unsigned char* p, uint32_t value) {
+  p[0] = (unsigned char)(value >> 24);
+  p[1] = (unsigned char)(value >> 16);
+  p[2] = (unsigned char)(value >> 8);
+  p[3] = (unsigned char)value;
+}
+
+ImageFormat formatOf(const char *path) {
+  size_t length = strlen(path);
+  return length >= 4 && !strcmp(path + length - 4, ".ppm") ? ImageFormat::PPM : ImageFormat::PNG;
+}
+
+ImageWriter::ImageWriter(const char *path, int width, int height, ImageFormat format, int level)
+    : width(width), height(height), format(format), level(level), rows(0), adler(adler32(0L, Z_NULL, 0)), failed(false) {
+  fp = fopen(path, "wb");
+  if (fp == NULL) {
+    failed = true;
+    return;
+  }
+  if (format == ImageFormat::PPM) {
+    if (fprintf(fp, "P6\n%d %d\n255\n", width, height) < 0) failed = true;
+    return;
+  }
+  if (!validLevel(level)) failed = true;
+  static const unsigned char signature[8] = {137, 'P', 'N', 'G', '\r', '\n', 26, '\n'};
+  if (fwrite(signature, 1, sizeof(signature), fp) != sizeof(signature)) failed = true;
+
+  // Header: 8 bit colour depth, RGB, deflate, adaptive filtering, not interlaced
+  unsigned char header[13];
+  putBigEndian(header, (uint32_t)width);
+  putBigEndian(header + 4, (uint32_t)height);
+  header[8] = 8;
+  header[9] = 2;
+  header[10] = header[11] = header[12] = 0;
+  writeChunk("IHDR", header, sizeof(header));
+
+  // Set title
+  static const char title[] = "Title\0Graphics";
+  writeChunk("tEXt", (const unsigned char*)title, sizeof(title) - 1);
+
+  // zlib stream header, FLEVEL only tells decoders how hard the encoder tried
+  unsigned char cmf = 0x78;
+  unsigned char flevel = level == 0 || level == 1 ? 0 : level >= 2 && level <= 5 ? 1 : level == 6 || level < 0 ? 2 : 3;
+  unsigned char flg = (unsigned char)(flevel << 6);
+  flg += 31 - (cmf * 256 + flg) % 31;
+  unsigned char zlibHeader[2] = {cmf, flg};
+  writeChunk("IDAT", zlibHeader, sizeof(zlibHeader));
+}
+
+void ImageWriter::writeChunk(const char *type, const unsigned char *data, size_t length) {
+  unsigned char buffer[8];
+  putBigEndian(buffer, (uint32_t)length);
+  memcpy(buffer + 4, type, 4);
+  uLong crc = crc32(0L, Z_NULL, 0);
+  crc = crc32(crc, buffer + 4, 4);
+  if (length > 0) crc = crc32(crc, data, (uInt)length);
+  if (fwrite(buffer, 1, 8, fp) != 8) failed = true;
+  if (length > 0 && fwrite(data, 1, length, fp) != length) failed = true;
+  putBigEndian(buffer, (uint32_t)crc);
+  if (fwrite(buffer, 1, 4, fp) != 4) failed = true;
+}
+
+static int paeth(int a, int b, int c) {
+  int p = a + b - c;
+  int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+  if (pa <= pb && pa <= pc) return a;
+  return pb <= pc ? b : c;
+}
+
+/**
+ * PNG filter for one row, picked by the usual minimum sum of absolute differences
+ * @param row
+ * @param prior row above, or NULL for the first row of a band so bands stay independent
+ * @param length bytes per row
+ * @param out filter type followed by the filtered row
+ * @param candidate scratch space of length bytes
+ */
+static void filterRow(const png_byte* row, const png_byte* prior, int length, unsigned char* out, unsigned char* candidate) {
+  const int bpp = 3;
+  long best = -1;
+  int filters = prior ? 5 : 2;
+  for (int filter = 0; filter < filters; ++filter) {
+    long sum = 0;
+    for (int i = 0; i < length; ++i) {
+      int a = i >= bpp ? row[i - bpp] : 0;
+      int b = prior ? prior[i] : 0;
+      int c = prior && i >= bpp ? prior[i - bpp] : 0;
+      int predicted = 0;
+      switch (filter) {
+        case 1: predicted = a; break;
+        case 2: predicted = b; break;
+        case 3: predicted = (a + b) / 2; break;
+        case 4: predicted = paeth(a, b, c); break;
+      }
+      unsigned char value = (unsigned char)(row[i] - predicted);
+      candidate[i] = value;
+      sum += value < 128 ? value : 256 - value;
+    }
+    if (best < 0 || sum < best) {
+      best = sum;
+      out[0] = (unsigned char)filter;
+      memcpy(out + 1, candidate, length);
+    }
+  }
+}
+
+EncodedRows ImageWriter::encode(const png_byte *rows, int count, bool last) const {
+  EncodedRows encoded;
+  int stride = width * 3;
+  encoded.ok = true;
+  if (format == ImageFormat::PPM) {
+    encoded.data.assign(rows, rows + (size_t)count * stride);
+    encoded.adler = 0;
+    encoded.length = 0;
+    return encoded;
+  }
+  std::vector<unsigned char> filtered((size_t)count * (stride + 1));
+  std::vector<unsigned char> candidate(stride);
+  for (int y = 0; y < count; ++y) {
+    filterRow(rows + (size_t)y * stride, y > 0 ? rows + (size_t)(y - 1) * stride : NULL, stride,
+              &filtered[(size_t)y * (stride + 1)], candidate.data());
+  }
+  encoded.length = (uLong)filtered.size();
+  encoded.adler = adler32(adler32(0L, Z_NULL, 0), filtered.data(), (uInt)filtered.size());
+
+  // Raw deflate, the writer supplies the zlib header and trailer. Z_FILTERED suits filtered rows, as in libpng
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  if (deflateInit2(&stream, level, Z_DEFLATED, -15, 8, Z_FILTERED) != Z_OK) {
+    encoded.ok = false;
+    encoded.data.clear();
+    return encoded;
+  }
+  encoded.data.resize(deflateBound(&stream, (uLong)filtered.size()) + 16);
+  stream.next_in = filtered.data();
+  stream.avail_in = (uInt)filtered.size();
+  stream.next_out = encoded.data.data();
+  stream.avail_out = (uInt)encoded.data.size();
+  // A sync flush ends on a byte boundary, so the next band's blocks can follow directly
+  int status = deflate(&stream, last ? Z_FINISH : Z_SYNC_FLUSH);
+  encoded.ok = last ? status == Z_STREAM_END : status == Z_OK && stream.avail_in == 0;
+  encoded.data.resize(stream.total_out);
+  // A band that ends in a sync flush leaves an unfinished stream, which deflateEnd reports as Z_DATA_ERROR
+  if (deflateEnd(&stream) == Z_STREAM_ERROR) encoded.ok = false;
+  return encoded;
+}
+
+void ImageWriter::write(const EncodedRows &encoded, int count) {
+  if (failed || fp == NULL) return;
+  if (!encoded.ok) {
+    failed = true;
+    return;
+  }
+  rows += count;
+  if (format == ImageFormat::PPM) {
+    if (fwrite(encoded.data.data(), 1, encoded.data.size(), fp) != encoded.data.size()) failed = true;
+    if (rows >= height) close();
+    return;
+  }
+  adler = adler32_combine(adler, encoded.adler, encoded.length);
+  writeChunk("IDAT", encoded.data.data(), encoded.data.size());
+  if (rows < height) return;
+  unsigned char trailer[4];
+  putBigEndian(trailer, (uint32_t)adler);
+  writeChunk("IDAT", trailer, sizeof(trailer));
+  writeChunk("IEND", NULL, 0);
+  close();
+}
+
+// Buffered data only reaches the file in fclose, so its result decides whether the image was written
+void ImageWriter::close() {
+  if (fclose(fp) != 0) failed = true;
+  fp = NULL;
+}
+
+void ImageWriter::writeRows(const png_byte *rows, int count) {
+  write(encode(rows, count, this->rows + count >= height), count);
+}
+
+ImageWriter::~ImageWriter() {
+  if (fp != NULL) fclose(fp);
+}
+
+bool writePNG(const char *path, int width, int height, const png_byte *image) {
+  ImageWriter writer(path, width, height);
+  writer.writeRows(image, height);
+  return writer.ok();
+}
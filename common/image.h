@@ -0,0 +1,63 @@
+#ifndef GRAPHICS_IMAGE_H
+#define GRAPHICS_IMAGE_H
+
+#include <cstdio>
+#include <vector>
+#include <png.h>
+#include <zlib.h>
+
+png_byte cut(double value);
+
+enum class ImageFormat {
+    PNG,
+    // Binary PPM, uncompressed and cheap to write, for pipelines that re-encode anyway
+    PPM
+};
+
+// PPM for paths ending in .ppm, PNG for any other
+ImageFormat formatOf(const char* path);
+
+// Rows of an image encoded independently of the rest, ready to be appended in order.
+// For PNG they are filtered and deflated, ending in a sync flush unless they are the last rows.
+struct EncodedRows {
+    std::vector<unsigned char> data;
+    uLong adler;
+    uLong length;
+    // False when zlib failed, the writer then fails too
+    bool ok;
+};
+
+/**
+ * Writes an 8-bit RGB image in bands of rows, top to bottom. The bands can be encoded on any
+ * thread in parallel, since each PNG band is filtered and deflated on its own as in pigz, and
+ * the writer joins the deflate streams into one zlib stream while appending them.
+ */
+class ImageWriter {
+private:
+    FILE* fp;
+    int width, height;
+    ImageFormat format;
+    int level;
+    int rows;
+    uLong adler;
+    bool failed;
+    void writeChunk(const char* type, const unsigned char* data, size_t length);
+    void close();
+public:
+    // level is the zlib compression level, -1 (the zlib default) to 9
+    static bool validLevel(int level) { return level >= -1 && level <= 9; }
+    ImageWriter(const char* path, int width, int height, ImageFormat format = ImageFormat::PNG, int level = Z_DEFAULT_COMPRESSION);
+    ~ImageWriter();
+    // False once anything failed, the file is closed and checked after the last band
+    bool ok() const { return !failed; }
+    // Encode count packed rows, last marks the band that ends the image. Safe to call from any thread.
+    EncodedRows encode(const png_byte* rows, int count, bool last) const;
+    // Append the next band, bands must come in order
+    void write(const EncodedRows& rows, int count);
+    void writeRows(const png_byte* rows, int count);
+};
+
+// Write a packed 8-bit RGB buffer as a PNG file
+bool writePNG(const char* path, int width, int height, const png_byte* image);
+
+#endif //GRAPHICS_IMAGE_H
@@ -0,0 +1,109 @@
+#include "instance.h"
+
+#include <algorithm>
+
+void Animation::add(float time, glm::vec3 translation, glm::quat rotation, glm::vec3 scale) {
+  Key key = {time, translation, glm::normalize(rotation), scale};
+  auto it = std::upper_bound(keys.begin(), keys.end(), time, [](float t, const Key& k) { return t < k.time; });
+  keys.insert(it, key);
+}
+
+glm::mat4 Animation::at(float time) const {
+  if (keys.empty()) return glm::mat4(1.0f);
+  auto it = std::upper_bound(keys.begin(), keys.end(), time, [](float t, const Key& k) { return t < k.time; });
+  const Key& a = it == keys.begin() ? keys.front() : *(it - 1);
+  const Key& b = it == keys.end() ? keys.back() : *it;
+  float f = b.time > a.time ? (time - a.time) / (b.time - a.time) : 0.0f;
+  glm::vec3 translation = glm::mix(a.translation, b.translation, f);
+  glm::quat rotation = glm::slerp(a.rotation, b.rotation, f);
+  glm::vec3 scale = glm::mix(a.scale, b.scale, f);
+  return glm::translate(translation) * glm::mat4_cast(rotation) * glm::scale(scale);
+}
+
+Instance::Instance(const Object *object, const Animation &animation)
+    : Object(*object), object(object), animation(animation) {
+  animate(0.0f);
+}
+
+bool Instance::animate(float time) {
+  transform = animation.at(time);
+  inverse = glm::inverse(transform);
+  normalMatrix = glm::transpose(glm::mat3(inverse));
+  AABB local = object->bounds();
+  AABB moved;
+  for (int corner = 0; corner < 8; ++corner) {
+    glm::vec3 p = glm::vec3(corner & 1 ? local.max.x : local.min.x, corner & 2 ? local.max.y : local.min.y, corner & 4 ? local.max.z : local.min.z);
+    moved.extend(glm::vec3(transform * glm::vec4(p, 1.0f)));
+  }
+  bool changed = moved.min != box.min || moved.max != box.max;
+  box = moved;
+  return changed;
+}
+
+/**
+ * The ray in the space of the object, with a unit direction as every object expects
+ * @param r
+ * @param scale object space distance per world space distance along the ray
+ * @return
+ */
+Ray Instance::toObject(const Ray &r, float &scale) const {
+  glm::vec3 direction = glm::vec3(inverse * glm::vec4(r.direction, 0.0f));
+  scale = glm::length(direction);
+  Ray ray(glm::vec3(inverse * glm::vec4(r.origin, 1.0f)), direction, r.n);
+  ray.width = r.width * scale;
+  ray.spread = r.spread;
+  return ray;
+}
+
+std::experimental::optional<Hit> Instance::intersect(const Ray &r, float tmax) const {
+  float scale;
+  Ray local = toObject(r, scale);
+  auto hit = object->intersect(local, tmax * scale);
+  if (!hit) return hit;
+  hit->distance /= scale;
+  hit->point = r.origin + r.direction * hit->distance;
+  hit->object = this;
+  return hit;
+}
+
+void Instance::surface(const Ray &r, Hit &hit) const {
+  float scale;
+  Ray ray = toObject(r, scale);
+  Hit local = hit;
+  local.distance = hit.distance * scale;
+  local.point = ray.origin + ray.direction * local.distance;
+  object->surface(ray, local);
+  hit.geometricNormal = glm::normalize(normalMatrix * local.geometricNormal);
+  hit.shadingNormal = glm::normalize(normalMatrix * local.shadingNormal);
+  hit.uv = local.uv;
+  hit.uvFootprint = local.uvFootprint;
+}
+
+bool Instance::occluded(const Ray &r, float tmax) const {
+  float scale;
+  Ray local = toObject(r, scale);
+  return object->occluded(local, tmax * scale);
+}
+
+void Instance::intersectPacket(RayPacket &packet, int mask) const {
+  RayPacket local;
+  float scale[SIMD_WIDTH];
+  for (int lane = firstLane(mask), m = mask; lane >= 0; m &= m - 1, lane = firstLane(m)) {
+    glm::vec3 origin = glm::vec3(packet.origin[0][lane], packet.origin[1][lane], packet.origin[2][lane]);
+    glm::vec3 direction = glm::vec3(packet.direction[0][lane], packet.direction[1][lane], packet.direction[2][lane]);
+    direction = glm::vec3(inverse * glm::vec4(direction, 0.0f));
+    scale[lane] = glm::length(direction);
+    local.set(lane, glm::vec3(inverse * glm::vec4(origin, 1.0f)), direction / scale[lane]);
+    local.tmax[lane] = packet.tmax[lane] * scale[lane];
+  }
+  local.prepare();
+  object->intersectPacket(local, mask);
+  for (int lane = firstLane(mask); lane >= 0; mask &= mask - 1, lane = firstLane(mask)) {
+    if (!local.object[lane]) continue;
+    packet.tmax[lane] = local.tmax[lane] / scale[lane];
+    packet.primitive[lane] = local.primitive[lane];
+    packet.u[lane] = local.u[lane];
+    packet.v[lane] = local.v[lane];
+    packet.object[lane] = this;
+  }
+}
@@ -0,0 +1,52 @@
+#ifndef GRAPHICS_INSTANCE_H
+#define GRAPHICS_INSTANCE_H
+
+#include <vector>
+
+#include <glm/glm.hpp>
+#include <glm/ext.hpp>
+
+#include "object.h"
+
+// Transform keyed over time. Translation, rotation and scale are interpolated separately and
+// composed as translate * rotate * scale. Before the first key and after the last it holds still.
+class Animation {
+private:
+    struct Key {
+        float time;
+        glm::vec3 translation;
+        glm::quat rotation;
+        glm::vec3 scale;
+    };
+    std::vector<Key> keys;
+public:
+    void add(float time, glm::vec3 translation, glm::quat rotation = glm::quat(1.0f, 0.0f, 0.0f, 0.0f), glm::vec3 scale = glm::vec3(1.0f));
+    glm::mat4 at(float time) const;
+    bool empty() const { return keys.empty(); }
+};
+
+/**
+ * Object placed in the world by an animated transform. Rays are moved into the space of the object
+ * instead of the object into the world, so posing it for another frame only changes its bounds in
+ * the scene BVH and never rebuilds the object itself. The instance starts with the material of the
+ * object and can be given its own; the object is then only used for its shape.
+ */
+class Instance final : public Object {
+private:
+    const Object* object;
+    Animation animation;
+    glm::mat4 transform, inverse;
+    glm::mat3 normalMatrix;
+    AABB box;
+    Ray toObject(const Ray& r, float& scale) const;
+public:
+    Instance(const Object* object, const Animation& animation);
+    bool animate(float time);
+    std::experimental::optional<Hit> intersect(const Ray& r, float tmax = INFINITY) const;
+    void surface(const Ray& r, Hit& hit) const;
+    bool occluded(const Ray& r, float tmax) const;
+    void intersectPacket(RayPacket& packet, int mask) const;
+    AABB bounds() const { return box; }
+};
+
+#endif //GRAPHICS_INSTANCE_H
@@ -0,0 +1,45 @@
+#include "lighttable.h"
+
+#include <cassert>
+
+#include "object.h"
+
+void LightTable::build(const std::vector<glm::vec3> &positions, const std::vector<float> &powers) {
+  assert(positions.size() == powers.size());
+  count = positions.size();
+  // Padding lights have no power and sit far away, so their lanes stay finite and never contribute
+  size_t padded = (count + SIMD_WIDTH - 1) / SIMD_WIDTH * SIMD_WIDTH;
+  x.assign(padded, 1.0e6f);
+  y.assign(padded, 1.0e6f);
+  z.assign(padded, 1.0e6f);
+  power.assign(padded, 0.0f);
+  for (size_t i = 0; i < count; ++i) {
+    x[i] = positions[i].x;
+    y[i] = positions[i].y;
+    z[i] = positions[i].z;
+    power[i] = powers[i];
+  }
+}
+
+int LightTable::weights(size_t first, glm::vec3 q, glm::vec3 N, glm::vec3 V, float gloss, float *diffuse, float *specular) const {
+  floatv lx = floatv::load(&x[first]) - floatv(q.x);
+  floatv ly = floatv::load(&y[first]) - floatv(q.y);
+  floatv lz = floatv::load(&z[first]) - floatv(q.z);
+  floatv distance = vsqrt(lx * lx + ly * ly + lz * lz);
+  lx = lx / distance;
+  ly = ly / distance;
+  lz = lz / distance;
+  floatv falloff = floatv::load(&power[first]) / (distance * distance);
+  floatv nl = floatv(N.x) * lx + floatv(N.y) * ly + floatv(N.z) * lz;
+  maskv lit = nl > floatv(EPSILON);
+  select(lit, falloff * nl, floatv(0.0f)).store(diffuse);
+  // R = 2 (L.N) N - L, only its cosine with V is needed
+  floatv twoNl = nl + nl;
+  floatv rv = (twoNl * floatv(N.x) - lx) * floatv(V.x) + (twoNl * floatv(N.y) - ly) * floatv(V.y) + (twoNl * floatv(N.z) - lz) * floatv(V.z);
+  maskv shiny = rv > floatv(EPSILON);
+  // Lanes outside the highlight take the power of a harmless 1
+  floatv highlight = vpow(select(shiny, rv, floatv(1.0f)), floatv(gloss));
+  select(shiny, falloff * highlight, floatv(0.0f)).store(specular);
+  int valid = first + SIMD_WIDTH <= count ? (1 << SIMD_WIDTH) - 1 : (1 << (count - first)) - 1;
+  return (lit | shiny).bits() & valid;
+}
@@ -0,0 +1,35 @@
+#ifndef GRAPHICS_LIGHTTABLE_H
+#define GRAPHICS_LIGHTTABLE_H
+
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "simd.h"
+
+// Point lights in structure-of-arrays layout, padded to a multiple of SIMD_WIDTH so the
+// shading terms of SIMD_WIDTH lights are computed by one kernel call
+class LightTable {
+private:
+    std::vector<float> x, y, z, power;
+    size_t count;
+public:
+    LightTable() : count(0) {};
+    void build(const std::vector<glm::vec3>& positions, const std::vector<float>& powers);
+    size_t size() const { return count; }
+    /**
+     * Unshadowed Phong weights of lights [first, first + SIMD_WIDTH) at a shading point, to be
+     * multiplied by the diffuse and specular colors of the surface
+     * @param first multiple of SIMD_WIDTH
+     * @param q shading point
+     * @param N shading normal
+     * @param V unit vector towards the eye
+     * @param gloss specular exponent
+     * @param diffuse weight per lane, 0 for lights behind the surface
+     * @param specular weight per lane, 0 outside the highlight
+     * @return lanes with a nonzero weight
+     */
+    int weights(size_t first, glm::vec3 q, glm::vec3 N, glm::vec3 V, float gloss, float* diffuse, float* specular) const;
+};
+
+#endif //GRAPHICS_LIGHTTABLE_H
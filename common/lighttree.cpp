@@ -0,0 +1,57 @@
+#include "lighttree.h"
+
+#include <cassert>
+
+#define LIGHT_MIN_DISTANCE2 1.0e-4f
+
+void LightTree::build(const std::vector<glm::vec3> &positions, const std::vector<float> &powers) {
+  assert(positions.size() == powers.size());
+  std::vector<AABB> boxes;
+  boxes.reserve(positions.size());
+  for (auto const & p: positions) {
+    boxes.push_back(AABB(p, p));
+  }
+  bvh.build(boxes, 1);
+  // Children come after their parent, so a reverse sweep sees them first
+  power.assign(bvh.nodes.size(), 0.0f);
+  for (size_t n = bvh.nodes.size(); n-- > 0;) {
+    const BVHNode& node = bvh.nodes[n];
+    if (node.leaf()) power[n] = powers[bvh.indices[node.first]];
+    else power[n] = power[n + 1] + power[node.first];
+  }
+}
+
+float LightTree::importance(uint32_t node, glm::vec3 p) const {
+  // Clamp to the cluster size so a point inside a cluster does not favour it without bound
+  const AABB& box = bvh.nodes[node].bounds;
+  glm::vec3 d = box.center() - p;
+  glm::vec3 extent = box.max - box.min;
+  float distance2 = glm::max(glm::dot(d, d), 0.25f * glm::dot(extent, extent));
+  return power[node] / glm::max(distance2, LIGHT_MIN_DISTANCE2);
+}
+
+uint32_t LightTree::sample(glm::vec3 p, float u, float &pdf) const {
+  uint32_t n = 0;
+  pdf = 1.0f;
+  while (!bvh.nodes[n].leaf()) {
+    uint32_t left = n + 1;
+    uint32_t right = bvh.nodes[n].first;
+    float il = importance(left, p);
+    float ir = importance(right, p);
+    float pl = (il + ir > 0.0f) ? il / (il + ir) : 0.5f;
+    // Never let a child become impossible to pick, or the estimate would be biased
+    pl = glm::clamp(pl, 0.01f, 0.99f);
+    if (u < pl) {
+      u /= pl;
+      pdf *= pl;
+      n = left;
+    }
+    else {
+      u = (u - pl) / (1.0f - pl);
+      pdf *= 1.0f - pl;
+      n = right;
+    }
+    u = glm::min(u, 0.99999994f);
+  }
+  return bvh.indices[bvh.nodes[n].first];
+}
@@ -0,0 +1,30 @@
+#ifndef GRAPHICS_LIGHTTREE_H
+#define GRAPHICS_LIGHTTREE_H
+
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "bvh.h"
+
+// Binary hierarchy over point lights, used to pick lights with probability
+// proportional to an estimate of their contribution at a shading point
+class LightTree {
+private:
+    BVH bvh;
+    std::vector<float> power;
+    float importance(uint32_t node, glm::vec3 p) const;
+public:
+    void build(const std::vector<glm::vec3>& positions, const std::vector<float>& powers);
+    bool empty() const { return bvh.empty(); }
+    /**
+     * Walk down the tree choosing children by importance
+     * @param p shading point
+     * @param u uniform random number in [0, 1), reused at every level
+     * @param pdf probability of the returned light
+     * @return index of the chosen light
+     */
+    uint32_t sample(glm::vec3 p, float u, float& pdf) const;
+};
+
+#endif //GRAPHICS_LIGHTTREE_H
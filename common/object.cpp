@@ -2,207 +2,471 @@
 
 #define SQ(x) (x)*(x)
 
-Triangle::Triangle(glm::vec3 a, glm::vec3 b, glm::vec3 c) {
-  vertices.push_back(a);
-  vertices.push_back(b);
-  vertices.push_back(c);
-  normal = glm::normalize(glm::cross(b - a, c - a));
-  normals.push_back(normal);
-  normals.push_back(normal);
-  normals.push_back(normal);
-}
-
-Triangle::Triangle(glm::vec3 a, glm::vec3 b, glm::vec3 c, glm::vec3 na, glm::vec3 nb, glm::vec3 nc) {
-  vertices.push_back(a);
-  vertices.push_back(b);
-  vertices.push_back(c);
-  normal = -glm::normalize(glm::cross(b - a, c - a));
-  normals.push_back(normal);
-  normals.push_back(normal);
-  normals.push_back(normal);
-}
-
-bool Triangle::contains(glm::vec3 p) const {
-  glm::vec3 p0 = vertices[0] - p;
-  glm::vec3 p1 = vertices[1] - p;
-  glm::vec3 p2 = vertices[2] - p;
-  double a_ = glm::length(glm::cross(p1, p2));
-  double b_ = glm::length(glm::cross(p2, p0));
-  double c_ = glm::length(glm::cross(p0, p1));
-  double a = a_ / (a_ + b_ + c_);
-  double b = b_ / (a_ + b_ + c_);
-  double c = c_ / (a_ + b_ + c_);
-  return (a >= 0.0 && a <= 1.0 && b >= 0.0 && b <= 1.0 && c >= 0.0 && c <= 1.0);
-}
-
-std::experimental::optional<glm::vec3> Triangle::intersect(Ray r) const {
-  double s = glm::dot(normal, vertices[0] - r.origin) / glm::dot(normal, r.direction);
-  if (s < EPSILON) return {};
-  glm::vec3 p = r.origin + s * r.direction;
-  glm::vec3 n = glm::normalize(glm::cross(vertices[1] - vertices[0], p - vertices[0]));
-  for (int i = 0; i < vertices.size(); ++i) {
-    if (!EQUAL(glm::normalize(glm::cross(vertices[(i+1) % vertices.size()] - vertices[i], p - vertices[i])), n)) return {};
-  }
-  return p;
-}
-
-glm::vec3 Triangle::normalAt(glm::vec3 p) const {
-  glm::vec3 p0 = vertices[0] - p;
-  glm::vec3 p1 = vertices[1] - p;
-  glm::vec3 p2 = vertices[2] - p;
-  double a = glm::length(glm::cross(p1, p2));
-  double b = glm::length(glm::cross(p2, p0));
-  double c = glm::length(glm::cross(p0, p1));
-  return (a * normals[0] + b * normals[1] + c * normals[2]) / (a + b + c);
-}
-
-Ray Triangle::reflect(Ray ray, double n) const {
-  glm::vec3 q = intersect(ray).value();
-  glm::vec3 L = -ray.direction;
-  glm::vec3 N = normalAt(q);
-  if (glm::dot(N, L) < -EPSILON) {
-    N = -N;
-    n = ray.n;
+Triangle::Triangle(glm::vec3 a, glm::vec3 b, glm::vec3 c) : v0(a), e1(b - a), e2(c - a) {}
+
+uint32_t encodeNormal(glm::vec3 n) {
+  n /= glm::abs(n.x) + glm::abs(n.y) + glm::abs(n.z);
+  glm::vec2 p = glm::vec2(n.x, n.y);
+  // The lower half folds over the diagonals
+  if (n.z < 0.0f) {
+    p = glm::vec2((1.0f - glm::abs(n.y)) * (n.x >= 0.0f ? 1.0f : -1.0f), (1.0f - glm::abs(n.x)) * (n.y >= 0.0f ? 1.0f : -1.0f));
   }
-  glm::vec3 R = glm::dot(2.0 * L, N) * N - L;
-  return Ray(q, R, ray.n);
+  int16_t x = (int16_t)glm::round(glm::clamp(p.x, -1.0f, 1.0f) * 32767.0f);
+  int16_t y = (int16_t)glm::round(glm::clamp(p.y, -1.0f, 1.0f) * 32767.0f);
+  return (uint32_t)(uint16_t)x | (uint32_t)(uint16_t)y << 16;
 }
 
-Ray Triangle::refract(Ray ray, double n) const {
-  glm::vec3 q = intersect(ray).value();
-  glm::vec3 L = -ray.direction;
-  glm::vec3 N = normalAt(q);
-  if (glm::dot(N, L) < -EPSILON) {
-    N = -N;
-    n = ray.n;
+glm::vec3 decodeNormal(uint32_t encoded) {
+  glm::vec2 p = glm::vec2((int16_t)(encoded & 0xFFFF), (int16_t)(encoded >> 16)) / 32767.0f;
+  glm::vec3 n = glm::vec3(p, 1.0f - glm::abs(p.x) - glm::abs(p.y));
+  if (n.z < 0.0f) {
+    n.x = (1.0f - glm::abs(p.y)) * (p.x >= 0.0f ? 1.0f : -1.0f);
+    n.y = (1.0f - glm::abs(p.x)) * (p.y >= 0.0f ? 1.0f : -1.0f);
   }
-  double cos_i = glm::dot(L, N);
-  double cos_r = sqrt(1.0 - (ray.n / n) * (ray.n / n) * (1.0 - cos_i * cos_i));
-  glm::vec3 T = (ray.n / n * cos_i - cos_r) * N - ray.n / n * L;
-  assert(EQUAL(T, glm::normalize(T)));
-  return Ray(q, T, n);
+  return glm::normalize(n);
+}
+
+/**
+ * Moller-Trumbore ray/triangle test
+ * @param r
+ * @param t distance along the ray
+ * @param u barycentric coordinate of the second vertex
+ * @param v barycentric coordinate of the third vertex
+ * @return
+ */
+bool Triangle::intersect(const Ray &r, float &t, float &u, float &v) const {
+  glm::vec3 p = glm::cross(r.direction, e2);
+  float det = glm::dot(e1, p);
+  if (det == 0.0f) return false;
+  float inv = 1.0f / det;
+  glm::vec3 s = r.origin - v0;
+  u = glm::dot(s, p) * inv;
+  if (u < 0.0f || u > 1.0f) return false;
+  glm::vec3 q = glm::cross(s, e1);
+  v = glm::dot(r.direction, q) * inv;
+  if (v < 0.0f || u + v > 1.0f) return false;
+  t = glm::dot(e2, q) * inv;
+  return t >= EPSILON;
+}
+
+TrianglePack::TrianglePack() {
+  for (int i = 0; i < SIMD_WIDTH; ++i) {
+    // Degenerate padding lanes never hit
+    for (int k = 0; k < 3; ++k) {
+      v0[k][i] = e1[k][i] = e2[k][i] = 0.0f;
+    }
+    id[i] = (uint32_t)-1;
+  }
+}
+
+void TrianglePack::set(int lane, const Triangle &triangle, uint32_t id) {
+  for (int k = 0; k < 3; ++k) {
+    v0[k][lane] = triangle.v0[k];
+    e1[k][lane] = triangle.e1[k];
+    e2[k][lane] = triangle.e2[k];
+  }
+  this->id[lane] = id;
+}
+
+/**
+ * Moller-Trumbore over all lanes at once
+ * @param r
+ * @param tmax
+ * @param t distance per lane
+ * @param u
+ * @param v
+ * @return lanes hit closer than tmax
+ */
+inline maskv TrianglePack::test(const Ray &r, float tmax, floatv &t, floatv &u, floatv &v) const {
+  floatv dx(r.direction.x), dy(r.direction.y), dz(r.direction.z);
+  floatv e1x = floatv::load(e1[0]), e1y = floatv::load(e1[1]), e1z = floatv::load(e1[2]);
+  floatv e2x = floatv::load(e2[0]), e2y = floatv::load(e2[1]), e2z = floatv::load(e2[2]);
+  floatv px = dy * e2z - dz * e2y;
+  floatv py = dz * e2x - dx * e2z;
+  floatv pz = dx * e2y - dy * e2x;
+  floatv det = e1x * px + e1y * py + e1z * pz;
+  floatv inv = floatv(1.0f) / det;
+  floatv sx = floatv(r.origin.x) - floatv::load(v0[0]);
+  floatv sy = floatv(r.origin.y) - floatv::load(v0[1]);
+  floatv sz = floatv(r.origin.z) - floatv::load(v0[2]);
+  u = (sx * px + sy * py + sz * pz) * inv;
+  floatv qx = sy * e1z - sz * e1y;
+  floatv qy = sz * e1x - sx * e1z;
+  floatv qz = sx * e1y - sy * e1x;
+  v = (dx * qx + dy * qy + dz * qz) * inv;
+  t = (e2x * qx + e2y * qy + e2z * qz) * inv;
+  return (det != floatv(0.0f)) & (u >= floatv(0.0f)) & (v >= floatv(0.0f)) & (u + v <= floatv(1.0f)) &
+         (t >= floatv(EPSILON)) & (t < floatv(tmax));
+}
+
+/**
+ * Nearest hit among the lanes
+ * @param r
+ * @param tmax shrunk to the distance of the nearest hit
+ * @param u
+ * @param v
+ * @return lane of the nearest hit closer than tmax, or -1
+ */
+int TrianglePack::intersect(const Ray &r, float &tmax, float &u, float &v) const {
+  floatv t, bu, bv;
+  maskv hit = test(r, tmax, t, bu, bv);
+  if (!hit.any()) return -1;
+  t = select(hit, t, floatv(INFINITY));
+  float nearest = hmin(t);
+  int lane = firstLane((hit & (t == floatv(nearest))).bits());
+  alignas(SIMD_ALIGN) float lanes[SIMD_WIDTH];
+  tmax = nearest;
+  bu.store(lanes);
+  u = lanes[lane];
+  bv.store(lanes);
+  v = lanes[lane];
+  return lane;
+}
+
+bool TrianglePack::occluded(const Ray &r, float tmax) const {
+  floatv t, u, v;
+  return test(r, tmax, t, u, v).any();
+}
+
+/**
+ * Moller-Trumbore of every triangle in the pack against the lanes of a packet
+ * @param packet tmax, primitive and barycentrics are updated for the lanes hit
+ * @param mask
+ * @return lanes hit
+ */
+int TrianglePack::intersectPacket(RayPacket &packet, int mask) const {
+  floatv dx = floatv::load(packet.direction[0]), dy = floatv::load(packet.direction[1]), dz = floatv::load(packet.direction[2]);
+  floatv ox = floatv::load(packet.origin[0]), oy = floatv::load(packet.origin[1]), oz = floatv::load(packet.origin[2]);
+  int updated = 0;
+  for (int i = 0; i < SIMD_WIDTH && id[i] != (uint32_t)-1; ++i) {
+    floatv e1x(e1[0][i]), e1y(e1[1][i]), e1z(e1[2][i]);
+    floatv e2x(e2[0][i]), e2y(e2[1][i]), e2z(e2[2][i]);
+    floatv px = dy * e2z - dz * e2y;
+    floatv py = dz * e2x - dx * e2z;
+    floatv pz = dx * e2y - dy * e2x;
+    floatv det = e1x * px + e1y * py + e1z * pz;
+    floatv inv = floatv(1.0f) / det;
+    floatv sx = ox - floatv(v0[0][i]);
+    floatv sy = oy - floatv(v0[1][i]);
+    floatv sz = oz - floatv(v0[2][i]);
+    floatv u = (sx * px + sy * py + sz * pz) * inv;
+    floatv qx = sy * e1z - sz * e1y;
+    floatv qy = sz * e1x - sx * e1z;
+    floatv qz = sx * e1y - sy * e1x;
+    floatv v = (dx * qx + dy * qy + dz * qz) * inv;
+    floatv t = (e2x * qx + e2y * qy + e2z * qz) * inv;
+    int hit = ((det != floatv(0.0f)) & (u >= floatv(0.0f)) & (v >= floatv(0.0f)) & (u + v <= floatv(1.0f)) &
+               (t >= floatv(EPSILON)) & (t < floatv::load(packet.tmax))).bits() & mask;
+    if (!hit) continue;
+    float lanes[3][SIMD_WIDTH];
+    t.store(lanes[0]);
+    u.store(lanes[1]);
+    v.store(lanes[2]);
+    for (int lane = firstLane(hit); lane >= 0; hit &= hit - 1, lane = firstLane(hit)) {
+      packet.tmax[lane] = lanes[0][lane];
+      packet.u[lane] = lanes[1][lane];
+      packet.v[lane] = lanes[2][lane];
+      packet.primitive[lane] = id[i];
+      updated |= 1 << lane;
+    }
+  }
+  return updated;
+}
+
+Triangle TriangleMesh::triangle(uint32_t i) const {
+  const glm::uvec3& p = positionIndices[i];
+  return Triangle(positions[p.x], positions[p.y], positions[p.z]);
+}
+
+glm::vec3 TriangleMesh::faceNormal(uint32_t i) const {
+  const glm::uvec3& p = positionIndices[i];
+  glm::vec3 a = positions[p.x];
+  glm::vec3 normal = glm::normalize(glm::cross(positions[p.y] - a, positions[p.z] - a));
+  if (!normalIndices.empty() && normalIndices[i].x != MESH_NONE && glm::dot(normal, decodeNormal(normals[normalIndices[i].x])) < 0.0f) {
+    return -normal;
+  }
+  return normal;
+}
+
+glm::vec3 TriangleMesh::normalAt(uint32_t i, glm::vec2 barycentric) const {
+  if (normalIndices.empty()) return faceNormal(i);
+  const glm::uvec3& c = normalIndices[i];
+  if (c.x == MESH_NONE || c.y == MESH_NONE || c.z == MESH_NONE) return faceNormal(i);
+  return glm::normalize((1.0f - barycentric.x - barycentric.y) * decodeNormal(normals[c.x]) +
+                        barycentric.x * decodeNormal(normals[c.y]) + barycentric.y * decodeNormal(normals[c.z]));
+}
+
+glm::vec2 TriangleMesh::uvAt(uint32_t i, glm::vec2 barycentric) const {
+  if (uvIndices.empty()) return glm::vec2(0.0f);
+  const glm::uvec3& c = uvIndices[i];
+  if (c.x == MESH_NONE || c.y == MESH_NONE || c.z == MESH_NONE) return glm::vec2(0.0f);
+  return (1.0f - barycentric.x - barycentric.y) * uvs[c.x] + barycentric.x * uvs[c.y] + barycentric.y * uvs[c.z];
+}
+
+float TriangleMesh::uvScale(uint32_t i) const {
+  if (uvIndices.empty()) return 0.0f;
+  const glm::uvec3& c = uvIndices[i];
+  if (c.x == MESH_NONE || c.y == MESH_NONE || c.z == MESH_NONE) return 0.0f;
+  const glm::uvec3& p = positionIndices[i];
+  glm::vec2 du = uvs[c.y] - uvs[c.x], dv = uvs[c.z] - uvs[c.x];
+  float uvArea = glm::abs(du.x * dv.y - du.y * dv.x);
+  float area = glm::length(glm::cross(positions[p.y] - positions[p.x], positions[p.z] - positions[p.x]));
+  if (area <= 0.0f) return 0.0f;
+  return glm::sqrt(uvArea / area);
+}
+
+AABB TriangleMesh::bounds(uint32_t i) const {
+  const glm::uvec3& p = positionIndices[i];
+  AABB box;
+  box.extend(positions[p.x]);
+  box.extend(positions[p.y]);
+  box.extend(positions[p.z]);
+  // Pad so that axis-aligned triangles do not produce flat boxes
+  box.min -= glm::vec3(EPSILON);
+  box.max += glm::vec3(EPSILON);
+  return box;
+}
+
+size_t TriangleMesh::memory() const {
+  return positions.size() * sizeof(glm::vec3) + normals.size() * sizeof(uint32_t) + uvs.size() * sizeof(glm::vec2) +
+         (positionIndices.size() + normalIndices.size() + uvIndices.size()) * sizeof(glm::uvec3);
 }
 
 Polygon::Polygon(std::vector<glm::vec3> vertices, glm::vec3 ambient, glm::vec3 diffuse, glm::vec3 specular, double gloss, double n, bool reflective, bool refractive)
     : Object(ambient, diffuse, specular, gloss, n, reflective, refractive) {
   assert(vertices.size() % 3 == 0);
-  for (size_t i = 0; i < vertices.size() / 3; ++i) {
-    glm::vec3 a = vertices[i * 3];
-    glm::vec3 b = vertices[i * 3 + 1];
-    glm::vec3 c = vertices[i * 3 + 2];
-    planes.push_back(Triangle(a, b, c));
+  Mesh mesh;
+  mesh.positions = vertices;
+  for (uint32_t i = 0; i < vertices.size(); ++i) {
+    mesh.positionIndices.push_back(i);
   }
+  setMesh(mesh);
 };
 
 Polygon::Polygon(std::vector<glm::vec3> vertices, std::vector<glm::vec3> normals, glm::vec3 ambient, glm::vec3 diffuse, glm::vec3 specular, double gloss, double n, bool reflective, bool refractive)
     : Object(ambient, diffuse, specular, gloss, n, reflective, refractive) {
   assert(vertices.size() % 3 == 0);
   assert(vertices.size() == normals.size());
-  for (size_t i = 0; i < vertices.size() / 3; ++i) {
-    glm::vec3 a = vertices[i * 3];
-    glm::vec3 b = vertices[i * 3 + 1];
-    glm::vec3 c = vertices[i * 3 + 2];
-
-    glm::vec3 na = normals[i * 3];
-    glm::vec3 nb = normals[i * 3 + 1];
-    glm::vec3 nc = normals[i * 3 + 2];
-    planes.push_back(Triangle(a, b, c, na, nb, nc));
+  Mesh mesh;
+  mesh.positions = vertices;
+  mesh.normals = normals;
+  for (uint32_t i = 0; i < vertices.size(); ++i) {
+    mesh.positionIndices.push_back(i);
+    mesh.normalIndices.push_back(i);
   }
+  setMesh(mesh);
 };
 
-std::experimental::optional<glm::vec3> Sphere::intersect(Ray r) const {
-  glm::vec3 dp = center - r.origin;
-  double udp = glm::dot(r.direction, dp);
+Polygon::Polygon(const Mesh& mesh, glm::vec3 ambient, glm::vec3 diffuse, glm::vec3 specular, double gloss, double n, bool reflective, bool refractive)
+    : Object(ambient, diffuse, specular, gloss, n, reflective, refractive) {
+  setMesh(mesh);
+}
+
+// The index arrays of the mesh are regrouped into triples. Normals are stored reversed, as polygons
+// given normals have always been shaded from the side opposite to them.
+void Polygon::setMesh(const Mesh& mesh) {
+  triangles = TriangleMesh();
+  triangles.positions = mesh.positions;
+  triangles.uvs = mesh.uvs;
+  triangles.normals.reserve(mesh.normals.size());
+  for (auto const & normal: mesh.normals) {
+    triangles.normals.push_back(encodeNormal(-normal));
+  }
+  auto triples = [&](const std::vector<uint32_t>& indices, std::vector<glm::uvec3>& out) {
+    out.resize(indices.size() / 3);
+    for (size_t i = 0; i < out.size(); ++i) {
+      out[i] = glm::uvec3(indices[i * 3], indices[i * 3 + 1], indices[i * 3 + 2]);
+    }
+  };
+  triples(mesh.positionIndices, triangles.positionIndices);
+  triples(mesh.normalIndices, triangles.normalIndices);
+  triples(mesh.uvIndices, triangles.uvIndices);
+  buildAccelerationStructure();
+}
+
+void Polygon::buildAccelerationStructure() {
+  std::vector<AABB> boxes;
+  boxes.reserve(triangles.size());
+  for (uint32_t i = 0; i < triangles.size(); ++i) {
+    boxes.push_back(triangles.bounds(i));
+  }
+  bvh.build(boxes, SIMD_WIDTH);
+  // Pack the triangles of every leaf so the leaf is tested in one kernel call
+  packs.clear();
+  leafPacks.assign(bvh.nodes.size(), 0);
+  for (uint32_t n = 0; n < bvh.nodes.size(); ++n) {
+    const BVHNode& node = bvh.nodes[n];
+    if (!node.leaf()) continue;
+    leafPacks[n] = (uint32_t)packs.size();
+    for (uint32_t i = 0; i < node.count; ++i) {
+      if (i % SIMD_WIDTH == 0) packs.push_back(TrianglePack());
+      uint32_t id = bvh.indices[node.first + i];
+      packs.back().set(i % SIMD_WIDTH, triangles.triangle(id), id);
+    }
+  }
+}
+
+// Distance to the near side of the sphere along a unit direction, or -1 when the ray misses
+double Sphere::nearest(glm::vec3 origin, glm::vec3 direction) const {
+  glm::vec3 dp = center - origin;
+  double udp = glm::dot(direction, dp);
   double det = udp * udp - glm::dot(dp, dp) + radius * radius;
-  if (det > EPSILON) {
-    double s = udp - glm::sqrt(det);
-    if (s < EPSILON) return {};
-    return r.origin + r.direction * s;
+  if (det <= EPSILON) return -1.0;
+  return udp - glm::sqrt(det);
+}
+
+std::experimental::optional<Hit> Sphere::intersect(const Ray &r, float tmax) const {
+  double s = nearest(r.origin, r.direction);
+  if (s < EPSILON || s >= tmax) return {};
+  Hit hit;
+  hit.distance = (float)s;
+  hit.point = r.origin + r.direction * s;
+  hit.primitive = 0;
+  hit.barycentric = glm::vec2(0.0f);
+  hit.object = this;
+  return hit;
+}
+
+bool Sphere::occluded(const Ray &r, float tmax) const {
+  double s = nearest(r.origin, r.direction);
+  return s >= EPSILON && s < tmax;
+}
+
+// Rejects the lanes that miss in single precision, the lanes that hit are resolved in double
+// precision so they agree with intersect()
+void Sphere::intersectPacket(RayPacket &packet, int mask) const {
+  floatv dpx = floatv(center.x) - floatv::load(packet.origin[0]);
+  floatv dpy = floatv(center.y) - floatv::load(packet.origin[1]);
+  floatv dpz = floatv(center.z) - floatv::load(packet.origin[2]);
+  floatv udp = floatv::load(packet.direction[0]) * dpx + floatv::load(packet.direction[1]) * dpy + floatv::load(packet.direction[2]) * dpz;
+  // Squared distance from the center to the ray, which loses less precision than udp^2 - |dp|^2
+  floatv cx = dpx - floatv::load(packet.direction[0]) * udp;
+  floatv cy = dpy - floatv::load(packet.direction[1]) * udp;
+  floatv cz = dpz - floatv::load(packet.direction[2]) * udp;
+  floatv det = floatv((float)(radius * radius)) - (cx * cx + cy * cy + cz * cz);
+  floatv far = udp + vsqrt(vmax(det, floatv(0.0f)));
+  int hit = ((det > floatv(0.0f)) & (far >= floatv(EPSILON))).bits() & mask;
+  for (int lane = firstLane(hit); lane >= 0; hit &= hit - 1, lane = firstLane(hit)) {
+    glm::vec3 origin = glm::vec3(packet.origin[0][lane], packet.origin[1][lane], packet.origin[2][lane]);
+    glm::vec3 direction = glm::vec3(packet.direction[0][lane], packet.direction[1][lane], packet.direction[2][lane]);
+    double s = nearest(origin, direction);
+    if (s < EPSILON || s >= packet.tmax[lane]) continue;
+    packet.tmax[lane] = (float)s;
+    packet.primitive[lane] = 0;
+    packet.u[lane] = packet.v[lane] = 0.0f;
+    packet.object[lane] = this;
   }
-  else return {};
 }
 
-glm::vec3 Sphere::normalAt(glm::vec3 p) const {
+void sphereSurface(glm::vec3 center, float radius, const Texture* bumpmap, const Ray &r, Hit &hit) {
+  glm::vec3 p = hit.point;
+  glm::vec3 z = glm::normalize(p - center);
+  hit.geometricNormal = z;
+  hit.uv = glm::vec2((p - center) / radius);
+  hit.uvFootprint = r.footprint(hit.distance) / radius;
+  hit.shadingNormal = z;
   if (bumpmap) {
     glm::vec3 up = glm::vec3(0,1,0);
-    glm::vec3 z = glm::normalize(p - center);
-    if (EQUAL(up, z)) return glm::normalize(p - center);
+    if (EQUAL(up, z)) return;
     glm::vec3 x = glm::normalize(glm::cross(up, z));
     glm::vec3 y = glm::cross(z, x);
-    double u = this->u(p);
-    double v = this->v(p);
-    glm::vec3 c = bumpmap->getTexture(u, v);
+    glm::vec3 c = bumpmap->sample(hit.uv, hit.uvFootprint);
     glm::vec3 coef = (2.0 * c) - glm::vec3(1.0);
-    return glm::normalize(x * coef.x + y * coef.y + z * coef.z);
+    hit.shadingNormal = glm::normalize(x * coef.x + y * coef.y + z * coef.z);
   }
-  else return glm::normalize(p - center);
 }
 
-glm::vec3 Polygon::normalAt(glm::vec3 q) const {
-  for(auto const & p: planes) {
-    if (p.contains(q)) {
-      return p.normalAt(q);
+void Sphere::surface(const Ray &r, Hit &hit) const {
+  sphereSurface(center, (float)radius, bumpmap, r, hit);
+}
+
+std::experimental::optional<Hit> Polygon::intersect(const Ray &r, float tmax) const {
+  Hit hit;
+  bool found = false;
+  bvh.traverseLeaves(r.origin, r.direction, tmax, [&](uint32_t n, float& tmax) {
+    const BVHNode& node = bvh.nodes[n];
+    uint32_t end = leafPacks[n] + (node.count + SIMD_WIDTH - 1) / SIMD_WIDTH;
+    for (uint32_t i = leafPacks[n]; i < end; ++i) {
+      float u, v;
+      int lane = packs[i].intersect(r, tmax, u, v);
+      if (lane >= 0) {
+        hit.primitive = packs[i].id[lane];
+        hit.barycentric = glm::vec2(u, v);
+        found = true;
+      }
     }
-  }
+  });
+  if (!found) return {};
+  hit.distance = tmax;
+  hit.point = r.origin + tmax * r.direction;
+  hit.object = this;
+  return hit;
 }
 
-std::experimental::optional<glm::vec3> Polygon::intersect(Ray r) const {
-  std::experimental::optional<glm::vec3> result = {};
-  for (auto const & p: planes) {
-    auto q = p.intersect(r);
-    if (q && (!result || glm::distance(r.origin, q.value()) < glm::distance(r.origin, result.value()))) {
-      result = q.value();
+bool Polygon::occluded(const Ray &r, float tmax) const {
+  return bvh.anyLeaves(r.origin, r.direction, tmax, [&](uint32_t n, float tmax) {
+    const BVHNode& node = bvh.nodes[n];
+    uint32_t end = leafPacks[n] + (node.count + SIMD_WIDTH - 1) / SIMD_WIDTH;
+    for (uint32_t i = leafPacks[n]; i < end; ++i) {
+      if (packs[i].occluded(r, tmax)) return true;
     }
-  }
-  return result;
+    return false;
+  });
 }
 
-Ray Sphere::reflect(Ray ray) const {
-  glm::vec3 q = intersect(ray).value();
-  glm::vec3 L = -ray.direction;
-  glm::vec3 N = normalAt(q);
-  double n = this->n;
-  if (glm::dot(N, L) < -EPSILON) {
-    N = -N;
-    n = ray.n;
-  }
-  glm::vec3 R = glm::dot(2.0 * L, N) * N - L;
-  return Ray(q, R, ray.n);
+void Polygon::intersectPacket(RayPacket &packet, int mask) const {
+  bvh.traversePacket(packet, mask, [&](uint32_t n, int mask) {
+    const BVHNode& node = bvh.nodes[n];
+    uint32_t end = leafPacks[n] + (node.count + SIMD_WIDTH - 1) / SIMD_WIDTH;
+    int hit = 0;
+    for (uint32_t i = leafPacks[n]; i < end; ++i) {
+      hit |= packs[i].intersectPacket(packet, mask);
+    }
+    for (int lane = firstLane(hit); lane >= 0; hit &= hit - 1, lane = firstLane(hit)) {
+      packet.object[lane] = this;
+    }
+  });
 }
 
-Ray Sphere::refract(Ray ray) const {
-  glm::vec3 q = intersect(ray).value();
-  glm::vec3 L = -ray.direction;
-  glm::vec3 N = normalAt(q);
-  double n = this->n;
-  if (glm::dot(N, L) < -EPSILON) {
-    N = -N;
-    n = ray.n;
+void Polygon::surface(const Ray &r, Hit &hit) const {
+  hit.geometricNormal = triangles.faceNormal(hit.primitive);
+  hit.shadingNormal = triangles.normalAt(hit.primitive, hit.barycentric);
+  hit.uv = triangles.uvAt(hit.primitive, hit.barycentric);
+  hit.uvFootprint = r.footprint(hit.distance) * triangles.uvScale(hit.primitive);
+}
+
+void Object::intersectPacket(RayPacket &packet, int mask) const {
+  for (int lane = firstLane(mask); lane >= 0; mask &= mask - 1, lane = firstLane(mask)) {
+    Ray r(glm::vec3(packet.origin[0][lane], packet.origin[1][lane], packet.origin[2][lane]),
+          glm::vec3(packet.direction[0][lane], packet.direction[1][lane], packet.direction[2][lane]), 1.0);
+    auto hit = intersect(r, packet.tmax[lane]);
+    if (!hit) continue;
+    packet.tmax[lane] = hit->distance;
+    packet.primitive[lane] = hit->primitive;
+    packet.u[lane] = hit->barycentric.x;
+    packet.v[lane] = hit->barycentric.y;
+    packet.object[lane] = this;
   }
-  double cos_i = glm::dot(L, N);
-  double cos_r = sqrt(1.0 - (ray.n / n) * (ray.n / n) * (1.0 - cos_i * cos_i));
-  glm::vec3 T = (ray.n / n * cos_i - cos_r) * N - ray.n / n * L;
-  assert(EQUAL(T, glm::normalize(T)));
-  return Ray(q, T, n);
 }
 
-Ray Polygon::reflect(Ray ray) const {
-  glm::vec3 q = intersect(ray).value();
+Ray Object::reflect(const Ray &ray, const Hit &hit) const {
+  glm::vec3 q = hit.point;
   glm::vec3 L = -ray.direction;
-  glm::vec3 N = normalAt(q);
-  double n = this->n;
+  glm::vec3 N = hit.shadingNormal;
   if (glm::dot(N, L) < -EPSILON) {
     N = -N;
-    n = ray.n;
   }
   glm::vec3 R = glm::dot(2.0 * L, N) * N - L;
-  return Ray(q, R, ray.n);
+  Ray reflected(q, R, ray.n);
+  reflected.width = ray.footprint(hit.distance);
+  reflected.spread = ray.spread;
+  return reflected;
 }
 
-Ray Polygon::refract(Ray ray) const {
-  glm::vec3 q = intersect(ray).value();
+Ray Object::refract(const Ray &ray, const Hit &hit) const {
+  glm::vec3 q = hit.point;
   glm::vec3 L = -ray.direction;
-  glm::vec3 N = normalAt(q);
+  glm::vec3 N = hit.shadingNormal;
   double n = this->n;
   if (glm::dot(N, L) < -EPSILON) {
     N = -N;
@@ -212,23 +476,22 @@ Ray Polygon::refract(Ray ray) const {
   double cos_r = sqrt(1.0 - (ray.n / n) * (ray.n / n) * (1.0 - cos_i * cos_i));
   glm::vec3 T = (ray.n / n * cos_i - cos_r) * N - ray.n / n * L;
   assert(EQUAL(T, glm::normalize(T)));
-  return Ray(q, T, n);
-}
-
-double Sphere::u(glm::vec3 point) const {
-  glm::vec3 p = (point - center) / radius;
-  return p.x;
+  Ray refracted(q, T, n);
+  refracted.width = ray.footprint(hit.distance);
+  refracted.spread = ray.spread;
+  return refracted;
 }
 
-double Sphere::v(glm::vec3 point) const {
-  glm::vec3 p = (point - center) / radius;
-  return p.y;
+AABB Sphere::bounds() const {
+  glm::vec3 r = glm::vec3((float)radius);
+  return AABB(center - r, center + r);
 }
 
-double Polygon::u(glm::vec3) const {
-  return 0.0;
+AABB Polygon::bounds() const {
+  return bvh.bounds();
 }
 
-double Polygon::v(glm::vec3) const {
-  return 0.0;
+size_t Polygon::memory() const {
+  return triangles.memory() + bvh.nodes.size() * sizeof(BVHNode) + bvh.indices.size() * sizeof(uint32_t) +
+         packs.size() * sizeof(TrianglePack) + leafPacks.size() * sizeof(uint32_t);
 }
@@ -8,16 +8,44 @@
 #include <glm/ext.hpp>
 
 #include "texture.h"
+#include "bvh.h"
+#include "simd.h"
+#include "packet.h"
+#include "objloader.hpp"
 
 #define EPSILON 1.0e-3f
 #define EQUAL(x,y) (glm::all(glm::lessThan(glm::abs((x) - (y)), glm::vec3(EPSILON))))
 
+// The ray stands for a cone that starts width wide and widens by spread per unit of distance,
+// a one-parameter form of ray differentials used to pick texture mip levels
 class Ray {
 public:
     glm::vec3 origin;
     glm::vec3 direction;
     double n;
-    Ray(glm::vec3 origin, glm::vec3 direction, double n) : origin(origin), direction(glm::normalize(direction)), n(n) {};
+    float width;
+    float spread;
+    Ray() : origin(0.0f), direction(0.0f, 0.0f, 1.0f), n(1.0), width(0.0f), spread(0.0f) {};
+    Ray(glm::vec3 origin, glm::vec3 direction, double n) : origin(origin), direction(glm::normalize(direction)), n(n), width(0.0f), spread(0.0f) {};
+    float footprint(float distance) const { return width + spread * distance; }
+};
+
+class Object;
+
+// Everything known about a ray/surface intersection. Object::intersect fills distance, point,
+// primitive and barycentric; Object::surface adds normals and texture coordinates.
+class Hit {
+public:
+    float distance;
+    glm::vec3 point;
+    uint32_t primitive;
+    glm::vec2 barycentric;
+    glm::vec3 geometricNormal;
+    glm::vec3 shadingNormal;
+    glm::vec2 uv;
+    // Width of the ray footprint in texture coordinates
+    float uvFootprint;
+    const Object* object;
 };
 
 class Object {
@@ -36,56 +64,118 @@ public:
     Object (glm::vec3 ambient, glm::vec3 diffuse, glm::vec3 specular, double gloss, double n, bool reflective, bool refractive)
         : ambient(ambient), diffuse(diffuse), specular(specular), gloss(gloss), n(n),
           reflective(reflective), refractive(refractive), reflectWeight(0.1), texture(nullptr), bumpmap(nullptr) {};
-    virtual std::experimental::optional<glm::vec3> intersect(Ray r) const = 0;
-    virtual glm::vec3 normalAt(glm::vec3) const = 0;
-    virtual Ray reflect(Ray ray) const = 0;
-    virtual Ray refract(Ray ray) const = 0;
-    virtual double u(glm::vec3) const = 0;
-    virtual double v(glm::vec3) const = 0;
+    virtual std::experimental::optional<Hit> intersect(const Ray& r, float tmax = INFINITY) const = 0;
+    virtual void surface(const Ray& r, Hit& hit) const = 0;
+    // Any-hit test for shadow rays, stops at the first blocker closer than tmax
+    virtual bool occluded(const Ray& r, float tmax) const = 0;
+    // Closest hits of the lanes in mask, updates the lanes hit closer than their tmax.
+    // The default traces the lanes one at a time.
+    virtual void intersectPacket(RayPacket& packet, int mask) const;
+    virtual AABB bounds() const = 0;
+    // Move to the pose at time, true when the bounds changed. Objects are static by default.
+    virtual bool animate(float /*time*/) { return false; }
+    Ray reflect(const Ray& ray, const Hit& hit) const;
+    Ray refract(const Ray& ray, const Hit& hit) const;
 };
 
-class Sphere : Object {
+class Sphere final : public Object {
 private:
     glm::vec3 center;
     double radius;
+    double nearest(glm::vec3 origin, glm::vec3 direction) const;
 public:
     Sphere(glm::vec3 center, double radius, glm::vec3 ambient, glm::vec3 diffuse, glm::vec3 specular, double gloss, double n, bool reflective, bool refractive)
         : center(center), radius(radius), Object(ambient, diffuse, specular, gloss, n, reflective, refractive) {};
-    std::experimental::optional<glm::vec3> intersect(Ray r) const;
-    glm::vec3 normalAt(glm::vec3) const;
-    Ray reflect(Ray ray) const;
-    Ray refract(Ray ray) const;
-    double u(glm::vec3) const;
-    double v(glm::vec3) const;
+    std::experimental::optional<Hit> intersect(const Ray& r, float tmax = INFINITY) const;
+    void surface(const Ray& r, Hit& hit) const;
+    bool occluded(const Ray& r, float tmax) const;
+    void intersectPacket(RayPacket& packet, int mask) const;
+    AABB bounds() const;
 };
 
+// Normals and texture coordinates of a hit on a sphere, bumped when there is a bumpmap
+void sphereSurface(glm::vec3 center, float radius, const Texture* bumpmap, const Ray& r, Hit& hit);
+
+// First vertex and edges of a triangle, what the intersection kernels need of it
 class Triangle {
 private:
-    std::vector<glm::vec3> vertices;
-    std::vector<glm::vec3> normals;
-    glm::vec3 normal;
+    glm::vec3 v0, e1, e2;
+    friend class TrianglePack;
 public:
     Triangle(glm::vec3, glm::vec3, glm::vec3);
-    Triangle(glm::vec3, glm::vec3, glm::vec3, glm::vec3, glm::vec3, glm::vec3);
-    std::experimental::optional<glm::vec3> intersect(Ray r) const;
-    bool contains(glm::vec3 p) const;
-    glm::vec3 normalAt(glm::vec3) const;
-    Ray reflect(Ray ray, double n) const;
-    Ray refract(Ray ray, double n) const;
+    bool intersect(const Ray& r, float& t, float& u, float& v) const;
+};
+
+// Unit vector folded onto an octahedron, 16 bits per coordinate
+uint32_t encodeNormal(glm::vec3 n);
+glm::vec3 decodeNormal(uint32_t encoded);
+
+/**
+ * Triangles with shared vertex attributes, one array per attribute. Triangle i is entry i of
+ * the index arrays, so it costs three 32-bit index triples and its share of the vertices. Normals
+ * are octahedral encoded. The normal and uv index arrays are empty when no triangle has them, and
+ * a corner without one holds MESH_NONE.
+ */
+class TriangleMesh {
+public:
+    std::vector<glm::vec3> positions;
+    std::vector<uint32_t> normals;
+    std::vector<glm::vec2> uvs;
+    std::vector<glm::uvec3> positionIndices;
+    std::vector<glm::uvec3> normalIndices;
+    std::vector<glm::uvec3> uvIndices;
+    size_t size() const { return positionIndices.size(); }
+    Triangle triangle(uint32_t i) const;
+    // Faces the side of the vertex normals when the triangle has them
+    glm::vec3 faceNormal(uint32_t i) const;
+    glm::vec3 normalAt(uint32_t i, glm::vec2 barycentric) const;
+    glm::vec2 uvAt(uint32_t i, glm::vec2 barycentric) const;
+    // Texture coordinate length per unit of world length across triangle i, 0 without uvs
+    float uvScale(uint32_t i) const;
+    AABB bounds(uint32_t i) const;
+    size_t memory() const;
+};
+
+// SIMD_WIDTH triangles in structure-of-arrays layout, tested together by one kernel call
+class TrianglePack {
+private:
+    float v0[3][SIMD_WIDTH];
+    float e1[3][SIMD_WIDTH];
+    float e2[3][SIMD_WIDTH];
+    maskv test(const Ray& r, float tmax, floatv& t, floatv& u, floatv& v) const;
+public:
+    uint32_t id[SIMD_WIDTH];
+    TrianglePack();
+    void set(int lane, const Triangle& triangle, uint32_t id);
+    int intersect(const Ray& r, float& tmax, float& u, float& v) const;
+    bool occluded(const Ray& r, float tmax) const;
+    int intersectPacket(RayPacket& packet, int mask) const;
 };
 
-class Polygon : Object {
+class Polygon final : public Object {
 private:
-    std::vector<Triangle> planes;
+    TriangleMesh triangles;
+    BVH bvh;
+    std::vector<TrianglePack> packs;
+    std::vector<uint32_t> leafPacks;
+    void buildAccelerationStructure();
+    friend class SceneCache;
 public:
+    // Material only, the triangles come from a SceneCache
+    Polygon(glm::vec3 ambient, glm::vec3 diffuse, glm::vec3 specular, double gloss, double n, bool reflective, bool refractive)
+        : Object(ambient, diffuse, specular, gloss, n, reflective, refractive) {};
     Polygon(std::vector<glm::vec3> vertices, std::vector<glm::vec3> normals, glm::vec3 ambient, glm::vec3 diffuse, glm::vec3 specular, double gloss, double n, bool reflective, bool refractive);
     Polygon(std::vector<glm::vec3> vertices, glm::vec3 ambient, glm::vec3 diffuse, glm::vec3 specular, double gloss, double n, bool reflective, bool refractive);
-    std::experimental::optional<glm::vec3> intersect(Ray r) const;
-    glm::vec3 normalAt(glm::vec3) const;
-    Ray reflect(Ray ray) const;
-    Ray refract(Ray ray) const;
-    double u(glm::vec3) const;
-    double v(glm::vec3) const;
+    Polygon(const Mesh& mesh, glm::vec3 ambient, glm::vec3 diffuse, glm::vec3 specular, double gloss, double n, bool reflective, bool refractive);
+    // Replace the triangles with those of the mesh and rebuild the acceleration structure
+    void setMesh(const Mesh& mesh);
+    std::experimental::optional<Hit> intersect(const Ray& r, float tmax = INFINITY) const;
+    void surface(const Ray& r, Hit& hit) const;
+    bool occluded(const Ray& r, float tmax) const;
+    void intersectPacket(RayPacket& packet, int mask) const;
+    AABB bounds() const;
+    // Bytes held by the triangles and their acceleration structure
+    size_t memory() const;
 };
 
 #endif //GRAPHICS_OBJECT_H
@@ -0,0 +1,85 @@
+#ifndef GRAPHICS_OBJECTLIST_H
+#define GRAPHICS_OBJECTLIST_H
+
+#include <vector>
+#include <experimental/optional>
+
+#include "object.h"
+#include "bvh.h"
+#include "packet.h"
+
+/**
+ * Objects of one type behind a BVH of their own. The loops over them call T directly, so for a
+ * final T they compile to direct calls the compiler may inline instead of virtual calls through
+ * Object. An ObjectList<Object> holds the types that have no list of their own.
+ */
+template <typename T>
+class ObjectList {
+public:
+    std::vector<T*> objects;
+    BVH bvh;
+
+    void add(T* object) { objects.push_back(object); }
+    std::vector<AABB> boxes() const;
+    void build() { bvh.build(boxes()); }
+    // Pose every object at time, true when any of them moved
+    bool animate(float time);
+    // Closest hit closer than tmax, shrinks tmax and replaces result when there is one
+    void intersect(const Ray& ray, float& tmax, std::experimental::optional<Hit>& result) const;
+    void intersectPacket(RayPacket& packet) const;
+    // First object other than skip that blocks the ray, or nullptr
+    const Object* occluded(const Ray& ray, float tmax, const Object* skip) const;
+};
+
+template <typename T>
+std::vector<AABB> ObjectList<T>::boxes() const {
+  std::vector<AABB> boxes;
+  boxes.reserve(objects.size());
+  for (auto & object: objects) {
+    boxes.push_back(object->bounds());
+  }
+  return boxes;
+}
+
+template <typename T>
+bool ObjectList<T>::animate(float time) {
+  bool moved = false;
+  for (auto & object: objects) {
+    moved |= object->animate(time);
+  }
+  return moved;
+}
+
+template <typename T>
+void ObjectList<T>::intersect(const Ray &ray, float &tmax, std::experimental::optional<Hit> &result) const {
+  bvh.traverse(ray.origin, ray.direction, tmax, [&](uint32_t i, float& tmax) {
+    auto hit = objects[i]->intersect(ray, tmax);
+    if (hit) {
+      tmax = hit->distance;
+      result = hit;
+    }
+  });
+}
+
+template <typename T>
+void ObjectList<T>::intersectPacket(RayPacket &packet) const {
+  bvh.traversePacket(packet, packet.active, [&](uint32_t n, int mask) {
+    const BVHNode& node = bvh.nodes[n];
+    for (uint32_t i = node.first; i < node.first + node.count; ++i) {
+      objects[bvh.indices[i]]->intersectPacket(packet, mask);
+    }
+  });
+}
+
+template <typename T>
+const Object* ObjectList<T>::occluded(const Ray &ray, float tmax, const Object *skip) const {
+  const Object* blocker = nullptr;
+  bvh.any(ray.origin, ray.direction, tmax, [&](uint32_t i, float tmax) {
+    if (objects[i] == skip || !objects[i]->occluded(ray, tmax)) return false;
+    blocker = objects[i];
+    return true;
+  });
+  return blocker;
+}
+
+#endif //GRAPHICS_OBJECTLIST_H
@@ -1,85 +1,325 @@
-#include <vector>
-#include <stdio.h>
-#include <string>
-#include <cstring>
-
-#include <glm/glm.hpp>
-
-#include "objloader.hpp"
-
-bool loadOBJ(
-	const char * path, 
-	std::vector<glm::vec3> & out_vertices, 
-	std::vector<glm::vec3> & out_normals
-){
-	printf("Loading OBJ file %s...\n", path);
-
-	std::vector<unsigned int> vertexIndices, normalIndices;
-	std::vector<glm::vec3> temp_vertices; 
-	std::vector<glm::vec3> temp_normals;
-
-
-	FILE * file = fopen(path, "r");
-	if( file == NULL ){
-		return false;
-	}
-
-	while(true) {
-		char lineHeader[128];
-		// read the first word of the line
-		int res = fscanf(file, "%s", lineHeader);
-		if (res == EOF)
-			break; // EOF = End Of File. Quit the loop.
-
-		// else : parse lineHeader
-		
-		if ( strcmp( lineHeader, "v" ) == 0 ){
-			glm::vec3 vertex;
-			fscanf(file, "%f %f %f\n", &vertex.x, &vertex.y, &vertex.z );
-			temp_vertices.push_back(vertex);
-		}else if ( strcmp( lineHeader, "vn" ) == 0 ){
-			glm::vec3 normal;
-			fscanf(file, "%f %f %f\n", &normal.x, &normal.y, &normal.z );
-			temp_normals.push_back(normal);
-		}else if ( strcmp( lineHeader, "f" ) == 0 ){
-			std::string vertex1, vertex2, vertex3;
-			unsigned int vertexIndex[3], normalIndex[3];
-			//int matches = fscanf(file, "%d/%*d/%d %d/%*d/%d %d/%*d/%d\n", &vertexIndex[0], &normalIndex[0], &vertexIndex[1], &normalIndex[1], &vertexIndex[2], &normalIndex[2] );
-			int matches = fscanf(file, "%d//%d %d//%d %d//%d\n", &vertexIndex[0], &normalIndex[0], &vertexIndex[1], &normalIndex[1], &vertexIndex[2], &normalIndex[2] );
-			if (matches != 6){
-				fclose(file);
-				return false;
-			}
-			vertexIndices.push_back(vertexIndex[0]);
-			vertexIndices.push_back(vertexIndex[1]);
-			vertexIndices.push_back(vertexIndex[2]);
-			normalIndices.push_back(normalIndex[0]);
-			normalIndices.push_back(normalIndex[1]);
-			normalIndices.push_back(normalIndex[2]);
-		}else{
-			// Probably a comment, eat up the rest of the line
-			char stupidBuffer[1000];
-			fgets(stupidBuffer, 1000, file);
-		}
-
-	}
-
-	// For each vertex of each triangle
-	for( unsigned int i=0; i<vertexIndices.size(); i++ ){
-
-		// Get the indices of its attributes
-		unsigned int vertexIndex = vertexIndices[i];
-		unsigned int normalIndex = normalIndices[i];
-		
-		// Get the attributes thanks to the index
-		glm::vec3 vertex = temp_vertices[ vertexIndex-1 ];
-		glm::vec3 normal = temp_normals[ normalIndex-1 ];
-		
-		// Put the attributes in buffers
-		out_vertices.push_back(vertex);
-		out_normals .push_back(normal);
-	
-	}
-	fclose(file);
-	return true;
-}
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <cstring>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <glm/glm.hpp>
+
+#include "objloader.hpp"
+#include "threadpool.h"
+
+// Smallest chunk worth a task of its own
+#define OBJ_CHUNK_BYTES (1 << 20)
+
+// What one chunk of the file holds. Indices are 0-based; negative OBJ indices are stored relative
+// to the first element of the chunk and listed in relative[], to be rebased when chunks are merged.
+struct ObjChunk {
+	const char * begin;
+	const char * end;
+	std::vector<glm::vec3> positions;
+	std::vector<glm::vec2> uvs;
+	std::vector<glm::vec3> normals;
+	std::vector<int32_t> indices[3];
+	std::vector<size_t> relative[3];
+	bool hasAttribute[3];
+	bool ok;
+};
+
+static const double POW10[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static inline bool isDigit(char c) { return c >= '0' && c <= '9'; }
+
+static inline const char * skipSpaces(const char * p, const char * end) {
+	while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) p++;
+	return p;
+}
+
+static inline const char * nextLine(const char * p, const char * end) {
+	p = (const char *)memchr(p, '\n', end - p);
+	return p ? p + 1 : end;
+}
+
+// Decimal with up to 15 significant digits and an exponent within 22 is one exactly rounded
+// multiplication or division in double. Anything else goes through strtof.
+static const char * parseFloat(const char * p, const char * end, float & out) {
+	const char * start = p;
+	bool negative = false;
+	if (p < end && (*p == '-' || *p == '+')) negative = *p++ == '-';
+	uint64_t mantissa = 0;
+	int digits = 0, exponent = 0;
+	bool any = false;
+	while (p < end && isDigit(*p)) {
+		if (mantissa || *p != '0') {
+			mantissa = mantissa * 10 + (*p - '0');
+			digits++;
+		}
+		any = true;
+		p++;
+	}
+	if (p < end && *p == '.') {
+		p++;
+		while (p < end && isDigit(*p)) {
+			if (mantissa || *p != '0') {
+				mantissa = mantissa * 10 + (*p - '0');
+				digits++;
+			}
+			exponent--;
+			any = true;
+			p++;
+		}
+	}
+	if (any && p < end && (*p == 'e' || *p == 'E')) {
+		const char * q = p + 1;
+		bool negativeExponent = false;
+		if (q < end && (*q == '-' || *q == '+')) negativeExponent = *q++ == '-';
+		int value = 0;
+		bool expDigits = false;
+		while (q < end && isDigit(*q)) {
+			if (value < 10000) value = value * 10 + (*q - '0');
+			expDigits = true;
+			q++;
+		}
+		if (expDigits) {
+			exponent += negativeExponent ? -value : value;
+			p = q;
+		}
+	}
+	if (any && digits <= 15 && exponent >= -22 && exponent <= 22) {
+		double value = exponent < 0 ? (double)mantissa / POW10[-exponent] : (double)mantissa * POW10[exponent];
+		out = (float)(negative ? -value : value);
+		return p;
+	}
+	char buffer[64];
+	size_t length = std::min((size_t)(end - start), sizeof(buffer) - 1);
+	memcpy(buffer, start, length);
+	buffer[length] = '\0';
+	char * stop;
+	out = strtof(buffer, &stop);
+	if (stop == buffer) return NULL;
+	return start + (stop - buffer);
+}
+
+static const char * parseInt(const char * p, const char * end, long & out) {
+	bool negative = false;
+	if (p < end && (*p == '-' || *p == '+')) negative = *p++ == '-';
+	if (p >= end || !isDigit(*p)) return NULL;
+	long value = 0;
+	while (p < end && isDigit(*p)) {
+		if (value < 0x7FFFFFFFL) value = value * 10 + (*p - '0');
+		p++;
+	}
+	out = negative ? -value : value;
+	return p;
+}
+
+static const char * parseFloats(const char * p, const char * end, float * out, int count) {
+	for (int i = 0; i < count; ++i) {
+		p = skipSpaces(p, end);
+		p = parseFloat(p, end, out[i]);
+		if (!p) return NULL;
+	}
+	return p;
+}
+
+static void parseChunk(ObjChunk & chunk) {
+	const char * end = chunk.end;
+	// Index and relative flag of the position, uv and normal of every corner of the current face
+	std::vector<int32_t> corners[3];
+	std::vector<bool> cornerRelative[3];
+	for (const char * p = chunk.begin; p < end; p = nextLine(p, end)) {
+		p = skipSpaces(p, end);
+		if (p + 1 >= end) continue;
+		if (p[0] == 'v' && (p[1] == ' ' || p[1] == '\t')) {
+			glm::vec3 v;
+			if (!parseFloats(p + 2, end, &v.x, 3)) return;
+			chunk.positions.push_back(v);
+		}
+		else if (p[0] == 'v' && p[1] == 't' && p + 2 < end && (p[2] == ' ' || p[2] == '\t')) {
+			glm::vec2 vt;
+			if (!parseFloats(p + 3, end, &vt.x, 2)) return;
+			chunk.uvs.push_back(vt);
+		}
+		else if (p[0] == 'v' && p[1] == 'n' && p + 2 < end && (p[2] == ' ' || p[2] == '\t')) {
+			glm::vec3 vn;
+			if (!parseFloats(p + 3, end, &vn.x, 3)) return;
+			chunk.normals.push_back(vn);
+		}
+		else if (p[0] == 'f' && (p[1] == ' ' || p[1] == '\t')) {
+			size_t counts[3] = {chunk.positions.size(), chunk.uvs.size(), chunk.normals.size()};
+			for (int a = 0; a < 3; ++a) {
+				corners[a].clear();
+				cornerRelative[a].clear();
+			}
+			p += 2;
+			while (true) {
+				p = skipSpaces(p, end);
+				if (p >= end || *p == '\n' || *p == '#') break;
+				// v, v/vt, v//vn or v/vt/vn
+				long values[3] = {0, 0, 0};
+				p = parseInt(p, end, values[0]);
+				if (!p) return;
+				if (p < end && *p == '/') {
+					p++;
+					if (p < end && *p != '/') {
+						p = parseInt(p, end, values[1]);
+						if (!p) return;
+					}
+					if (p < end && *p == '/') {
+						p = parseInt(p + 1, end, values[2]);
+						if (!p) return;
+					}
+				}
+				if (values[0] == 0) return;
+				for (int a = 0; a < 3; ++a) {
+					if (values[a] > 0) {
+						corners[a].push_back((int32_t)(values[a] - 1));
+						cornerRelative[a].push_back(false);
+					}
+					else if (values[a] < 0) {
+						corners[a].push_back((int32_t)((long)counts[a] + values[a]));
+						cornerRelative[a].push_back(true);
+					}
+					else {
+						corners[a].push_back((int32_t)MESH_NONE);
+						cornerRelative[a].push_back(false);
+					}
+				}
+			}
+			size_t k = corners[0].size();
+			if (k < 3) return;
+			for (size_t i = 1; i + 1 < k; ++i) {
+				size_t fan[3] = {0, i, i + 1};
+				for (int a = 0; a < 3; ++a) {
+					for (size_t c: fan) {
+						if (cornerRelative[a][c]) chunk.relative[a].push_back(chunk.indices[a].size());
+						if (corners[a][c] != (int32_t)MESH_NONE) chunk.hasAttribute[a] = true;
+						chunk.indices[a].push_back(corners[a][c]);
+					}
+				}
+			}
+		}
+	}
+	chunk.ok = true;
+}
+
+bool loadOBJ(const char * path, Mesh & mesh, int threads) {
+	printf("Loading OBJ file %s...\n", path);
+	mesh = Mesh();
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) return false;
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		return false;
+	}
+	size_t size = (size_t)st.st_size;
+	if (size == 0) {
+		close(fd);
+		return true;
+	}
+	void * map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) return false;
+	madvise(map, size, MADV_SEQUENTIAL);
+	const char * data = (const char *)map;
+
+	ThreadPool pool(threads);
+	size_t count = std::max((size_t)1, std::min((size_t)pool.size() * 4, size / OBJ_CHUNK_BYTES));
+	std::vector<ObjChunk> chunks(count);
+	const char * begin = data;
+	for (size_t i = 0; i < count; ++i) {
+		const char * end = i + 1 == count ? data + size : nextLine(data + size * (i + 1) / count, data + size);
+		chunks[i].begin = begin;
+		chunks[i].end = std::max(begin, end);
+		chunks[i].hasAttribute[0] = chunks[i].hasAttribute[1] = chunks[i].hasAttribute[2] = false;
+		chunks[i].ok = false;
+		begin = chunks[i].end;
+	}
+	for (auto & chunk: chunks) {
+		pool.submit([&chunk](int) { parseChunk(chunk); });
+	}
+	pool.wait();
+	munmap(map, size);
+
+	// Offsets of every chunk in the merged arrays
+	std::vector<size_t> bases[3], offsets(count + 1, 0);
+	size_t totals[3] = {0, 0, 0};
+	bool hasAttribute[3] = {true, false, false};
+	for (int a = 0; a < 3; ++a) bases[a].resize(count);
+	for (size_t i = 0; i < count; ++i) {
+		if (!chunks[i].ok) return false;
+		bases[0][i] = totals[0];
+		bases[1][i] = totals[1];
+		bases[2][i] = totals[2];
+		totals[0] += chunks[i].positions.size();
+		totals[1] += chunks[i].uvs.size();
+		totals[2] += chunks[i].normals.size();
+		offsets[i + 1] = offsets[i] + chunks[i].indices[0].size();
+		hasAttribute[1] |= chunks[i].hasAttribute[1];
+		hasAttribute[2] |= chunks[i].hasAttribute[2];
+	}
+	mesh.positions.resize(totals[0]);
+	mesh.uvs.resize(totals[1]);
+	mesh.normals.resize(totals[2]);
+	std::vector<uint32_t> * indices[3] = {&mesh.positionIndices, &mesh.uvIndices, &mesh.normalIndices};
+	for (int a = 0; a < 3; ++a) {
+		if (hasAttribute[a]) indices[a]->resize(offsets[count]);
+	}
+
+	std::vector<char> valid(count, 1);
+	for (size_t i = 0; i < count; ++i) {
+		pool.submit([&, i](int) {
+			ObjChunk & chunk = chunks[i];
+			std::copy(chunk.positions.begin(), chunk.positions.end(), mesh.positions.begin() + bases[0][i]);
+			std::copy(chunk.uvs.begin(), chunk.uvs.end(), mesh.uvs.begin() + bases[1][i]);
+			std::copy(chunk.normals.begin(), chunk.normals.end(), mesh.normals.begin() + bases[2][i]);
+			for (int a = 0; a < 3; ++a) {
+				if (!hasAttribute[a]) continue;
+				uint32_t * out = indices[a]->data() + offsets[i];
+				const std::vector<int32_t> & in = chunk.indices[a];
+				for (size_t c = 0; c < in.size(); ++c) {
+					out[c] = (uint32_t)in[c];
+				}
+				for (size_t c: chunk.relative[a]) {
+					out[c] = (uint32_t)((int64_t)bases[a][i] + in[c]);
+				}
+				for (size_t c = 0; c < in.size(); ++c) {
+					if (out[c] >= totals[a] && !(a > 0 && out[c] == MESH_NONE)) valid[i] = 0;
+				}
+			}
+		});
+	}
+	pool.wait();
+	for (char ok: valid) {
+		if (!ok) return false;
+	}
+	return true;
+}
+
+bool loadOBJ(
+	const char * path,
+	std::vector<glm::vec3> & out_vertices,
+	std::vector<glm::vec3> & out_normals
+){
+	Mesh mesh;
+	if (!loadOBJ(path, mesh)) return false;
+	if (mesh.normalIndices.empty()) return false;
+
+	// For each vertex of each triangle
+	for( unsigned int i=0; i<mesh.positionIndices.size(); i++ ){
+		if (mesh.normalIndices[i] == MESH_NONE) return false;
+		out_vertices.push_back(mesh.positions[mesh.positionIndices[i]]);
+		out_normals .push_back(mesh.normals[mesh.normalIndices[i]]);
+	}
+	return true;
+}
@@ -1,10 +1,42 @@
-#ifndef OBJLOADER_H
-#define OBJLOADER_H
-
-bool loadOBJ(
-	const char * path, 
-	std::vector<glm::vec3> & out_vertices, 
-	std::vector<glm::vec3> & out_normals
-);
-
-#endif
\ No newline at end of file
+#ifndef OBJLOADER_H
+#define OBJLOADER_H
+
+#include <vector>
+#include <cstdint>
+
+#include <glm/glm.hpp>
+
+// Index of a corner attribute the face did not give
+#define MESH_NONE 0xFFFFFFFFu
+
+// Triangle mesh with shared vertex attributes. Every triangle is three consecutive entries of
+// the index arrays; uvIndices and normalIndices are empty when no face gives that attribute.
+struct Mesh {
+	std::vector<glm::vec3> positions;
+	std::vector<glm::vec2> uvs;
+	std::vector<glm::vec3> normals;
+	std::vector<uint32_t> positionIndices;
+	std::vector<uint32_t> uvIndices;
+	std::vector<uint32_t> normalIndices;
+	size_t triangles() const { return positionIndices.size() / 3; }
+};
+
+/**
+ * Parses a Wavefront OBJ file. The file is mapped and split into chunks at line ends, which are
+ * parsed in parallel. Faces may be v, v/vt, v//vn or v/vt/vn with absolute or negative indices,
+ * polygons are split into fans.
+ * @param path
+ * @param mesh
+ * @param threads 0 uses one per hardware thread
+ * @return false when the file can not be read or a face is malformed or out of range
+ */
+bool loadOBJ(const char * path, Mesh & mesh, int threads = 0);
+
+// Flat copies of the position and normal of every triangle corner
+bool loadOBJ(
+	const char * path,
+	std::vector<glm::vec3> & out_vertices,
+	std::vector<glm::vec3> & out_normals
+);
+
+#endif
@@ -0,0 +1,46 @@
+#include "packet.h"
+
+void RayPacket::set(int lane, glm::vec3 origin, glm::vec3 direction) {
+  for (int k = 0; k < 3; ++k) {
+    this->origin[k][lane] = origin[k];
+    this->direction[k][lane] = direction[k];
+    invDirection[k][lane] = 1.0f / direction[k];
+  }
+  tmax[lane] = INFINITY;
+  object[lane] = nullptr;
+  active |= 1 << lane;
+}
+
+void RayPacket::prepare() {
+  for (int lane = 0; lane < SIMD_WIDTH; ++lane) {
+    if (active & (1 << lane)) continue;
+    // Unused lanes get a finite ray that can never hit anything
+    for (int k = 0; k < 3; ++k) {
+      origin[k][lane] = direction[k][lane] = invDirection[k][lane] = 0.0f;
+    }
+    tmax[lane] = -INFINITY;
+    object[lane] = nullptr;
+  }
+
+  coherent = active != 0;
+  originMin = invMin = glm::vec3(INFINITY);
+  originMax = invMax = glm::vec3(-INFINITY);
+  meanDirection = glm::vec3(0.0f);
+  for (int lane = 0; lane < SIMD_WIDTH; ++lane) {
+    if (!(active & (1 << lane))) continue;
+    glm::vec3 o = glm::vec3(origin[0][lane], origin[1][lane], origin[2][lane]);
+    glm::vec3 d = glm::vec3(direction[0][lane], direction[1][lane], direction[2][lane]);
+    glm::vec3 inv = glm::vec3(invDirection[0][lane], invDirection[1][lane], invDirection[2][lane]);
+    originMin = glm::min(originMin, o);
+    originMax = glm::max(originMax, o);
+    invMin = glm::min(invMin, inv);
+    invMax = glm::max(invMax, inv);
+    meanDirection += d;
+    for (int k = 0; k < 3; ++k) {
+      if (d[k] == 0.0f || !std::isfinite(inv[k])) coherent = false;
+    }
+  }
+  for (int k = 0; k < 3; ++k) {
+    if (invMin[k] < 0.0f && invMax[k] > 0.0f) coherent = false;
+  }
+}
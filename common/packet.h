@@ -0,0 +1,38 @@
+#ifndef GRAPHICS_PACKET_H
+#define GRAPHICS_PACKET_H
+
+#include <cstdint>
+#include <cmath>
+
+#include <glm/glm.hpp>
+
+#include "simd.h"
+
+class Object;
+
+// SIMD_WIDTH rays in structure-of-arrays layout, traced together, with the closest hit of every lane.
+// Only the lanes set in `active` are valid.
+struct RayPacket {
+    float origin[3][SIMD_WIDTH];
+    float direction[3][SIMD_WIDTH];
+    float invDirection[3][SIMD_WIDTH];
+    float tmax[SIMD_WIDTH];
+    uint32_t primitive[SIMD_WIDTH];
+    float u[SIMD_WIDTH];
+    float v[SIMD_WIDTH];
+    const Object* object[SIMD_WIDTH];
+    int active;
+    // Bounds over the active lanes, only valid when the packet is coherent:
+    // every axis has one direction sign and no direction component is zero
+    bool coherent;
+    glm::vec3 originMin, originMax;
+    glm::vec3 invMin, invMax;
+    glm::vec3 meanDirection;
+
+    RayPacket() : active(0), coherent(false) {};
+    void set(int lane, glm::vec3 origin, glm::vec3 direction);
+    // Call after the last set(), fills the unused lanes and the bounds
+    void prepare();
+};
+
+#endif //GRAPHICS_PACKET_H
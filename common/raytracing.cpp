@@ -1,202 +1,851 @@
 #include "raytracing.h"
+#include "image.h"
+#include "wavefront.h"
+#include "distributed.h"
 
-std::experimental::optional<Object*> World::intersect(Ray ray) const {
-  glm::vec3 closest = glm::vec3(INFINITY);
-  std::experimental::optional<Object*> result = {};
-  for(auto & object: objects) {
-    std::experimental::optional<glm::vec3> p = object->intersect(ray);
-    if (p && glm::distance(p.value(), ray.origin) < glm::distance(closest, ray.origin)) {
-      closest = p.value();
-      result = object;
+#include <cstring>
+#include <atomic>
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+thread_local RayStats rayStats;
+// Hash of a pixel, sample and dimension to a float in [0, 1)
+static float sampleHash(uint32_t x, uint32_t y, uint32_t k, uint32_t dim) {
+  uint32_t h = x * 73856093u ^ y * 19349663u ^ k * 83492791u ^ dim * 2654435761u;
+  h ^= h >> 16;
+  h *= 0x7feb352du;
+  h ^= h >> 15;
+  h *= 0x846ca68bu;
+  h ^= h >> 16;
+  return (h >> 8) * (1.0f / 16777216.0f);
+}
+
+// Last object that blocked each light, per render thread
+struct ShadowCache {
+    const World* world = nullptr;
+    std::vector<const Object*> occluders;
+};
+static thread_local ShadowCache shadowCache;
+
+void RayStats::add(const RayStats &other) {
+  primary += other.primary;
+  secondary += other.secondary;
+  shadow += other.shadow;
+  occluded += other.occluded;
+  cacheHits += other.cacheHits;
+  texture.add(other.texture);
+}
+
+void RayStats::print() const {
+  uint64_t total = primary + secondary + shadow;
+  printf("Rays: %llu primary, %llu secondary, %llu shadow (%.1f%% of %llu)\n",
+         (unsigned long long)primary, (unsigned long long)secondary, (unsigned long long)shadow,
+         total ? 100.0 * shadow / total : 0.0, (unsigned long long)total);
+  printf("Shadow rays: %.1f%% occluded, %.1f%% of those by the cached occluder\n",
+         shadow ? 100.0 * occluded / shadow : 0.0, occluded ? 100.0 * cacheHits / occluded : 0.0);
+  uint64_t lookups = texture.hits + texture.shared + texture.decoded;
+  if (lookups == 0) return;
+  printf("Texture blocks: %.1f%% of %llu lookups in the thread table, %llu shared, %llu decoded, %llu evicted\n",
+         100.0 * texture.hits / lookups, (unsigned long long)lookups, (unsigned long long)texture.shared,
+         (unsigned long long)texture.decoded, (unsigned long long)texture.evicted);
+}
+
+RayStats RayStats::take() {
+  RayStats stats = rayStats;
+  stats.texture = TextureCache::stats();
+  reset();
+  return stats;
+}
+
+void RayStats::reset() {
+  rayStats = RayStats();
+  TextureCache::stats() = TextureStats();
+}
+
+std::experimental::optional<Hit> World::intersect(const Ray& ray) const {
+  float tmax = INFINITY;
+  std::experimental::optional<Hit> result = {};
+  eachList([&](const auto& list) { list.intersect(ray, tmax, result); });
+  return result;
+}
+
+/**
+ * Closest hits of up to SIMD_WIDTH camera rays, traced as one packet through the scene.
+ * Packets whose directions do not share an octant are traced one ray at a time.
+ * @param rays
+ * @param count
+ * @param hits filled for the rays that hit
+ * @return bit i is set when rays[i] hit
+ */
+int World::intersectPacket(const Ray* rays, int count, Hit* hits) const {
+  RayPacket packet;
+  for (int i = 0; i < count; ++i) {
+    packet.set(i, rays[i].origin, rays[i].direction);
+  }
+  packet.prepare();
+  int mask = 0;
+  if (!packet.coherent) {
+    for (int i = 0; i < count; ++i) {
+      auto hit = intersect(rays[i]);
+      if (!hit) continue;
+      hits[i] = hit.value();
+      mask |= 1 << i;
     }
+    return mask;
   }
-  return result;
+  eachList([&](const auto& list) { list.intersectPacket(packet); });
+  for (int i = 0; i < count; ++i) {
+    if (!packet.object[i]) continue;
+    Hit& hit = hits[i];
+    hit.distance = packet.tmax[i];
+    hit.point = rays[i].origin + packet.tmax[i] * rays[i].direction;
+    hit.primitive = packet.primitive[i];
+    hit.barycentric = glm::vec2(packet.u[i], packet.v[i]);
+    hit.object = packet.object[i];
+    mask |= 1 << i;
+  }
+  return mask;
 }
 
-glm::vec3 World::trace(Ray ray, int depth) const {
-  glm::vec3 background_color = glm::vec3(135.0 / 255, 206.0 / 255, 235.0 / 255);
-  if (depth > DEPTH_MAX) return background_color;
+void World::buildAccelerationStructure() {
+  eachList([](auto& list) { list.build(); });
 
-  auto obj_test = intersect(ray);
-  if (!obj_test) return background_color;
-  Object* obj = obj_test.value();
-  auto c = accumulateLightSource(obj, ray);
-  double weightSum = 1.0;
+  std::vector<glm::vec3> positions;
+  std::vector<float> powers;
+  for (auto & light: lights) {
+    positions.push_back(light.position);
+    powers.push_back((float)light.power);
+  }
+  lightTree.build(positions, powers);
+  lightTable.build(positions, powers);
+}
 
-  if (obj->reflective) {
-    Ray reflect = obj->reflect(ray);
-    c += trace(reflect, depth + 1) * obj->reflectWeight;
-    weightSum += obj->reflectWeight;
+void World::setTime(float time) {
+  auto start = std::chrono::steady_clock::now();
+  bool moved = false, rebuilt = false;
+  float worst = 1.0f;
+  eachList([&](auto& list) {
+    if (!list.animate(time) || sceneChanged) return;
+    moved = true;
+    std::vector<AABB> boxes = list.boxes();
+    list.bvh.refit(boxes);
+    float ratio = list.bvh.buildCost() > 0.0f ? list.bvh.cost() / list.bvh.buildCost() : 1.0f;
+    worst = std::max(worst, ratio);
+    if (ratio > BVH_REFIT_LIMIT) {
+      list.bvh.build(boxes);
+      rebuilt = true;
+    }
+  });
+  if (sceneChanged) {
+    buildAccelerationStructure();
+    sceneChanged = false;
+    return;
   }
-  if (obj->refractive) {
-    Ray refract = obj->refract(ray);
-    double refractWeight = 4.0f;
-    c += trace(refract, depth + 1) * refractWeight;
+  if (!moved) return;
+  printf("Scene BVH %s for time %.3f in %.3fms, cost %.2fx of the last build\n", rebuilt ? "rebuilt" : "refit", time,
+         std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count(), worst);
+}
+
+glm::vec3 World::trace(const Ray& ray, int depth, glm::vec3 eye) const {
+  if (depth > DEPTH_MAX) return BACKGROUND_COLOR;
+
+  if (depth == 0) rayStats.primary++;
+  else rayStats.secondary++;
+  auto hit_test = intersect(ray);
+  if (!hit_test) return BACKGROUND_COLOR;
+  return (this->*kernel())(ray, hit_test.value(), depth, eye);
+}
+
+template <typename Real, int Features>
+glm::vec3 World::traceWith(const Ray& ray, int depth, glm::vec3 eye) const {
+  if (depth > DEPTH_MAX) return BACKGROUND_COLOR;
+
+  if (depth == 0) rayStats.primary++;
+  else rayStats.secondary++;
+  auto hit_test = intersect(ray);
+  if (!hit_test) return BACKGROUND_COLOR;
+  return shade<Real, Features>(ray, hit_test.value(), depth, eye);
+}
+
+// Color seen along ray at its closest hit, reflections and refractions are traced one ray at a time
+template <typename Real, int Features>
+glm::vec3 World::shade(const Ray& ray, Hit& hit, int depth, glm::vec3 eye) const {
+  const Object* obj = hit.object;
+  obj->surface(ray, hit);
+  auto c = accumulateLightSource<Real, Features>(hit, eye);
+  Real weightSum = 1.0;
+
+  if ((Features & SHADE_REFLECTION) && obj->reflective) {
+    Ray reflect = obj->reflect(ray, hit);
+    c += traceWith<Real, Features>(reflect, depth + 1, eye) * (Real)obj->reflectWeight;
+    weightSum += (Real)obj->reflectWeight;
+  }
+  if ((Features & SHADE_REFRACTION) && obj->refractive) {
+    Ray refract = obj->refract(ray, hit);
+    Real refractWeight = 4.0f;
+    c += traceWith<Real, Features>(refract, depth + 1, eye) * refractWeight;
     weightSum += refractWeight;
   }
   return c / weightSum;
 }
 
-glm::vec3 World::accumulateLightSource(Object* obj, Ray ray) const {
-  glm::vec3 q = obj->intersect(ray).value();
-  glm::vec3 c = obj->ambient;
-  if (obj->texture) {
-    double u = obj->u(q);
-    double v = obj->v(q);
-    c = obj->texture->getTexture(u, v);
-  }
-  // glm::vec3 c = glm::vec3(0);
-  for(auto & light: lights) {
-    if (reachable(light, q)) {
-      glm::vec3 L = glm::normalize(light.position - q);
-      glm::vec3 N = obj->normalAt(q);
-      double nl = glm::dot(N, L);
-      double distance = glm::distance(light.position, q);
-      if (nl > EPSILON) {
-        c += obj->diffuse * light.power / (distance*distance) * nl;
-      }
-      glm::vec3 R = glm::dot(2.0 * L, N) * N - L;
-      glm::vec3 V = glm::normalize(eye - q);
-      if (glm::dot(R, V) > EPSILON) {
-        c += obj->specular * light.power / (distance*distance) * pow(glm::dot(R, V), obj->gloss);
+template <int Features>
+glm::vec3 World::ambientColor(const Hit& hit) const {
+  const Object* obj = hit.object;
+  if ((Features & SHADE_TEXTURES) && obj->texture) {
+    return obj->texture->sample(hit.uv, hit.uvFootprint);
+  }
+  return obj->ambient;
+}
+
+template <typename Real, int Features>
+glm::vec3 World::accumulateLightSource(const Hit& hit, glm::vec3 eye) const {
+  glm::vec3 q = hit.point;
+  glm::vec3 c = ambientColor<Features>(hit);
+  glm::vec3 N = hit.shadingNormal;
+  glm::vec3 V = glm::normalize(eye - q);
+  if (!(Features & SHADE_LIGHT_SAMPLING) || lightBudget == 0 || lightBudget >= lights.size()) {
+    glm::vec3 contributions[SIMD_WIDTH];
+    for (size_t first = 0; first < lights.size(); first += SIMD_WIDTH) {
+      // Shading terms of a block of lights first, then the shadow rays of those that contribute
+      int lit = lightBlock<Real>(first, hit, N, V, contributions);
+      for (int lane = firstLane(lit); lane >= 0; lit &= lit - 1, lane = firstLane(lit)) {
+        if (reachable(first + lane, q)) c += contributions[lane];
       }
     }
+    return c;
+  }
+  // Unbiased estimate of the sum over all lights from lightBudget importance-sampled ones
+  glm::vec3 sum = glm::vec3(0);
+  for (size_t k = 0; k < lightBudget; ++k) {
+    float pdf;
+    uint32_t i = lightTree.sample(q, lightSample(q, k), pdf);
+    sum += shadeLight<Real>(i, hit, N, V) / pdf;
+  }
+  return c + sum / (float)lightBudget;
+}
+
+/**
+ * Uniform number that picks the k-th light sampled at a shading point. The pixel and eye sample
+ * decide the point, so budgeted renders come out the same on any thread, process or render path.
+ * @param q
+ * @param k
+ * @return number in [0, 1)
+ */
+float World::lightSample(glm::vec3 q, size_t k) {
+  uint32_t x, y, z;
+  memcpy(&x, &q.x, sizeof(x));
+  memcpy(&y, &q.y, sizeof(y));
+  memcpy(&z, &q.z, sizeof(z));
+  return sampleHash(x, y ^ z * 0x9E3779B9u, (uint32_t)k, 2);
+}
+
+// Unshadowed diffuse and specular contribution of one light
+template <typename Real>
+glm::vec3 World::lightContribution(size_t i, const Hit& hit, glm::vec3 N, glm::vec3 V) const {
+  const Object* obj = hit.object;
+  const Light& light = lights[i];
+  glm::vec3 q = hit.point;
+  glm::vec3 L = glm::normalize(light.position - q);
+  Real nl = glm::dot(N, L);
+  Real distance = glm::distance(light.position, q);
+  Real power = (Real)light.power;
+  glm::vec3 c = glm::vec3(0);
+  if (nl > EPSILON) {
+    c += obj->diffuse * power / (distance*distance) * nl;
+  }
+  glm::vec3 R = glm::dot((Real)2.0 * L, N) * N - L;
+  if (glm::dot(R, V) > EPSILON) {
+    c += obj->specular * power / (distance*distance) * std::pow((Real)glm::dot(R, V), (Real)obj->gloss);
   }
   return c;
 }
 
-bool World::reachable(Light light, glm::vec3 target) const {
-  Ray ray = Ray(target, light.position - target, 0.0);
-  for(auto & object: objects) {
-    auto p = object->intersect(ray);
-    if (p && glm::distance(light.position, target) > glm::distance(target, p.value())) {
-      return false;
+template <typename Real>
+glm::vec3 World::shadeLight(size_t i, const Hit& hit, glm::vec3 N, glm::vec3 V) const {
+  glm::vec3 c = lightContribution<Real>(i, hit, N, V);
+  // Only lights that would contribute need a shadow ray
+  if (c == glm::vec3(0) || !reachable(i, hit.point)) return glm::vec3(0);
+  return c;
+}
+
+template <typename Real>
+int World::lightBlock(size_t first, const Hit& hit, glm::vec3 N, glm::vec3 V, glm::vec3* contributions) const {
+  int lit = 0;
+  size_t count = std::min((size_t)SIMD_WIDTH, lights.size() - first);
+  for (size_t lane = 0; lane < count; ++lane) {
+    contributions[lane] = lightContribution<Real>(first + lane, hit, N, V);
+    if (contributions[lane] != glm::vec3(0)) lit |= 1 << lane;
+  }
+  return lit;
+}
+
+template <>
+int World::lightBlock<float>(size_t first, const Hit& hit, glm::vec3 N, glm::vec3 V, glm::vec3* contributions) const {
+  const Object* obj = hit.object;
+  float diffuse[SIMD_WIDTH], specular[SIMD_WIDTH];
+  int weighted = lightTable.weights(first, hit.point, N, V, (float)obj->gloss, diffuse, specular);
+  int lit = 0;
+  for (int lane = firstLane(weighted); lane >= 0; weighted &= weighted - 1, lane = firstLane(weighted)) {
+    contributions[lane] = obj->diffuse * diffuse[lane] + obj->specular * specular[lane];
+    if (contributions[lane] != glm::vec3(0)) lit |= 1 << lane;
+  }
+  return lit;
+}
+
+// The wavefront engine shades with these
+template glm::vec3 World::ambientColor<SHADE_ALL>(const Hit& hit) const;
+template glm::vec3 World::lightContribution<float>(size_t light, const Hit& hit, glm::vec3 N, glm::vec3 V) const;
+template glm::vec3 World::lightContribution<double>(size_t light, const Hit& hit, glm::vec3 N, glm::vec3 V) const;
+template int World::lightBlock<double>(size_t first, const Hit& hit, glm::vec3 N, glm::vec3 V, glm::vec3* contributions) const;
+
+int World::sceneFeatures() const {
+  int features = 0;
+  eachList([&](const auto& list) {
+    for (auto & object: list.objects) {
+      if (object->texture) features |= SHADE_TEXTURES;
+      if (object->reflective) features |= SHADE_REFLECTION;
+      if (object->refractive) features |= SHADE_REFRACTION;
     }
+  });
+  if (lightBudget != 0 && lightBudget < lights.size()) features |= SHADE_LIGHT_SAMPLING;
+  return features;
+}
+
+template <typename Real, int... Features>
+World::ShadeKernel World::kernelFor(int features, std::integer_sequence<int, Features...>) {
+  static const ShadeKernel kernels[] = {&World::shade<Real, Features>...};
+  return kernels[features];
+}
+
+// Picks the instantiation of the trace kernel with exactly the features of the scene
+void World::selectKernel() {
+  int features = sceneFeatures() | extraFeatures;
+  auto all = std::make_integer_sequence<int, SHADE_ALL + 1>();
+  shadeKernel = singlePrecision ? kernelFor<float>(features, all) : kernelFor<double>(features, all);
+}
+
+World::ShadeKernel World::kernel() const {
+  return shadeKernel ? shadeKernel : &World::shade<double, SHADE_ALL>;
+}
+
+bool World::reachable(size_t light, glm::vec3 target) const {
+  glm::vec3 d = lights[light].position - target;
+  return !occluded(Ray(target, d, 0.0), glm::length(d), light);
+}
+
+/**
+ * Any-hit shadow query. The object that blocked this light last time on this thread is tried first.
+ * @param ray
+ * @param tmax distance to the light
+ * @param light index into lights
+ * @return
+ */
+bool World::occluded(const Ray& ray, float tmax, size_t light) const {
+  rayStats.shadow++;
+  if (shadowCache.world != this || shadowCache.occluders.size() != lights.size()) {
+    shadowCache.world = this;
+    shadowCache.occluders.assign(lights.size(), nullptr);
   }
+  const Object* last = shadowCache.occluders[light];
+  if (last && last->occluded(ray, tmax)) {
+    rayStats.occluded++;
+    rayStats.cacheHits++;
+    return true;
+  }
+  const Object* blocker = nullptr;
+  eachList([&](const auto& list) {
+    if (!blocker) blocker = list.occluded(ray, tmax, last);
+  });
+  if (!blocker) return false;
+  shadowCache.occluders[light] = blocker;
+  rayStats.occluded++;
   return true;
 }
 
-png_byte cut(double value) {
-  if (value < 0.0) return 0;
-  else if (value > 255) return 255;
-  else return (png_byte)value;
+// First eye sample of the tile that the accumulator does not hold yet
+int World::tileProgress(const RenderJob& job, const Tile& tile) const {
+  if (!job.accumulator) return 0;
+  return (int)std::min(job.accumulator->samples(job.accumulator->tileAt(tile.x0, tile.y0)), (uint32_t)samplesPerPixel);
 }
 
-void* fillImage(void* arg) {
-  int x, y;
-  struct thread_data* data;
-  data = (struct thread_data *)arg;
+/**
+ * Sums of eye samples [first, first + count) of every pixel of a tile, row by row
+ * @param job
+ * @param tile
+ * @param first
+ * @param count
+ * @param sums
+ */
+void World::renderSums(const RenderJob& job, const Tile& tile, int first, int count, glm::vec3* sums) const {
+  if (wavefront) {
+    Wavefront(*this).render(job, tile, first, count, sums);
+    return;
+  }
+  int tileWidth = tile.x1 - tile.x0;
+  for (int y = tile.y0; y < tile.y1; ++y) {
+    for (int x = tile.x0; x < tile.x1; ++x) {
+      sums[(y - tile.y0) * tileWidth + (x - tile.x0)] = sampleSum(x, y, job, first, count);
+    }
+  }
+}
 
-  int progress = 0;
+/**
+ * Adds count new samples per pixel to the accumulator and writes the pixels of the tile. Without
+ * a checkpoint every pixel shows sum / samplesPerPixel; with one, the mean of everything
+ * accumulated so far.
+ */
+void World::finishTile(const RenderJob& job, const Tile& tile, const glm::vec3* sums, int count) const {
+  Accumulator* accumulator = job.accumulator;
+  int tileWidth = tile.x1 - tile.x0;
+  if (accumulator && count > 0) {
+    int index = accumulator->tileAt(tile.x0, tile.y0);
+    accumulator->beginTile(index);
+    for (int y = tile.y0; y < tile.y1; ++y) {
+      for (int x = tile.x0; x < tile.x1; ++x) {
+        accumulator->add(x, y, sums[(y - tile.y0) * tileWidth + (x - tile.x0)], (uint32_t)count);
+      }
+    }
+    accumulator->endTile(index, (uint32_t)samplesPerPixel);
+  }
+  for (int y = tile.y0; y < tile.y1; ++y) {
+    for (int x = tile.x0; x < tile.x1; ++x) {
+      glm::vec3 color = accumulator ? accumulator->mean(x, y) : sums[(y - tile.y0) * tileWidth + (x - tile.x0)] / (float)samplesPerPixel;
+      png_byte* pixel = job.pixel(x, y);
+      pixel[0] = cut(color.x * 255.0);
+      pixel[1] = cut(color.y * 255.0);
+      pixel[2] = cut(color.z * 255.0);
+    }
+  }
+}
 
-  for (int y_ = 0 ; y_ < data->height / NTHREAD ; y_++) {
-    y = data->id * data->height / NTHREAD + y_;
-    for (x=0 ; x < data->width ; x++) {
-      glm::vec3 color = data->world->calculateColor(x, y, data->direction, data->right, data->up, data->width, data->height, data->view_width, data->view_height);
-      data->image[y * data->width * 3 + x * 3 + 0] = cut(color.x * 255.0);
-      data->image[y * data->width * 3 + x * 3 + 1] = cut(color.y * 255.0);
-      data->image[y * data->width * 3 + x * 3 + 2] = cut(color.z * 255.0);
+void World::renderTile(const RenderJob& job, const Tile& tile) const {
+  if (adaptive) {
+    for (int y = tile.y0; y < tile.y1; ++y) {
+      for (int x = tile.x0; x < tile.x1; ++x) {
+        glm::vec3 color = calculateColorAdaptive(x, y, job, job.samples[(y - job.y0) * job.width + x]);
+        png_byte* pixel = job.pixel(x, y);
+        pixel[0] = cut(color.x * 255.0);
+        pixel[1] = cut(color.y * 255.0);
+        pixel[2] = cut(color.z * 255.0);
+      }
     }
-    if ((int)(y_ * 20.0 / (data->height / NTHREAD)) > progress) {
-      progress = (int)(y_ * 20.0 / (data->height / NTHREAD));
-      printf("Thread %d:\t%d%%\tdone...\n", data->id, progress * 5);
+    return;
+  }
+  int first = tileProgress(job, tile);
+  int count = samplesPerPixel - first;
+  std::vector<glm::vec3> sums((size_t)(tile.x1 - tile.x0) * (tile.y1 - tile.y0), glm::vec3(0));
+  if (count > 0) renderSums(job, tile, first, count, sums.data());
+  finishTile(job, tile, sums.data(), count);
+}
+
+// Sample counts from blue at minSamples to red at maxSamples
+static void heatmapRow(const int* samples, int width, int minSamples, int maxSamples, png_byte* row) {
+  for (int x = 0; x < width; ++x) {
+    double t = maxSamples > minSamples ? (double)(samples[x] - minSamples) / (maxSamples - minSamples) : 0.0;
+    row[x * 3 + 0] = cut(t * 255.0);
+    row[x * 3 + 1] = cut((1.0 - glm::abs(2.0 * t - 1.0)) * 255.0);
+    row[x * 3 + 2] = cut((1.0 - t) * 255.0);
+  }
+}
+
+// FNV-1a of the view, so a checkpoint is only resumed by the render it was made for
+static uint64_t viewKey(glm::vec3 eye, glm::vec3 direction, glm::vec3 up, double view_width, int width, int height) {
+  float values[] = {eye.x, eye.y, eye.z, direction.x, direction.y, direction.z, up.x, up.y, up.z, (float)view_width};
+  uint64_t h = 14695981039346656037ull;
+  auto mix = [&](const void* data, size_t size) {
+    for (size_t i = 0; i < size; ++i) {
+      h = (h ^ ((const unsigned char*)data)[i]) * 1099511628211ull;
     }
+  };
+  mix(values, sizeof(values));
+  mix(&width, sizeof(width));
+  mix(&height, sizeof(height));
+  return h;
+}
+
+// Camera of a view, without output rows
+RenderJob World::viewJob(const View& view) const {
+  RenderJob job;
+  job.width = view.width;
+  job.height = view.height;
+  job.y0 = 0;
+  job.image = nullptr;
+  job.samples = nullptr;
+  job.accumulator = nullptr;
+  job.eye = view.eye;
+  job.direction = view.direction;
+  job.right = glm::normalize(glm::cross(view.direction, view.up));
+  job.up = view.up;
+  job.view_width = view.view_width;
+  job.view_height = view.view_width / view.width * view.height;
+  return job;
+}
+
+// Checkpoint of frame index of a batch of count frames, or nullptr
+std::unique_ptr<Accumulator> World::openCheckpoint(const View& view, size_t index, size_t count) const {
+  std::unique_ptr<Accumulator> accumulator;
+  if (checkpoint.empty() || adaptive) return accumulator;
+  std::string path = count > 1 ? checkpoint + "." + std::to_string(index) : checkpoint;
+  accumulator.reset(new Accumulator());
+  int resumed = accumulator->open(path.c_str(), view.width, view.height, TILE_SIZE,
+                                  viewKey(view.eye, view.direction, view.up, view.view_width, view.width, view.height));
+  if (resumed < 0) {
+    printf("Could not map the checkpoint %s\n", path.c_str());
+    accumulator.reset();
+  }
+  else if (resumed > 0) {
+    printf("Resuming %d tiles from %s\n", resumed, path.c_str());
   }
-  pthread_exit(NULL);
+  return accumulator;
+}
+
+// Heatmap next to the image, frame.png gets frame.samples.png
+static std::string samplesPath(const View& view) {
+  if (!view.samples.empty()) return view.samples;
+  size_t slash = view.output.find_last_of('/');
+  size_t dot = view.output.find_last_of('.');
+  std::string stem = dot != std::string::npos && (slash == std::string::npos || dot > slash) ? view.output.substr(0, dot) : view.output;
+  return stem + ".samples.png";
 }
 
 void World::createImageFromView(glm::vec3 eye, glm::vec3 direction, glm::vec3 up, double view_width, int width, int height) {
-  assert(height % NTHREAD == 0);
-  this->eye = eye;
-  FILE *fp = fopen("./result.png", "wb");
-  png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-  png_infop info_ptr = png_create_info_struct(png_ptr);
-  setjmp(png_jmpbuf(png_ptr));
-  png_init_io(png_ptr, fp);
-
-  // Write header (8 bit colour depth)
-  png_set_IHDR(png_ptr, info_ptr, width, height,
-               8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
-               PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
-
-  // Set title
-  png_text title_text;
-  title_text.compression = PNG_TEXT_COMPRESSION_NONE;
-  title_text.key = (png_charp)"Title";
-  title_text.text = (png_charp)"Graphics";
-  png_set_text(png_ptr, info_ptr, &title_text, 1);
-
-  png_write_info(png_ptr, info_ptr);
-
-  // Write image data
-  double view_height = view_width / width * height;
-  glm::vec3 right = glm::normalize(glm::cross(direction, up));
-  pthread_t threads[NTHREAD];
-  struct thread_data data[NTHREAD];
-  void* status;
-
-  png_byte* image = (png_byte*)malloc(sizeof(png_byte) * 3 * height * width);
-
-  for(int t = 0; t < NTHREAD; t++) {
-    data[t].id = t;
-    data[t].world = this;
-    data[t].width = width;
-    data[t].height = height;
-    data[t].view_width = view_width;
-    data[t].view_height = view_height;
-    data[t].direction = direction;
-    data[t].right = right;
-    data[t].up = up;
-    data[t].image = image;
-    pthread_create(&threads[t], NULL, fillImage, (void*)(&data[t]));
-  }
-
-  for(int t = 0; t < NTHREAD; t++) {
-    pthread_join(threads[t], &status);
-  }
-
-  png_bytep row = NULL;
-
-  // Allocate memory for one row (3 bytes per pixel - RGB)
-  row = (png_bytep) malloc(3 * width * sizeof(png_byte));
-  for (int y = 0; y < height; ++y) {
-    png_write_row(png_ptr, &image[y * width * 3]);
-  }
-
-  // End write
-  png_write_end(png_ptr, NULL);
-  png_write_info(png_ptr, info_ptr);
-
-  if (fp != NULL) fclose(fp);
-  if (info_ptr != NULL) png_free_data(png_ptr, info_ptr, PNG_FREE_ALL, -1);
-  if (png_ptr != NULL) png_destroy_write_struct(&png_ptr, (png_infopp)NULL);
-  if (row != NULL) free(row);
-}
-
-glm::vec3 World::calculateColor(int x, int y, glm::vec3 direction, glm::vec3 right, glm::vec3 up, int width, int height, double view_width, double view_height) const {
-  bool distributed = true;
-  glm::vec3 color;
-  if (distributed) {
-    color = glm::vec3(0);
-    for (int i = -3; i <= 3; ++i) {
-      for (int j = -3; j <= 3; ++j) {
-        glm::vec3 target = eye + direction +
-                           right * ((double) x / width * 2.0 - 1.0) * view_width +
-                           up * (1.0 - (double) y / height * 2.0) * view_height;
-        glm::vec3 dist_eye = eye + right * (double) i * 0.5f + up * (double) j * 0.5f;
-        Ray ray = Ray(dist_eye, target - dist_eye, 1.0);
-        glm::vec3 c = trace(ray, 0);
-        color += c;
+  View view(eye, direction, up, view_width, width, height, outputFormat == ImageFormat::PPM ? "./result.ppm" : "./result.png");
+  view.samples = "./samples.png";
+  renderBatch(std::vector<View>(1, view));
+}
+
+void World::renderBatch(const std::vector<View>& views) {
+  if (!checkpoint.empty() && adaptive) {
+    printf("Adaptive sampling does not use the checkpoint %s\n", checkpoint.c_str());
+  }
+  if (processes > 0 && adaptive) {
+    printf("Adaptive sampling renders in this process\n");
+  }
+  for (size_t begin = 0, end; begin < views.size(); begin = end) {
+    for (end = begin + 1; end < views.size() && views[end].time == views[begin].time; ++end);
+    setTime(views[begin].time);
+    selectKernel();
+    std::vector<size_t> local;
+    for (size_t i = begin; i < end; ++i) {
+      if (processes <= 0 || adaptive) {
+        local.push_back(i);
+        continue;
+      }
+      const View& v = views[i];
+      RenderJob view = viewJob(v);
+      std::unique_ptr<Accumulator> accumulator = openCheckpoint(v, i, views.size());
+      view.accumulator = accumulator.get();
+      int threads = threadCount > 0 ? threadCount : std::max(1, (int)std::thread::hardware_concurrency() / processes);
+      Coordinator coordinator(*this, view);
+      if (!coordinator.start(processes, threads)) {
+        printf("Could not start worker processes, rendering in this process\n");
+        local.push_back(i);
+        continue;
       }
+      ImageWriter writer(v.output.c_str(), v.width, v.height, formatOf(v.output.c_str()), compressionLevel);
+      RayStats stats;
+      coordinator.render(writer, stats);
+      if (accumulator) accumulator->flush(true);
+      stats.print();
+      if (!writer.ok()) printf("Could not write %s\n", v.output.c_str());
     }
-    color /= 49.0f;
+    if (!local.empty()) renderLocal(views, local);
   }
-  else {
-    glm::vec3 target = eye + direction +
-                       right * ((double) x / width * 2.0 - 1.0) * view_width +
-                       up * (1.0 - (double) y / height * 2.0) * view_height;
-    Ray ray = Ray(eye, target - eye, 1.0);
-    color = trace(ray, 0);
+}
+
+/**
+ * Renders the frames in bands of TILE_SIZE rows and streams each to its file in order.
+ * The worker that finishes the last tile of a band also encodes it, so compression runs in
+ * parallel, and the main thread only appends the encoded bands to the file. At most
+ * outputWindow bands are in flight, so memory is bounded by the window rather than the image.
+ * The bands of consecutive frames share the window, so it never drains between frames.
+ * @param views
+ * @param frames indices of the views to render
+ */
+void World::renderLocal(const std::vector<View>& views, const std::vector<size_t>& frames) {
+  struct Frame {
+    size_t index;
+    RenderJob view;
+    std::unique_ptr<ImageWriter> writer, heatmap;
+    std::unique_ptr<Accumulator> accumulator;
+    long totalSamples;
+    int fewest, most;
+    std::chrono::steady_clock::time_point start;
+  };
+  if (!pool) pool.reset(new ThreadPool(threadCount));
+
+  // Bands of every frame in order, frame f starts at band firstBand[f]
+  std::vector<Frame> states(frames.size());
+  std::vector<int> firstBand(frames.size());
+  int bands = 0;
+  for (size_t f = 0; f < frames.size(); ++f) {
+    states[f].index = frames[f];
+    states[f].view = viewJob(views[frames[f]]);
+    firstBand[f] = bands;
+    bands += (views[frames[f]].height + TILE_SIZE - 1) / TILE_SIZE;
+  }
+  auto frameOf = [&](int band) {
+    return (int)(std::upper_bound(firstBand.begin(), firstBand.end(), band) - firstBand.begin()) - 1;
+  };
+  // Files of a frame are opened by the main thread before its first band is handed out
+  auto openFrame = [&](int band) {
+    Frame& frame = states[frameOf(band)];
+    if (frame.writer) return;
+    const View& v = views[frame.index];
+    frame.writer.reset(new ImageWriter(v.output.c_str(), v.width, v.height, formatOf(v.output.c_str()), compressionLevel));
+    if (adaptive) frame.heatmap.reset(new ImageWriter(samplesPath(v).c_str(), v.width, v.height));
+    frame.accumulator = openCheckpoint(v, frame.index, views.size());
+    frame.view.accumulator = frame.accumulator.get();
+    frame.totalSamples = 0;
+    frame.fewest = maxSamples;
+    frame.most = 0;
+    frame.start = std::chrono::steady_clock::now();
+  };
+
+  int nworkers = pool->size();
+  int window = std::min(bands, outputWindow > 0 ? outputWindow : 2 * nworkers);
+  std::vector<RenderJob> jobs(window);
+  std::vector<int> slotFrame(window);
+  std::vector<std::vector<png_byte>> images(window);
+  std::vector<std::vector<int>> samples(window);
+  std::vector<EncodedRows> encoded(window), encodedHeatmap(window);
+  std::vector<bool> ready(window, false);
+  std::unique_ptr<std::atomic<int>[]> remaining(new std::atomic<int>[std::max(window, 1)]);
+  std::mutex mutex;
+  std::condition_variable bandDone;
+
+  std::vector<RayStats> workerStats(nworkers);
+  pool->resetBusyTime();
+  auto start = std::chrono::steady_clock::now();
+  auto encodeBand = [&](int slot) {
+    const RenderJob& job = jobs[slot];
+    Frame& frame = states[slotFrame[slot]];
+    int rows = std::min(TILE_SIZE, job.height - job.y0);
+    bool last = job.y0 + rows == job.height;
+    encoded[slot] = frame.writer->encode(job.image, rows, last);
+    if (!adaptive) return;
+    std::vector<png_byte> colors(rows * job.width * 3);
+    for (int y = 0; y < rows; ++y) {
+      heatmapRow(&job.samples[y * job.width], job.width, minSamples, maxSamples, &colors[y * job.width * 3]);
+    }
+    encodedHeatmap[slot] = frame.heatmap->encode(colors.data(), rows, last);
+  };
+  // Tiles of a band go left to right, every worker gets a contiguous run and idle workers steal
+  auto submitBand = [&](int band) {
+    int slot = band % window;
+    int f = frameOf(band);
+    RenderJob& job = jobs[slot];
+    job = states[f].view;
+    int width = job.width;
+    job.y0 = (band - firstBand[f]) * TILE_SIZE;
+    images[slot].resize(TILE_SIZE * width * 3);
+    samples[slot].resize(adaptive ? TILE_SIZE * width : 0);
+    job.image = images[slot].data();
+    job.samples = samples[slot].data();
+    slotFrame[slot] = f;
+    int tiles = (width + TILE_SIZE - 1) / TILE_SIZE;
+    remaining[slot] = tiles;
+    ready[slot] = false;
+    for (int i = 0; i < tiles; ++i) {
+      Tile tile = {i * TILE_SIZE, job.y0, std::min((i + 1) * TILE_SIZE, width), std::min(job.y0 + TILE_SIZE, job.height)};
+      pool->submit([&, slot, tile](int worker) {
+        renderTile(jobs[slot], tile);
+        workerStats[worker].add(RayStats::take());
+        if (--remaining[slot] > 0) return;
+        encodeBand(slot);
+        std::lock_guard<std::mutex> lock(mutex);
+        ready[slot] = true;
+        bandDone.notify_one();
+      }, i * nworkers / tiles);
+    }
+  };
+  for (int band = 0; band < window; ++band) {
+    openFrame(band);
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (int band = 0; band < window; ++band) {
+      submitBand(band);
+    }
+  }
+
+  for (int band = 0; band < bands; ++band) {
+    int slot = band % window;
+    std::unique_lock<std::mutex> lock(mutex);
+    bandDone.wait(lock, [&] { return ready[slot]; });
+    lock.unlock();
+    Frame& frame = states[slotFrame[slot]];
+    int width = jobs[slot].width;
+    int rows = std::min(TILE_SIZE, jobs[slot].height - jobs[slot].y0);
+    bool last = jobs[slot].y0 + rows == jobs[slot].height;
+    frame.writer->write(encoded[slot], rows);
+    if (frame.accumulator) frame.accumulator->flush(false);
+    if (adaptive) {
+      for (int i = 0; i < rows * width; ++i) {
+        frame.totalSamples += samples[slot][i];
+        frame.fewest = std::min(frame.fewest, samples[slot][i]);
+        frame.most = std::max(frame.most, samples[slot][i]);
+      }
+      frame.heatmap->write(encodedHeatmap[slot], rows);
+    }
+    if (band + window < bands) {
+      openFrame(band + window);
+      lock.lock();
+      submitBand(band + window);
+      lock.unlock();
+    }
+    if ((band + 1) * 20 / bands > band * 20 / bands) {
+      printf("%d%%\tdone...\n", (band + 1) * 20 / bands * 5);
+    }
+    if (!last) continue;
+    // Every band of the frame is written, later frames are still in flight
+    const View& v = views[frame.index];
+    if (frame.accumulator) frame.accumulator->flush(true);
+    if (views.size() > 1) {
+      printf("Frame %zu: %s in %.2fs\n", frame.index, v.output.c_str(),
+             std::chrono::duration<double>(std::chrono::steady_clock::now() - frame.start).count());
+    }
+    if (adaptive) {
+      printf("Samples: %.1f per pixel on average, %d to %d\n", (double)frame.totalSamples / ((double)v.width * v.height), frame.fewest, frame.most);
+    }
+    if (!frame.writer->ok()) printf("Could not write %s\n", v.output.c_str());
+    frame.writer.reset();
+    frame.heatmap.reset();
+    frame.accumulator.reset();
+  }
+  pool->wait();
+  double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  RayStats stats;
+  for (int t = 0; t < nworkers; t++) {
+    printf("Thread %d:\tbusy %.2fs (%.0f%%)\n", t, pool->busyTime(t), elapsed > 0.0 ? 100.0 * pool->busyTime(t) / elapsed : 0.0);
+    stats.add(workerStats[t]);
+  }
+  stats.print();
+  if (frames.size() > 1) {
+    printf("%zu frames in %.2fs, %.2f frames/s\n", frames.size(), elapsed, elapsed > 0.0 ? frames.size() / elapsed : 0.0);
+  }
+}
+
+glm::vec3 World::calculateColor(int x, int y, glm::vec3 eye, glm::vec3 direction, glm::vec3 right, glm::vec3 up, int width, int height, double view_width, double view_height) const {
+  RenderJob job;
+  job.width = width;
+  job.height = height;
+  job.eye = eye;
+  job.direction = direction;
+  job.right = right;
+  job.up = up;
+  job.view_width = view_width;
+  job.view_height = view_height;
+  return sampleSum(x, y, job, 0, EYE_SAMPLES) / (float)EYE_SAMPLES;
+}
+
+/**
+ * Eye offset of the k-th adaptive sample, in units of right and up. The first EYE_SAMPLES samples
+ * visit every grid cell once, in an order that spreads early samples over the whole grid, so
+ * stopping early still averages over the aperture. Later samples are jittered inside the cells.
+ */
+static glm::vec2 eyeOffset(int x, int y, int k) {
+  int cell = (k * 19) % EYE_SAMPLES;
+  glm::vec2 offset = glm::vec2(cell / EYE_GRID - EYE_GRID / 2, cell % EYE_GRID - EYE_GRID / 2);
+  if (k >= EYE_SAMPLES) {
+    offset += glm::vec2(sampleHash(x, y, k, 0), sampleHash(x, y, k, 1)) - glm::vec2(0.5f);
+  }
+  return offset * (float)EYE_SPACING;
+}
+
+// Point on the view plane that every eye sample of the pixel converges on
+glm::vec3 World::pixelTarget(const RenderJob& job, int x, int y) const {
+  return job.eye + job.direction +
+         job.right * ((double) x / job.width * 2.0 - 1.0) * job.view_width +
+         job.up * (1.0 - (double) y / job.height * 2.0) * job.view_height;
+}
+
+// Camera ray whose cone covers one pixel of the view plane at target
+Ray World::cameraRay(const RenderJob& job, glm::vec3 from, glm::vec3 target) const {
+  Ray ray(from, target - from, 1.0);
+  ray.spread = (float)(2.0 * job.view_width / job.width) / glm::length(target - from);
+  return ray;
+}
+
+/**
+ * Eye position of the k-th sample of a pixel. The first EYE_SAMPLES samples walk the grid row by
+ * row, later ones are jittered inside the cells, so every sample count extends the previous one.
+ */
+glm::vec3 World::eyeSample(const RenderJob& job, int x, int y, int k) const {
+  if (k >= EYE_SAMPLES) {
+    glm::vec2 offset = eyeOffset(x, y, k);
+    return job.eye + job.right * offset.x + job.up * offset.y;
+  }
+  int i = k / EYE_GRID - EYE_GRID / 2;
+  int j = k % EYE_GRID - EYE_GRID / 2;
+  return job.eye + job.right * (double) i * 0.5f + job.up * (double) j * 0.5f;
+}
+
+/**
+ * Sum of the colors of eye samples [first, first + count) of a pixel
+ * @param x
+ * @param y
+ * @param job
+ * @param first
+ * @param count
+ * @return
+ */
+glm::vec3 World::sampleSum(int x, int y, const RenderJob& job, int first, int count) const {
+  glm::vec3 color = glm::vec3(0);
+  glm::vec3 target = pixelTarget(job, x, y);
+  // The eye samples of a pixel converge on one target, so they are traced in packets
+  Ray rays[SIMD_WIDTH];
+  Hit hits[SIMD_WIDTH];
+  for (int k = first; k < first + count; k += SIMD_WIDTH) {
+    int n = std::min(SIMD_WIDTH, first + count - k);
+    for (int l = 0; l < n; ++l) {
+      glm::vec3 dist_eye = eyeSample(job, x, y, k + l);
+      rays[l] = cameraRay(job, dist_eye, target);
+    }
+    rayStats.primary += n;
+    int hit = intersectPacket(rays, n, hits);
+    for (int l = 0; l < n; ++l) {
+      color += (hit & (1 << l)) ? (this->*kernel())(rays[l], hits[l], 0, job.eye) : BACKGROUND_COLOR;
+    }
   }
   return color;
 }
+
+glm::vec3 World::calculateColorAdaptive(int x, int y, const RenderJob& job, int& samples) const {
+  glm::vec3 target = pixelTarget(job, x, y);
+  glm::vec3 sum = glm::vec3(0);
+  // Welford's running mean and variance of the luminance
+  double mean = 0.0, m2 = 0.0;
+  int n = 0;
+  Ray rays[SIMD_WIDTH];
+  Hit hits[SIMD_WIDTH];
+  bool converged = false;
+  // Intersect a packet of samples, then shade them in order until the pixel converges
+  while (n < maxSamples && !converged) {
+    int count = std::min(SIMD_WIDTH, maxSamples - n);
+    for (int l = 0; l < count; ++l) {
+      glm::vec2 offset = eyeOffset(x, y, n + l);
+      glm::vec3 dist_eye = job.eye + job.right * offset.x + job.up * offset.y;
+      rays[l] = cameraRay(job, dist_eye, target);
+    }
+    rayStats.primary += count;
+    int hit = intersectPacket(rays, count, hits);
+    for (int l = 0; l < count && !converged; ++l) {
+      glm::vec3 c = (hit & (1 << l)) ? (this->*kernel())(rays[l], hits[l], 0, job.eye) : BACKGROUND_COLOR;
+      sum += c;
+      n++;
+      double lum = 0.2126 * c.x + 0.7152 * c.y + 0.0722 * c.z;
+      double delta = lum - mean;
+      mean += delta / n;
+      m2 += delta * (lum - mean);
+      converged = n >= minSamples && n > 1 && glm::sqrt(m2 / (n - 1) / n) <= noiseThreshold;
+    }
+  }
+  samples = n;
+  return sum / (float)n;
+}
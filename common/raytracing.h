@@ -4,14 +4,46 @@
 #include <glm/glm.hpp>
 #include <glm/ext.hpp>
 #include "object.h"
+#include "bvh.h"
+#include "objectlist.h"
+#include "spheretable.h"
+#include "lighttree.h"
+#include "lighttable.h"
+#include "threadpool.h"
+#include "image.h"
+#include "accumulator.h"
 
 #include <vector>
+#include <memory>
+#include <utility>
+#include <algorithm>
+#include <string>
 #include <png.h>
-#include <pthread.h>
 
 #define DEPTH_MAX 10
 
-#define NTHREAD 8
+#define BACKGROUND_COLOR glm::vec3(135.0 / 255, 206.0 / 255, 235.0 / 255)
+
+#define TILE_SIZE 16
+
+// Surface area cost, relative to the last build, past which refitting the scene BVH gives way to a rebuild
+#define BVH_REFIT_LIMIT 1.3f
+
+// Distributed eye sampling jitters the eye over a 7x7 grid spaced 0.5 apart
+#define EYE_GRID 7
+#define EYE_SAMPLES (EYE_GRID * EYE_GRID)
+#define EYE_SPACING 0.5
+
+// Shading features a trace kernel is compiled with. A kernel without a feature skips its tests,
+// so it may only shade scenes that do not use it.
+enum ShadeFeature {
+    SHADE_TEXTURES = 1,
+    SHADE_REFLECTION = 2,
+    SHADE_REFRACTION = 4,
+    // Fewer shadow rays than lights, sampled from the light tree
+    SHADE_LIGHT_SAMPLING = 8,
+    SHADE_ALL = 15
+};
 
 class Light {
 public:
@@ -20,31 +52,242 @@ public:
     Light(glm::vec3 position, double power) : position(position), power(power) {};
 };
 
-class World {
-private:
-    std::vector<Object*> objects;
-    std::vector<Light> lights;
-    std::experimental::optional<Object*> intersect(Ray ray) const;
-    glm::vec3 accumulateLightSource(Object* obj, Ray ray) const;
-    bool reachable(Light light, glm::vec3 target) const;
-    glm::vec3 eye;
-public:
-    glm::vec3 trace(Ray ray, int depth) const;
-    void addObject(Object* obj) { objects.push_back(obj); }
-    void addLight(Light& light) { lights.push_back(light); }
-    void createImageFromView(glm::vec3 eye, glm::vec3 direction, glm::vec3 up, double view_width, int width, int height);
-    glm::vec3 calculateColor(int x, int y, glm::vec3 direction, glm::vec3 right, glm::vec3 up, int width, int height, double view_width, double view_height) const;
+// Ray counters, kept per render thread and summed after a render with the texture counters of the thread
+struct RayStats {
+    uint64_t primary;
+    uint64_t secondary;
+    uint64_t shadow;
+    uint64_t occluded;
+    uint64_t cacheHits;
+    TextureStats texture;
+    RayStats() : primary(0), secondary(0), shadow(0), occluded(0), cacheHits(0) {};
+    void add(const RayStats& other);
+    void print() const;
+    // Counters of the calling thread since the last reset, which are reset
+    static RayStats take();
+    static void reset();
 };
+extern thread_local RayStats rayStats;
 
-struct thread_data {
-    int id;
+// View and output rows shared by the tiles of one band of a render.
+// image and samples hold the rows starting at y0.
+struct RenderJob {
     int width, height;
-    World* world;
+    int y0;
     png_byte* image;
+    int* samples;
+    // Checkpointed sums of earlier renders, or nullptr
+    Accumulator* accumulator;
+    glm::vec3 eye;
     glm::vec3 direction, right, up;
     double view_width, view_height;
+    png_byte* pixel(int x, int y) const { return image + ((y - y0) * width + x) * 3; }
+};
+
+struct Tile {
+    int x0, y0, x1, y1;
+};
+
+// Camera and output file of one frame
+struct View {
+    glm::vec3 eye, direction, up;
+    double view_width;
+    int width, height;
+    std::string output;
+    // Sample count heatmap of adaptive sampling, next to output when empty
+    std::string samples;
+    // Scene time the animated objects are posed at
+    float time;
+    View(glm::vec3 eye, glm::vec3 direction, glm::vec3 up, double view_width, int width, int height, const std::string& output, float time = 0.0f)
+        : eye(eye), direction(direction), up(up), view_width(view_width), width(width), height(height), output(output), time(time) {};
+};
+
+class World {
+private:
+    // Objects by type, anything without a list of its own goes to others
+    ObjectList<Sphere> spheres;
+    ObjectList<Polygon> polygons;
+    ObjectList<SphereTable> sphereTables;
+    ObjectList<Object> others;
+    std::vector<Light> lights;
+    LightTree lightTree;
+    LightTable lightTable;
+    size_t lightBudget;
+    std::unique_ptr<ThreadPool> pool;
+    int threadCount;
+    int outputWindow;
+    ImageFormat outputFormat;
+    int compressionLevel;
+    bool adaptive;
+    bool wavefront;
+    int minSamples, maxSamples;
+    float noiseThreshold;
+    int samplesPerPixel;
+    int processes;
+    std::string checkpoint;
+    // Objects or lights were added since the last build
+    bool sceneChanged;
+    bool singlePrecision;
+    int extraFeatures;
+    typedef glm::vec3 (World::*ShadeKernel)(const Ray& ray, Hit& hit, int depth, glm::vec3 eye) const;
+    // Instantiation of shade picked for the scene by selectKernel
+    ShadeKernel shadeKernel;
+    // The picked kernel, or the general one before the first render
+    ShadeKernel kernel() const;
+    template <typename T>
+    void add(ObjectList<T>& list, T* object) {
+      list.add(object);
+      sceneChanged = true;
+    }
+    // Calls f with every object list in turn
+    template <typename F>
+    void eachList(F&& f) {
+      f(spheres);
+      f(polygons);
+      f(sphereTables);
+      f(others);
+    }
+    template <typename F>
+    void eachList(F&& f) const {
+      f(spheres);
+      f(polygons);
+      f(sphereTables);
+      f(others);
+    }
+    std::experimental::optional<Hit> intersect(const Ray& ray) const;
+    int intersectPacket(const Ray* rays, int count, Hit* hits) const;
+    /**
+     * The trace kernel: recursive tracing and shading with the lighting arithmetic in Real and the
+     * tests of the ShadeFeatures not in Features compiled out
+     */
+    template <typename Real, int Features>
+    glm::vec3 traceWith(const Ray& ray, int depth, glm::vec3 eye) const;
+    template <typename Real, int Features>
+    glm::vec3 shade(const Ray& ray, Hit& hit, int depth, glm::vec3 eye) const;
+    template <typename Real, int Features>
+    glm::vec3 accumulateLightSource(const Hit& hit, glm::vec3 eye) const;
+    template <int Features>
+    glm::vec3 ambientColor(const Hit& hit) const;
+    template <typename Real>
+    glm::vec3 lightContribution(size_t light, const Hit& hit, glm::vec3 N, glm::vec3 V) const;
+    template <typename Real>
+    glm::vec3 shadeLight(size_t light, const Hit& hit, glm::vec3 N, glm::vec3 V) const;
+    /**
+     * Unshadowed contributions of lights [first, first + SIMD_WIDTH), the float kernel takes them from
+     * the light table SIMD_WIDTH at a time
+     * @param first multiple of SIMD_WIDTH
+     * @param hit
+     * @param N
+     * @param V
+     * @param contributions one per lane
+     * @return lanes of the lights that contribute, each needs a shadow ray
+     */
+    template <typename Real>
+    int lightBlock(size_t first, const Hit& hit, glm::vec3 N, glm::vec3 V, glm::vec3* contributions) const;
+    static float lightSample(glm::vec3 q, size_t k);
+    // ShadeFeatures the objects and lights of the scene use
+    int sceneFeatures() const;
+    void selectKernel();
+    template <typename Real, int... Features>
+    static ShadeKernel kernelFor(int features, std::integer_sequence<int, Features...>);
+    bool reachable(size_t light, glm::vec3 target) const;
+    bool occluded(const Ray& ray, float tmax, size_t light) const;
+    void buildAccelerationStructure();
+    RenderJob viewJob(const View& view) const;
+    std::unique_ptr<Accumulator> openCheckpoint(const View& view, size_t index, size_t count) const;
+    void renderLocal(const std::vector<View>& views, const std::vector<size_t>& frames);
+    void renderTile(const RenderJob& job, const Tile& tile) const;
+    int tileProgress(const RenderJob& job, const Tile& tile) const;
+    void renderSums(const RenderJob& job, const Tile& tile, int first, int count, glm::vec3* sums) const;
+    void finishTile(const RenderJob& job, const Tile& tile, const glm::vec3* sums, int count) const;
+    glm::vec3 pixelTarget(const RenderJob& job, int x, int y) const;
+    glm::vec3 eyeSample(const RenderJob& job, int x, int y, int k) const;
+    Ray cameraRay(const RenderJob& job, glm::vec3 from, glm::vec3 target) const;
+    glm::vec3 sampleSum(int x, int y, const RenderJob& job, int first, int count) const;
+    friend class Wavefront;
+    friend class Coordinator;
+    glm::vec3 calculateColorAdaptive(int x, int y, const RenderJob& job, int& samples) const;
+public:
+    World() : lightBudget(0), threadCount(0), outputWindow(0), outputFormat(ImageFormat::PNG), compressionLevel(Z_DEFAULT_COMPRESSION), adaptive(false), wavefront(false), minSamples(8), maxSamples(EYE_SAMPLES), noiseThreshold(0.002f), samplesPerPixel(EYE_SAMPLES), processes(0), sceneChanged(true), singlePrecision(false), extraFeatures(0), shadeKernel(nullptr) {};
+    // Color seen along ray, eye is where specular highlights are seen from. Renders pick the kernel.
+    glm::vec3 trace(const Ray& ray, int depth, glm::vec3 eye) const;
+    void addObject(Sphere* sphere) { add(spheres, sphere); }
+    void addObject(Polygon* polygon) { add(polygons, polygon); }
+    void addObject(SphereTable* table) { add(sphereTables, table); }
+    // Any other shape, called through Object
+    void addObject(Object* obj) { add(others, obj); }
+    void addLight(Light& light) {
+      lights.push_back(light);
+      sceneChanged = true;
+    }
+    /**
+     * Pose every animated object at time. The BVH of every object list with objects that moved is
+     * refit, and only rebuilt once its surface area cost exceeds BVH_REFIT_LIMIT times that of its
+     * last build.
+     * Renders call it with the time of their view.
+     */
+    void setTime(float time);
+    // Shadow rays per hit, 0 shades every light. Smaller budgets sample lights from the light tree.
+    void setLightBudget(size_t budget) { lightBudget = budget; }
+    // Render threads, 0 uses one per hardware thread. Takes effect before the first render.
+    void setThreadCount(int threads) { threadCount = threads; }
+    // Bands of TILE_SIZE rows held in memory while rendering, 0 uses two per thread.
+    // Bands are written out in order as soon as they are done.
+    void setOutputWindow(int bands) { outputWindow = bands; }
+    // PNG at the given zlib level, or PPM. createImageFromView writes ./result.png or ./result.ppm.
+    // Views rendered by renderBatch are written in the format their extension names, see formatOf.
+    void setOutputFormat(ImageFormat format, int level = Z_DEFAULT_COMPRESSION) {
+      outputFormat = format;
+      compressionLevel = level;
+    }
+    /**
+     * Stop sampling a pixel once the standard error of its mean luminance drops below threshold.
+     * Every pixel takes at least minSamples and at most maxSamples eye samples; past EYE_SAMPLES
+     * the grid cells are revisited with jitter. The sample counts are written to ./samples.png,
+     * from blue at minSamples to red at maxSamples. minSamples is raised to 1 and maxSamples to
+     * minSamples, so every pixel takes at least one sample.
+     */
+    void setAdaptiveSampling(int minSamples, int maxSamples, float threshold) {
+      adaptive = true;
+      this->minSamples = std::max(1, minSamples);
+      this->maxSamples = std::max(this->minSamples, maxSamples);
+      noiseThreshold = threshold;
+    }
+    // Render bounce by bounce with the wavefront engine instead of tracing each eye sample recursively.
+    // Adaptive sampling always traces recursively.
+    void setWavefront(bool enabled) { wavefront = enabled; }
+    // Shade in float instead of double, faster but no longer bit-identical to earlier renders
+    void setSinglePrecision(bool enabled) { singlePrecision = enabled; }
+    // ShadeFeatures to compile into the trace kernel beyond those the scene uses, SHADE_ALL for the general one
+    void setExtraFeatures(int features) { extraFeatures = features & SHADE_ALL; }
+    // Eye samples per pixel. The first EYE_SAMPLES cover the grid, later ones are jittered inside its cells.
+    void setSamplesPerPixel(int samples) { samplesPerPixel = samples; }
+    /**
+     * Keep the color sums in a memory-mapped file at path. Tiles that already hold samplesPerPixel
+     * samples for the same view and size are not rendered again, and tiles with fewer only trace the
+     * missing samples, so a killed render resumes and a finished one can be refined. The scene itself
+     * is not part of the check: delete the file after changing it. Adaptive sampling ignores it.
+     */
+    void setCheckpoint(const std::string& path) { checkpoint = path; }
+    // Render on this many forked worker processes, each with setThreadCount threads or an even share
+    // of the hardware threads. 0 renders in this process. Adaptive sampling always renders here.
+    void setProcesses(int count) { processes = count; }
+    // Render one view to ./result.png, or ./result.ppm, and ./samples.png
+    void createImageFromView(glm::vec3 eye, glm::vec3 direction, glm::vec3 up, double view_width, int width, int height);
+    /**
+     * Render every view to its own file with the same scene, acceleration structures and threads.
+     * The bands of all frames go through one window in order, so the last bands of a frame are
+     * encoded and written while the next frame is rendering. With worker processes the frames are
+     * rendered one after another, each with freshly forked workers. With a checkpoint, frame i of
+     * a batch of more than one keeps its sums in the checkpoint path followed by .i
+     * Consecutive views at the same time share the pipeline; the scene is posed between them.
+     * @param views
+     */
+    void renderBatch(const std::vector<View>& views);
+    glm::vec3 calculateColor(int x, int y, glm::vec3 eye, glm::vec3 direction, glm::vec3 right, glm::vec3 up, int width, int height, double view_width, double view_height) const;
 };
 
-void* fillImage(void* arg);
+template <>
+int World::lightBlock<float>(size_t first, const Hit& hit, glm::vec3 N, glm::vec3 V, glm::vec3* contributions) const;
 
 #endif //GRAPHICS_RAYTRACING_H
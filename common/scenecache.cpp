@@ -0,0 +1,204 @@
+#include "scenecache.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define SCENE_MAGIC "RTSCENE"
+#define SCENE_VERSION 2
+#define SCENE_SECTIONS 10
+// Arrays are aligned to cache lines in the file
+#define SCENE_ALIGNMENT 64
+
+static uint64_t align(uint64_t offset) {
+  return (offset + SCENE_ALIGNMENT - 1) / SCENE_ALIGNMENT * SCENE_ALIGNMENT;
+}
+
+template <typename T>
+static bool fits(uint64_t offset, uint64_t count, uint32_t elementSize, size_t size) {
+  return elementSize == sizeof(T) && offset % SCENE_ALIGNMENT == 0 && offset <= size && count <= (size - offset) / sizeof(T);
+}
+
+template <typename T>
+static void copy(const char* base, uint64_t offset, uint64_t count, std::vector<T>& out) {
+  const T* begin = (const T*)(base + offset);
+  out.assign(begin, begin + count);
+}
+
+template <typename T>
+static bool put(FILE* f, uint64_t& position, uint64_t offset, const std::vector<T>& data) {
+  static const char zeros[SCENE_ALIGNMENT] = {};
+  if (fwrite(zeros, 1, offset - position, f) != offset - position) return false;
+  position = offset + data.size() * sizeof(T);
+  return fwrite(data.data(), sizeof(T), data.size(), f) == data.size();
+}
+
+bool SceneCache::read(const std::string &file, uint64_t key, Polygon &polygon) const {
+  int fd = ::open(file.c_str(), O_RDONLY);
+  if (fd < 0) return false;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(Header)) {
+    close(fd);
+    return false;
+  }
+  size_t size = (size_t)st.st_size;
+  void* map = mmap(NULL, size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) return false;
+  const char* base = (const char*)map;
+  const Header* header = (const Header*)map;
+
+  bool ok = memcmp(header->magic, SCENE_MAGIC, 8) == 0 && header->version == SCENE_VERSION &&
+            header->sections == SCENE_SECTIONS && header->key == key && header->size == size &&
+            fits<glm::vec3>(header->positions.offset, header->positions.count, header->positions.elementSize, size) &&
+            fits<uint32_t>(header->normals.offset, header->normals.count, header->normals.elementSize, size) &&
+            fits<glm::vec2>(header->uvs.offset, header->uvs.count, header->uvs.elementSize, size) &&
+            fits<glm::uvec3>(header->positionIndices.offset, header->positionIndices.count, header->positionIndices.elementSize, size) &&
+            fits<glm::uvec3>(header->normalIndices.offset, header->normalIndices.count, header->normalIndices.elementSize, size) &&
+            fits<glm::uvec3>(header->uvIndices.offset, header->uvIndices.count, header->uvIndices.elementSize, size) &&
+            fits<BVHNode>(header->nodes.offset, header->nodes.count, header->nodes.elementSize, size) &&
+            fits<uint32_t>(header->indices.offset, header->indices.count, header->indices.elementSize, size) &&
+            fits<TrianglePack>(header->packs.offset, header->packs.count, header->packs.elementSize, size) &&
+            fits<uint32_t>(header->leafPacks.offset, header->leafPacks.count, header->leafPacks.elementSize, size) &&
+            header->leafPacks.count == header->nodes.count;
+  if (ok) {
+    TriangleMesh& mesh = polygon.triangles;
+    copy(base, header->positions.offset, header->positions.count, mesh.positions);
+    copy(base, header->normals.offset, header->normals.count, mesh.normals);
+    copy(base, header->uvs.offset, header->uvs.count, mesh.uvs);
+    copy(base, header->positionIndices.offset, header->positionIndices.count, mesh.positionIndices);
+    copy(base, header->normalIndices.offset, header->normalIndices.count, mesh.normalIndices);
+    copy(base, header->uvIndices.offset, header->uvIndices.count, mesh.uvIndices);
+    copy(base, header->nodes.offset, header->nodes.count, polygon.bvh.nodes);
+    copy(base, header->indices.offset, header->indices.count, polygon.bvh.indices);
+    copy(base, header->packs.offset, header->packs.count, polygon.packs);
+    copy(base, header->leafPacks.offset, header->leafPacks.count, polygon.leafPacks);
+  }
+  munmap(map, size);
+  if (!ok) return false;
+
+  // Leaves must stay inside the arrays they index, anything else means a damaged file
+  for (size_t n = 0; n < polygon.bvh.nodes.size() && ok; ++n) {
+    const BVHNode& node = polygon.bvh.nodes[n];
+    if (node.leaf()) {
+      ok = (uint64_t)node.first + node.count <= polygon.bvh.indices.size() &&
+           (uint64_t)polygon.leafPacks[n] + (node.count + SIMD_WIDTH - 1) / SIMD_WIDTH <= polygon.packs.size();
+    }
+    else {
+      ok = n + 1 < polygon.bvh.nodes.size() && node.first < polygon.bvh.nodes.size();
+    }
+  }
+  const TriangleMesh& mesh = polygon.triangles;
+  for (uint32_t i: polygon.bvh.indices) {
+    if (i >= mesh.size()) ok = false;
+  }
+  // Attribute arrays are either empty or one triple per triangle, MESH_NONE only for normals and uvs
+  auto inside = [&](const std::vector<glm::uvec3>& triples, size_t count, bool optional) {
+    if (triples.empty()) return optional;
+    if (triples.size() != mesh.size()) return false;
+    for (auto const & c: triples) {
+      for (int k = 0; k < 3; ++k) {
+        if (c[k] >= count && !(optional && c[k] == MESH_NONE)) return false;
+      }
+    }
+    return true;
+  };
+  return ok && inside(mesh.positionIndices, mesh.positions.size(), mesh.size() == 0) &&
+         inside(mesh.normalIndices, mesh.normals.size(), true) && inside(mesh.uvIndices, mesh.uvs.size(), true);
+}
+
+// Written next to the target and renamed over it, so a reader never sees half a file
+bool SceneCache::write(const std::string &file, uint64_t key, const Polygon &polygon) const {
+  Header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, SCENE_MAGIC, 8);
+  header.version = SCENE_VERSION;
+  header.sections = SCENE_SECTIONS;
+  header.key = key;
+  uint64_t offset = align(sizeof(Header));
+  auto place = [&](Section& section, size_t count, size_t elementSize) {
+    section.offset = offset;
+    section.count = count;
+    section.elementSize = (uint32_t)elementSize;
+    offset = align(offset + count * elementSize);
+  };
+  const TriangleMesh& mesh = polygon.triangles;
+  place(header.positions, mesh.positions.size(), sizeof(glm::vec3));
+  place(header.normals, mesh.normals.size(), sizeof(uint32_t));
+  place(header.uvs, mesh.uvs.size(), sizeof(glm::vec2));
+  place(header.positionIndices, mesh.positionIndices.size(), sizeof(glm::uvec3));
+  place(header.normalIndices, mesh.normalIndices.size(), sizeof(glm::uvec3));
+  place(header.uvIndices, mesh.uvIndices.size(), sizeof(glm::uvec3));
+  place(header.nodes, polygon.bvh.nodes.size(), sizeof(BVHNode));
+  place(header.indices, polygon.bvh.indices.size(), sizeof(uint32_t));
+  place(header.packs, polygon.packs.size(), sizeof(TrianglePack));
+  place(header.leafPacks, polygon.leafPacks.size(), sizeof(uint32_t));
+  header.size = offset;
+
+  std::string temporary = file + ".tmp" + std::to_string(getpid());
+  FILE* f = fopen(temporary.c_str(), "wb");
+  if (!f) return false;
+  uint64_t position = sizeof(Header);
+  bool ok = fwrite(&header, sizeof(Header), 1, f) == 1 &&
+            put(f, position, header.positions.offset, mesh.positions) &&
+            put(f, position, header.normals.offset, mesh.normals) &&
+            put(f, position, header.uvs.offset, mesh.uvs) &&
+            put(f, position, header.positionIndices.offset, mesh.positionIndices) &&
+            put(f, position, header.normalIndices.offset, mesh.normalIndices) &&
+            put(f, position, header.uvIndices.offset, mesh.uvIndices) &&
+            put(f, position, header.nodes.offset, polygon.bvh.nodes) &&
+            put(f, position, header.indices.offset, polygon.bvh.indices) &&
+            put(f, position, header.packs.offset, polygon.packs) &&
+            put(f, position, header.leafPacks.offset, polygon.leafPacks) &&
+            put(f, position, header.size, std::vector<char>());
+  ok = fclose(f) == 0 && ok;
+  if (ok) ok = rename(temporary.c_str(), file.c_str()) == 0;
+  if (!ok) unlink(temporary.c_str());
+  return ok;
+}
+
+bool SceneCache::loadPolygon(const char *path, const glm::mat4 &transform, Polygon &polygon) const {
+  struct stat st;
+  if (stat(path, &st) != 0) return false;
+
+  // The file is named after the source and transform, its key also covers the state of the source
+  uint64_t h = 14695981039346656037ull;
+  auto mix = [&](const void* data, size_t size) {
+    for (size_t i = 0; i < size; ++i) {
+      h = (h ^ ((const unsigned char*)data)[i]) * 1099511628211ull;
+    }
+  };
+  mix(path, strlen(path));
+  mix(&transform[0][0], sizeof(float) * 16);
+  char name[32];
+  snprintf(name, sizeof(name), "/%016llx.scene", (unsigned long long)h);
+  std::string file = directory + name;
+  uint32_t layout[] = {SCENE_VERSION, SIMD_WIDTH, (uint32_t)sizeof(glm::uvec3), (uint32_t)sizeof(BVHNode), (uint32_t)sizeof(TrianglePack)};
+  int64_t source[] = {(int64_t)st.st_size, (int64_t)st.st_mtim.tv_sec, (int64_t)st.st_mtim.tv_nsec, (int64_t)st.st_ino};
+  mix(layout, sizeof(layout));
+  mix(source, sizeof(source));
+  uint64_t key = h;
+
+  if (!directory.empty() && read(file, key, polygon)) {
+    printf("Loaded %zu compiled triangles of %s from %s\n", polygon.triangles.size(), path, file.c_str());
+    return true;
+  }
+  Mesh mesh;
+  if (!loadOBJ(path, mesh)) return false;
+  for (auto & p: mesh.positions) {
+    p = glm::vec3(transform * glm::vec4(p, 1.0f));
+  }
+  glm::mat3 normalMatrix = glm::transpose(glm::inverse(glm::mat3(transform)));
+  for (auto & n: mesh.normals) {
+    n = glm::normalize(normalMatrix * n);
+  }
+  polygon.setMesh(mesh);
+  if (!directory.empty()) {
+    mkdir(directory.c_str(), 0755);
+    if (!write(file, key, polygon)) printf("Could not write the scene cache %s\n", file.c_str());
+  }
+  return true;
+}
@@ -0,0 +1,54 @@
+#ifndef GRAPHICS_SCENECACHE_H
+#define GRAPHICS_SCENECACHE_H
+
+#include <string>
+#include <cstdint>
+
+#include <glm/glm.hpp>
+
+#include "object.h"
+
+/**
+ * Compiled meshes on disk. The first load of an OBJ file parses it, builds the polygon and writes
+ * its vertex and index arrays, BVH and triangle packs to a binary file in the cache directory. Later loads map
+ * that file and copy the arrays in as they are, without parsing or building anything. The file
+ * is keyed by the size, modification time and inode of the source and by the transform, so it is
+ * rebuilt when either changes, and by the layout of the stored types, so it is rebuilt by a build
+ * with another SIMD width.
+ */
+class SceneCache {
+private:
+    // Array at offset bytes from the start of the file
+    struct Section {
+        uint64_t offset;
+        uint64_t count;
+        uint32_t elementSize;
+        uint32_t reserved;
+    };
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t sections;
+        uint64_t key;
+        uint64_t size;
+        Section positions, normals, uvs, positionIndices, normalIndices, uvIndices;
+        Section nodes, indices, packs, leafPacks;
+    };
+    std::string directory;
+    bool read(const std::string& file, uint64_t key, Polygon& polygon) const;
+    bool write(const std::string& file, uint64_t key, const Polygon& polygon) const;
+public:
+    // An empty directory loads and builds every time
+    SceneCache(const std::string& directory = "") : directory(directory) {};
+    void setDirectory(const std::string& directory) { this->directory = directory; }
+    /**
+     * Fill a polygon with the triangles of an OBJ file, from the cache when it holds them
+     * @param path OBJ file
+     * @param transform applied to the positions
+     * @param polygon constructed with its material only
+     * @return false when the OBJ file can not be loaded
+     */
+    bool loadPolygon(const char* path, const glm::mat4& transform, Polygon& polygon) const;
+};
+
+#endif //GRAPHICS_SCENECACHE_H
@@ -0,0 +1,213 @@
+#ifndef GRAPHICS_SIMD_H
+#define GRAPHICS_SIMD_H
+
+// Thin wrapper over the widest float vector the target supports.
+// floatv holds SIMD_WIDTH lanes, maskv holds one comparison result per lane.
+// Loads and stores are unaligned since std::vector does not honour alignas before C++17.
+
+#include <cmath>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#define SIMD_WIDTH 8
+#elif defined(__SSE4_1__)
+#include <smmintrin.h>
+#define SIMD_WIDTH 4
+#else
+#define SIMD_WIDTH 1
+#endif
+
+#define SIMD_ALIGN 32
+
+#if SIMD_WIDTH == 8
+
+struct maskv {
+    __m256 m;
+    maskv(__m256 m) : m(m) {};
+    int bits() const { return _mm256_movemask_ps(m); }
+    bool any() const { return bits() != 0; }
+};
+inline maskv operator&(maskv a, maskv b) { return _mm256_and_ps(a.m, b.m); }
+inline maskv operator|(maskv a, maskv b) { return _mm256_or_ps(a.m, b.m); }
+
+struct floatv {
+    __m256 v;
+    floatv() {};
+    floatv(__m256 v) : v(v) {};
+    floatv(float f) : v(_mm256_set1_ps(f)) {};
+    static floatv load(const float* p) { return _mm256_loadu_ps(p); }
+    void store(float* p) const { _mm256_storeu_ps(p, v); }
+};
+inline floatv operator+(floatv a, floatv b) { return _mm256_add_ps(a.v, b.v); }
+inline floatv operator-(floatv a, floatv b) { return _mm256_sub_ps(a.v, b.v); }
+inline floatv operator*(floatv a, floatv b) { return _mm256_mul_ps(a.v, b.v); }
+inline floatv operator/(floatv a, floatv b) { return _mm256_div_ps(a.v, b.v); }
+inline floatv operator-(floatv a) { return _mm256_xor_ps(a.v, _mm256_set1_ps(-0.0f)); }
+inline maskv operator<(floatv a, floatv b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ); }
+inline maskv operator<=(floatv a, floatv b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ); }
+inline maskv operator>(floatv a, floatv b) { return _mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ); }
+inline maskv operator>=(floatv a, floatv b) { return _mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ); }
+inline maskv operator==(floatv a, floatv b) { return _mm256_cmp_ps(a.v, b.v, _CMP_EQ_OQ); }
+inline maskv operator!=(floatv a, floatv b) { return _mm256_cmp_ps(a.v, b.v, _CMP_NEQ_UQ); }
+inline floatv vmin(floatv a, floatv b) { return _mm256_min_ps(a.v, b.v); }
+inline floatv vmax(floatv a, floatv b) { return _mm256_max_ps(a.v, b.v); }
+inline floatv vsqrt(floatv a) { return _mm256_sqrt_ps(a.v); }
+inline floatv vabs(floatv a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a.v); }
+inline floatv select(maskv m, floatv a, floatv b) { return _mm256_blendv_ps(b.v, a.v, m.m); }
+inline float hmin(floatv a) {
+  __m128 m = _mm_min_ps(_mm256_castps256_ps128(a.v), _mm256_extractf128_ps(a.v, 1));
+  m = _mm_min_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(1, 0, 3, 2)));
+  m = _mm_min_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1)));
+  return _mm_cvtss_f32(m);
+}
+inline floatv vround(floatv a) { return _mm256_round_ps(a.v, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC); }
+// AVX has no 256-bit integer shifts, the exponent bits are moved in 128-bit halves
+inline floatv vexponent(floatv a) {
+  __m256i bits = _mm256_castps_si256(a.v);
+  __m128i lo = _mm_srli_epi32(_mm256_castsi256_si128(bits), 23);
+  __m128i hi = _mm_srli_epi32(_mm256_extractf128_si256(bits, 1), 23);
+  return _mm256_cvtepi32_ps(_mm256_insertf128_si256(_mm256_castsi128_si256(lo), hi, 1)) - floatv(127.0f);
+}
+inline floatv vexp2i(floatv n) {
+  __m256i e = _mm256_cvtps_epi32((n + floatv(127.0f)).v);
+  __m128i lo = _mm_slli_epi32(_mm256_castsi256_si128(e), 23);
+  __m128i hi = _mm_slli_epi32(_mm256_extractf128_si256(e, 1), 23);
+  return _mm256_castsi256_ps(_mm256_insertf128_si256(_mm256_castsi128_si256(lo), hi, 1));
+}
+
+#elif SIMD_WIDTH == 4
+
+struct maskv {
+    __m128 m;
+    maskv(__m128 m) : m(m) {};
+    int bits() const { return _mm_movemask_ps(m); }
+    bool any() const { return bits() != 0; }
+};
+inline maskv operator&(maskv a, maskv b) { return _mm_and_ps(a.m, b.m); }
+inline maskv operator|(maskv a, maskv b) { return _mm_or_ps(a.m, b.m); }
+
+struct floatv {
+    __m128 v;
+    floatv() {};
+    floatv(__m128 v) : v(v) {};
+    floatv(float f) : v(_mm_set1_ps(f)) {};
+    static floatv load(const float* p) { return _mm_loadu_ps(p); }
+    void store(float* p) const { _mm_storeu_ps(p, v); }
+};
+inline floatv operator+(floatv a, floatv b) { return _mm_add_ps(a.v, b.v); }
+inline floatv operator-(floatv a, floatv b) { return _mm_sub_ps(a.v, b.v); }
+inline floatv operator*(floatv a, floatv b) { return _mm_mul_ps(a.v, b.v); }
+inline floatv operator/(floatv a, floatv b) { return _mm_div_ps(a.v, b.v); }
+inline floatv operator-(floatv a) { return _mm_xor_ps(a.v, _mm_set1_ps(-0.0f)); }
+inline maskv operator<(floatv a, floatv b) { return _mm_cmplt_ps(a.v, b.v); }
+inline maskv operator<=(floatv a, floatv b) { return _mm_cmple_ps(a.v, b.v); }
+inline maskv operator>(floatv a, floatv b) { return _mm_cmpgt_ps(a.v, b.v); }
+inline maskv operator>=(floatv a, floatv b) { return _mm_cmpge_ps(a.v, b.v); }
+inline maskv operator==(floatv a, floatv b) { return _mm_cmpeq_ps(a.v, b.v); }
+inline maskv operator!=(floatv a, floatv b) { return _mm_cmpneq_ps(a.v, b.v); }
+inline floatv vmin(floatv a, floatv b) { return _mm_min_ps(a.v, b.v); }
+inline floatv vmax(floatv a, floatv b) { return _mm_max_ps(a.v, b.v); }
+inline floatv vsqrt(floatv a) { return _mm_sqrt_ps(a.v); }
+inline floatv vabs(floatv a) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), a.v); }
+inline floatv select(maskv m, floatv a, floatv b) { return _mm_blendv_ps(b.v, a.v, m.m); }
+inline float hmin(floatv a) {
+  __m128 m = _mm_min_ps(a.v, _mm_shuffle_ps(a.v, a.v, _MM_SHUFFLE(1, 0, 3, 2)));
+  m = _mm_min_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1)));
+  return _mm_cvtss_f32(m);
+}
+inline floatv vround(floatv a) { return _mm_round_ps(a.v, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC); }
+inline floatv vexponent(floatv a) {
+  return _mm_cvtepi32_ps(_mm_srli_epi32(_mm_castps_si128(a.v), 23)) - floatv(127.0f);
+}
+inline floatv vexp2i(floatv n) {
+  return _mm_castsi128_ps(_mm_slli_epi32(_mm_cvtps_epi32((n + floatv(127.0f)).v), 23));
+}
+
+#else
+
+struct maskv {
+    bool m;
+    maskv(bool m) : m(m) {};
+    int bits() const { return m ? 1 : 0; }
+    bool any() const { return m; }
+};
+inline maskv operator&(maskv a, maskv b) { return a.m && b.m; }
+inline maskv operator|(maskv a, maskv b) { return a.m || b.m; }
+
+struct floatv {
+    float v;
+    floatv() {};
+    floatv(float f) : v(f) {};
+    static floatv load(const float* p) { return *p; }
+    void store(float* p) const { *p = v; }
+};
+inline floatv operator+(floatv a, floatv b) { return a.v + b.v; }
+inline floatv operator-(floatv a, floatv b) { return a.v - b.v; }
+inline floatv operator*(floatv a, floatv b) { return a.v * b.v; }
+inline floatv operator/(floatv a, floatv b) { return a.v / b.v; }
+inline floatv operator-(floatv a) { return -a.v; }
+inline maskv operator<(floatv a, floatv b) { return a.v < b.v; }
+inline maskv operator<=(floatv a, floatv b) { return a.v <= b.v; }
+inline maskv operator>(floatv a, floatv b) { return a.v > b.v; }
+inline maskv operator>=(floatv a, floatv b) { return a.v >= b.v; }
+inline maskv operator==(floatv a, floatv b) { return a.v == b.v; }
+inline maskv operator!=(floatv a, floatv b) { return a.v != b.v; }
+inline floatv vmin(floatv a, floatv b) { return a.v < b.v ? a.v : b.v; }
+inline floatv vmax(floatv a, floatv b) { return a.v > b.v ? a.v : b.v; }
+inline floatv vsqrt(floatv a) { return std::sqrt(a.v); }
+inline floatv vabs(floatv a) { return std::fabs(a.v); }
+inline floatv select(maskv m, floatv a, floatv b) { return m.m ? a : b; }
+inline float hmin(floatv a) { return a.v; }
+inline floatv vround(floatv a) { return std::nearbyint(a.v); }
+inline floatv vexponent(floatv a) { return (float)(std::ilogb(a.v)); }
+inline floatv vexp2i(floatv n) { return std::ldexp(1.0f, (int)n.v); }
+
+#endif
+
+// vexponent is the unbiased exponent of a positive normal float and vexp2i is 2^n for an integer n
+// in the normal range, both by moving the exponent bits. vlog2 and vexp2 build on them and are
+// accurate to about 1e-7.
+
+// log2(x) for positive normal x, from the exponent and the atanh series of the mantissa
+inline floatv vlog2(floatv x) {
+  floatv e = vexponent(x);
+  floatv m = x / vexp2i(e);
+  // Center the mantissa on 1 so the series converges fast
+  maskv high = m > floatv(1.41421356f);
+  m = select(high, m * floatv(0.5f), m);
+  e = select(high, e + floatv(1.0f), e);
+  floatv t = (m - floatv(1.0f)) / (m + floatv(1.0f));
+  floatv t2 = t * t;
+  floatv series = floatv(1.0f / 9) * t2 + floatv(1.0f / 7);
+  series = series * t2 + floatv(1.0f / 5);
+  series = series * t2 + floatv(1.0f / 3);
+  series = series * t2 + floatv(1.0f);
+  return e + floatv(2.88539008f) * t * series;
+}
+
+// 2^y, 0 below the normal range and only valid up to 2^127
+inline floatv vexp2(floatv y) {
+  floatv n = vround(vmax(y, floatv(-126.0f)));
+  // exp(f ln 2) for f in [-0.5, 0.5] by its Taylor series
+  floatv f = (y - n) * floatv(0.693147181f);
+  floatv p = floatv(1.0f / 5040) * f + floatv(1.0f / 720);
+  p = p * f + floatv(1.0f / 120);
+  p = p * f + floatv(1.0f / 24);
+  p = p * f + floatv(1.0f / 6);
+  p = p * f + floatv(0.5f);
+  p = p * f + floatv(1.0f);
+  p = p * f + floatv(1.0f);
+  return select(y < floatv(-126.0f), floatv(0.0f), p * vexp2i(n));
+}
+
+// x^y for positive normal x
+inline floatv vpow(floatv x, floatv y) {
+  return vexp2(y * vlog2(x));
+}
+
+// Index of the lowest set lane, or -1
+inline int firstLane(int bits) {
+  return bits ? __builtin_ctz(bits) : -1;
+}
+
+#endif //GRAPHICS_SIMD_H
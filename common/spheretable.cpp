@@ -0,0 +1,175 @@
+#include "spheretable.h"
+
+SpherePack::SpherePack() {
+  for (int i = 0; i < SIMD_WIDTH; ++i) {
+    // Padding lanes have a negative squared radius and never hit
+    center[0][i] = center[1][i] = center[2][i] = 0.0f;
+    radius2[i] = -1.0f;
+    id[i] = (uint32_t)-1;
+  }
+}
+
+void SpherePack::set(int lane, glm::vec3 center, float radius, uint32_t id) {
+  for (int k = 0; k < 3; ++k) {
+    this->center[k][lane] = center[k];
+  }
+  radius2[lane] = radius * radius;
+  this->id[lane] = id;
+}
+
+/**
+ * Near side of every sphere along a unit direction, with the same thresholds as Sphere::intersect.
+ * The discriminant is taken from the distance between the center and the ray, which loses less
+ * precision than udp^2 - |dp|^2 + r^2.
+ * @param r
+ * @param tmax
+ * @param t distance per lane
+ * @return lanes hit closer than tmax
+ */
+inline maskv SpherePack::test(const Ray &r, float tmax, floatv &t) const {
+  floatv dx(r.direction.x), dy(r.direction.y), dz(r.direction.z);
+  floatv px = floatv::load(center[0]) - floatv(r.origin.x);
+  floatv py = floatv::load(center[1]) - floatv(r.origin.y);
+  floatv pz = floatv::load(center[2]) - floatv(r.origin.z);
+  floatv udp = dx * px + dy * py + dz * pz;
+  floatv cx = px - dx * udp;
+  floatv cy = py - dy * udp;
+  floatv cz = pz - dz * udp;
+  floatv det = floatv::load(radius2) - (cx * cx + cy * cy + cz * cz);
+  t = udp - vsqrt(vmax(det, floatv(0.0f)));
+  return (det > floatv(EPSILON)) & (t >= floatv(EPSILON)) & (t < floatv(tmax));
+}
+
+/**
+ * Nearest hit among the lanes
+ * @param r
+ * @param tmax shrunk to the distance of the nearest hit
+ * @return lane of the nearest hit closer than tmax, or -1
+ */
+int SpherePack::intersect(const Ray &r, float &tmax) const {
+  floatv t;
+  maskv hit = test(r, tmax, t);
+  if (!hit.any()) return -1;
+  t = select(hit, t, floatv(INFINITY));
+  float nearest = hmin(t);
+  tmax = nearest;
+  return firstLane((hit & (t == floatv(nearest))).bits());
+}
+
+bool SpherePack::occluded(const Ray &r, float tmax) const {
+  floatv t;
+  return test(r, tmax, t).any();
+}
+
+/**
+ * Every sphere in the pack against the lanes of a packet
+ * @param packet tmax and primitive are updated for the lanes hit
+ * @param mask
+ * @return lanes hit
+ */
+int SpherePack::intersectPacket(RayPacket &packet, int mask) const {
+  floatv dx = floatv::load(packet.direction[0]), dy = floatv::load(packet.direction[1]), dz = floatv::load(packet.direction[2]);
+  floatv ox = floatv::load(packet.origin[0]), oy = floatv::load(packet.origin[1]), oz = floatv::load(packet.origin[2]);
+  int updated = 0;
+  for (int i = 0; i < SIMD_WIDTH && id[i] != (uint32_t)-1; ++i) {
+    floatv px = floatv(center[0][i]) - ox;
+    floatv py = floatv(center[1][i]) - oy;
+    floatv pz = floatv(center[2][i]) - oz;
+    floatv udp = dx * px + dy * py + dz * pz;
+    floatv cx = px - dx * udp;
+    floatv cy = py - dy * udp;
+    floatv cz = pz - dz * udp;
+    floatv det = floatv(radius2[i]) - (cx * cx + cy * cy + cz * cz);
+    floatv t = udp - vsqrt(vmax(det, floatv(0.0f)));
+    int hit = ((det > floatv(EPSILON)) & (t >= floatv(EPSILON)) & (t < floatv::load(packet.tmax))).bits() & mask;
+    if (!hit) continue;
+    float lanes[SIMD_WIDTH];
+    t.store(lanes);
+    for (int lane = firstLane(hit); lane >= 0; hit &= hit - 1, lane = firstLane(hit)) {
+      packet.tmax[lane] = lanes[lane];
+      packet.u[lane] = packet.v[lane] = 0.0f;
+      packet.primitive[lane] = id[i];
+      updated |= 1 << lane;
+    }
+  }
+  return updated;
+}
+
+SphereTable::SphereTable(const std::vector<glm::vec3>& centers, const std::vector<float>& radii, glm::vec3 ambient, glm::vec3 diffuse, glm::vec3 specular, double gloss, double n, bool reflective, bool refractive)
+    : Object(ambient, diffuse, specular, gloss, n, reflective, refractive), centers(centers), radii(radii) {
+  assert(centers.size() == radii.size());
+  std::vector<AABB> boxes;
+  boxes.reserve(centers.size());
+  for (size_t i = 0; i < centers.size(); ++i) {
+    glm::vec3 r = glm::vec3(radii[i]);
+    boxes.push_back(AABB(centers[i] - r, centers[i] + r));
+  }
+  bvh.build(boxes, SIMD_WIDTH, SIMD_WIDTH);
+  // Pack the spheres of every leaf so the leaf is tested in one kernel call
+  leafPacks.assign(bvh.nodes.size(), 0);
+  for (uint32_t n = 0; n < bvh.nodes.size(); ++n) {
+    const BVHNode& node = bvh.nodes[n];
+    if (!node.leaf()) continue;
+    leafPacks[n] = (uint32_t)packs.size();
+    for (uint32_t i = 0; i < node.count; ++i) {
+      if (i % SIMD_WIDTH == 0) packs.push_back(SpherePack());
+      uint32_t id = bvh.indices[node.first + i];
+      packs.back().set(i % SIMD_WIDTH, centers[id], radii[id], id);
+    }
+  }
+}
+
+std::experimental::optional<Hit> SphereTable::intersect(const Ray &r, float tmax) const {
+  Hit hit;
+  bool found = false;
+  bvh.traverseLeaves(r.origin, r.direction, tmax, [&](uint32_t n, float& tmax) {
+    const BVHNode& node = bvh.nodes[n];
+    uint32_t end = leafPacks[n] + (node.count + SIMD_WIDTH - 1) / SIMD_WIDTH;
+    for (uint32_t i = leafPacks[n]; i < end; ++i) {
+      int lane = packs[i].intersect(r, tmax);
+      if (lane >= 0) {
+        hit.primitive = packs[i].id[lane];
+        found = true;
+      }
+    }
+  });
+  if (!found) return {};
+  hit.distance = tmax;
+  hit.point = r.origin + tmax * r.direction;
+  hit.barycentric = glm::vec2(0.0f);
+  hit.object = this;
+  return hit;
+}
+
+void SphereTable::surface(const Ray &r, Hit &hit) const {
+  sphereSurface(centers[hit.primitive], radii[hit.primitive], bumpmap, r, hit);
+}
+
+bool SphereTable::occluded(const Ray &r, float tmax) const {
+  return bvh.anyLeaves(r.origin, r.direction, tmax, [&](uint32_t n, float tmax) {
+    const BVHNode& node = bvh.nodes[n];
+    uint32_t end = leafPacks[n] + (node.count + SIMD_WIDTH - 1) / SIMD_WIDTH;
+    for (uint32_t i = leafPacks[n]; i < end; ++i) {
+      if (packs[i].occluded(r, tmax)) return true;
+    }
+    return false;
+  });
+}
+
+void SphereTable::intersectPacket(RayPacket &packet, int mask) const {
+  bvh.traversePacket(packet, mask, [&](uint32_t n, int mask) {
+    const BVHNode& node = bvh.nodes[n];
+    uint32_t end = leafPacks[n] + (node.count + SIMD_WIDTH - 1) / SIMD_WIDTH;
+    int hit = 0;
+    for (uint32_t i = leafPacks[n]; i < end; ++i) {
+      hit |= packs[i].intersectPacket(packet, mask);
+    }
+    for (int lane = firstLane(hit); lane >= 0; hit &= hit - 1, lane = firstLane(hit)) {
+      packet.object[lane] = this;
+    }
+  });
+}
+
+AABB SphereTable::bounds() const {
+  return bvh.bounds();
+}
@@ -0,0 +1,47 @@
+#ifndef GRAPHICS_SPHERETABLE_H
+#define GRAPHICS_SPHERETABLE_H
+
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "object.h"
+
+// SIMD_WIDTH spheres in structure-of-arrays layout, tested together by one kernel call
+class SpherePack {
+private:
+    float center[3][SIMD_WIDTH];
+    float radius2[SIMD_WIDTH];
+    maskv test(const Ray& r, float tmax, floatv& t) const;
+public:
+    uint32_t id[SIMD_WIDTH];
+    SpherePack();
+    void set(int lane, glm::vec3 center, float radius, uint32_t id);
+    int intersect(const Ray& r, float& tmax) const;
+    bool occluded(const Ray& r, float tmax) const;
+    int intersectPacket(RayPacket& packet, int mask) const;
+};
+
+/**
+ * Many spheres of one material as one object, for particle scenes. Centers and radii are kept in
+ * arrays of their own, and a BVH over the spheres packs up to SIMD_WIDTH of them into every leaf so
+ * the leaf is tested in one kernel call. Unlike Sphere the kernel stays in single precision.
+ */
+class SphereTable final : public Object {
+private:
+    std::vector<glm::vec3> centers;
+    std::vector<float> radii;
+    BVH bvh;
+    std::vector<SpherePack> packs;
+    std::vector<uint32_t> leafPacks;
+public:
+    SphereTable(const std::vector<glm::vec3>& centers, const std::vector<float>& radii, glm::vec3 ambient, glm::vec3 diffuse, glm::vec3 specular, double gloss, double n, bool reflective, bool refractive);
+    size_t size() const { return centers.size(); }
+    std::experimental::optional<Hit> intersect(const Ray& r, float tmax = INFINITY) const;
+    void surface(const Ray& r, Hit& hit) const;
+    bool occluded(const Ray& r, float tmax) const;
+    void intersectPacket(RayPacket& packet, int mask) const;
+    AABB bounds() const;
+};
+
+#endif //GRAPHICS_SPHERETABLE_H
@@ -1,40 +1,249 @@
 #include "texture.h"
 
-Texture::Texture(const char *imagepath) {
-  FILE * file = fopen(imagepath, "rb");
-  assert(file);
+#include <cstdio>
+#include <cmath>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-  unsigned char header[54];
+#define TEXTURE_LOCAL_BLOCKS 64
 
-  assert(fread(header, 1, 54, file) == 54);
-  assert(header[0] == 'B' && header[1] == 'M');
+// Blocks this thread used last, by key
+struct LocalBlock {
+    uint64_t key;
+    std::shared_ptr<const TextureBlock> block;
+};
+static thread_local LocalBlock localBlocks[TEXTURE_LOCAL_BLOCKS];
+static thread_local TextureStats textureStats;
 
-  assert(*(int*)&(header[0x1E]) == 0);
-  assert(*(int*)&(header[0x1C]) == 24);
+// File ids start at 1, so no key is 0
+static uint64_t blockKey(uint32_t id, int level, int block) {
+  return (uint64_t)id << 40 | (uint64_t)level << 35 | (uint64_t)block;
+}
+
+// Texel shown in place of a file that could not be loaded
+static const unsigned char missingTexel[4] = { 255, 0, 255, 0 };
+
+TextureFile::TextureFile(const std::string& path, uint32_t id) : map(NULL), mapSize(0), id(id) {
+  if (!load(path)) {
+    fprintf(stderr, "Could not load texture %s, it is not a readable uncompressed 24-bit BMP\n", path.c_str());
+    if (map) munmap(map, mapSize);
+    map = NULL;
+    mapSize = 0;
+    pixels = missingTexel;
+    stride = 4;
+    width = height = 1;
+  }
+
+  int w = width, h = height;
+  while (true) {
+    Level level;
+    level.width = w;
+    level.height = h;
+    level.blocksX = (w + TEXTURE_BLOCK - 1) / TEXTURE_BLOCK;
+    levels.push_back(level);
+    if (w == 1 && h == 1) break;
+    w = std::max(1, w / 2);
+    h = std::max(1, h / 2);
+  }
+}
+
+TextureFile::~TextureFile() {
+  if (map) munmap(map, mapSize);
+}
+
+bool TextureFile::load(const std::string& path) {
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) return false;
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return false;
+  }
+  if ((size_t)st.st_size < 54) {
+    close(fd);
+    return false;
+  }
+  void* mapped = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapped == MAP_FAILED) return false;
+  map = mapped;
+  mapSize = (size_t)st.st_size;
+
+  const unsigned char* header = (const unsigned char*)map;
+  if (header[0] != 'B' || header[1] != 'M') return false;
+  if (*(int*)&(header[0x1E]) != 0 || *(short*)&(header[0x1C]) != 24) return false;
 
   unsigned int dataPos = *(int*)&(header[0x0A]);
-  unsigned int imageSize = *(int*)&(header[0x22]);
   width = *(int*)&(header[0x12]);
   height = *(int*)&(header[0x16]);
+  if (width <= 0 || height <= 0) return false;
 
-  if (imageSize == 0) imageSize = width * height * 3;
   if (dataPos == 0) dataPos = 54;
+  // Rows are padded to four bytes
+  stride = (width * 3 + 3) & ~3;
+  if (dataPos + (size_t)stride * height > mapSize) return false;
+  pixels = header + dataPos;
+  return true;
+}
+
+glm::vec3 TextureFile::texel(int level, int x, int y) const {
+  const Level& l = levels[level];
+  x = std::min(std::max(x, 0), l.width - 1);
+  y = std::min(std::max(y, 0), l.height - 1);
+  int block = (y / TEXTURE_BLOCK) * l.blocksX + x / TEXTURE_BLOCK;
+  uint64_t key = blockKey(id, level, block);
+  LocalBlock& local = localBlocks[(block + level * 7 + id * 13) % TEXTURE_LOCAL_BLOCKS];
+  if (local.key == key) {
+    textureStats.hits++;
+  }
+  else {
+    local.block = TextureCache::instance().block(*this, level, block);
+    local.key = key;
+  }
+  return local.block->texels[(y % TEXTURE_BLOCK) * TEXTURE_BLOCK + x % TEXTURE_BLOCK];
+}
+
+// Level 0 comes from the file, every other level is the 2x2 box filter of the one above
+std::shared_ptr<const TextureBlock> TextureFile::decode(int level, int block) const {
+  std::shared_ptr<TextureBlock> result = std::make_shared<TextureBlock>();
+  const Level& l = levels[level];
+  int x0 = (block % l.blocksX) * TEXTURE_BLOCK;
+  int y0 = (block / l.blocksX) * TEXTURE_BLOCK;
+  if (level == 0) {
+    for (int y = y0; y < std::min(y0 + TEXTURE_BLOCK, l.height); ++y) {
+      for (int x = x0; x < std::min(x0 + TEXTURE_BLOCK, l.width); ++x) {
+        const unsigned char* bgr = pixels + (size_t)y * stride + x * 3;
+        result->texels[(y - y0) * TEXTURE_BLOCK + (x - x0)] = glm::vec3((int)bgr[2], (int)bgr[1], (int)bgr[0]) / 255.0f;
+      }
+    }
+    return result;
+  }
+  // The block covers at most 2x2 blocks of the level above, which are held for the whole block
+  const Level& above = levels[level - 1];
+  int aboveBlocksY = (above.height + TEXTURE_BLOCK - 1) / TEXTURE_BLOCK;
+  int bx0 = 2 * x0 / TEXTURE_BLOCK, by0 = 2 * y0 / TEXTURE_BLOCK;
+  std::shared_ptr<const TextureBlock> sources[2][2];
+  for (int j = 0; j < 2; ++j) {
+    for (int i = 0; i < 2; ++i) {
+      int bx = std::min(bx0 + i, above.blocksX - 1), by = std::min(by0 + j, aboveBlocksY - 1);
+      sources[j][i] = TextureCache::instance().block(*this, level - 1, by * above.blocksX + bx);
+    }
+  }
+  auto source = [&](int x, int y) {
+    x = std::min(x, above.width - 1);
+    y = std::min(y, above.height - 1);
+    const TextureBlock& b = *sources[y / TEXTURE_BLOCK - by0][x / TEXTURE_BLOCK - bx0];
+    return b.texels[(y % TEXTURE_BLOCK) * TEXTURE_BLOCK + x % TEXTURE_BLOCK];
+  };
+  for (int y = y0; y < std::min(y0 + TEXTURE_BLOCK, l.height); ++y) {
+    for (int x = x0; x < std::min(x0 + TEXTURE_BLOCK, l.width); ++x) {
+      result->texels[(y - y0) * TEXTURE_BLOCK + (x - x0)] =
+          (source(2 * x, 2 * y) + source(2 * x + 1, 2 * y) + source(2 * x, 2 * y + 1) + source(2 * x + 1, 2 * y + 1)) * 0.25f;
+    }
+  }
+  return result;
+}
 
-  data = new unsigned char[imageSize];
-  fread(data, 1, imageSize, file);
-  fclose(file);
+void TextureStats::add(const TextureStats &other) {
+  hits += other.hits;
+  shared += other.shared;
+  decoded += other.decoded;
+  evicted += other.evicted;
 }
 
-Texture::~Texture() {
-  delete [] data;
+TextureCache::TextureCache() : budget((size_t)256 << 20), nextId(1) {
+  for (auto & shard: shards) {
+    shard.bytes = 0;
+  }
 }
 
-glm::vec3 Texture::getTexture(double u, double v) {
-  int x = (int)((u + 1.0) / 2.0 * width);
-  int y = (int)((v + 1.0) / 2.0 * height);
-  unsigned char r = data[(y * width + x) * 3 + 2];
-  unsigned char g = data[(y * width + x) * 3 + 1];
-  unsigned char b = data[(y * width + x) * 3 + 0];
-  return glm::vec3((int)r, (int)g, (int)b) / 255;
+TextureCache& TextureCache::instance() {
+  static TextureCache cache;
+  return cache;
 }
 
+TextureStats& TextureCache::stats() {
+  return textureStats;
+}
+
+std::shared_ptr<TextureFile> TextureCache::open(const std::string &path) {
+  std::lock_guard<std::mutex> guard(filesLock);
+  std::shared_ptr<TextureFile> file = files[path].lock();
+  if (!file) {
+    file = std::make_shared<TextureFile>(path, nextId++);
+    files[path] = file;
+  }
+  return file;
+}
+
+/**
+ * Decoded block of a texture, decoded on a miss without holding the lock, since blocks of lower
+ * levels are built from the cache as well. Two threads may decode the same block, the first to
+ * finish keeps it.
+ * @param file
+ * @param level
+ * @param block
+ * @return
+ */
+std::shared_ptr<const TextureBlock> TextureCache::block(const TextureFile &file, int level, int block) {
+  uint64_t key = blockKey(file.id, level, block);
+  Shard& shard = shards[(key * 0x9E3779B97F4A7C15ull) >> 60];
+  {
+    std::lock_guard<std::mutex> guard(shard.lock);
+    auto it = shard.index.find(key);
+    if (it != shard.index.end()) {
+      shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+      textureStats.shared++;
+      return it->second->block;
+    }
+  }
+  textureStats.decoded++;
+  std::shared_ptr<const TextureBlock> decoded = file.decode(level, block);
+  std::lock_guard<std::mutex> guard(shard.lock);
+  auto it = shard.index.find(key);
+  if (it != shard.index.end()) return it->second->block;
+  shard.lru.push_front({key, decoded});
+  shard.index[key] = shard.lru.begin();
+  shard.bytes += sizeof(TextureBlock);
+  // Threads still holding an evicted block keep it alive until they move on
+  while (shard.bytes > budget / TEXTURE_CACHE_SHARDS && shard.lru.size() > 1) {
+    shard.index.erase(shard.lru.back().key);
+    shard.lru.pop_back();
+    shard.bytes -= sizeof(TextureBlock);
+    textureStats.evicted++;
+  }
+  return decoded;
+}
+
+Texture::Texture(const char *imagepath) : file(TextureCache::instance().open(imagepath)) {
+}
+
+glm::vec3 Texture::bilinear(int level, glm::vec2 uv) const {
+  const TextureFile::Level& l = file->levels[level];
+  float s = (uv.x + 1.0f) * 0.5f * l.width - 0.5f;
+  float t = (uv.y + 1.0f) * 0.5f * l.height - 0.5f;
+  int x = (int)std::floor(s);
+  int y = (int)std::floor(t);
+  float fx = s - x, fy = t - y;
+  glm::vec3 top = glm::mix(file->texel(level, x, y), file->texel(level, x + 1, y), fx);
+  glm::vec3 bottom = glm::mix(file->texel(level, x, y + 1), file->texel(level, x + 1, y + 1), fx);
+  return glm::mix(top, bottom, fy);
+}
+
+glm::vec3 Texture::getTexture(double u, double v) const {
+  return file->texel(0, (int)((u + 1.0) / 2.0 * file->width), (int)((v + 1.0) / 2.0 * file->height));
+}
+
+glm::vec3 Texture::sample(glm::vec2 uv, float footprint) const {
+  // Texels of the full resolution image the footprint covers, across the wider axis
+  float texels = footprint * 0.5f * std::max(file->width, file->height);
+  if (!(texels > 1.0f)) return bilinear(0, uv);
+  float lod = std::min(std::log2(texels), (float)(file->levels.size() - 1));
+  int level = (int)lod;
+  glm::vec3 c = bilinear(level, uv);
+  if (level + 1 == (int)file->levels.size()) return c;
+  return glm::mix(c, bilinear(level + 1, uv), lod - level);
+}
@@ -2,18 +2,116 @@
 #define GRAPHICS_TEXTURE_H
 
 #include <vector>
+#include <list>
+#include <string>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <cstdint>
 
 #include <glm/glm.hpp>
 #include <glm/ext.hpp>
 
+// Texels per side of the square blocks the mip levels are stored in
+#define TEXTURE_BLOCK 8
+// Independently locked parts of the texture cache, each with its share of the budget
+#define TEXTURE_CACHE_SHARDS 16
+
+struct TextureBlock {
+    glm::vec3 texels[TEXTURE_BLOCK * TEXTURE_BLOCK];
+};
+
+/**
+ * 24-bit BMP file mapped into memory. Its mip pyramid of float RGB is never built as a whole:
+ * TEXTURE_BLOCK x TEXTURE_BLOCK blocks of a level are decoded when first touched, level 0 from
+ * the file and every other level with a 2x2 box filter of the level above, and are kept in the
+ * TextureCache. Each thread remembers the last blocks it used, so most lookups take no lock.
+ * A file that can not be loaded is reported and reads as a single magenta texel.
+ */
+class TextureFile {
+private:
+    void* map;
+    size_t mapSize;
+    const unsigned char* pixels;
+    int stride;
+    std::shared_ptr<const TextureBlock> decode(int level, int block) const;
+    // Maps and checks the file, false when it can not be read or is not an uncompressed 24-bit BMP
+    bool load(const std::string& path);
+    friend class TextureCache;
+public:
+    struct Level {
+        int width, height;
+        int blocksX;
+    };
+    // Never reused, so blocks of a closed file can not be mistaken for those of a new one
+    uint32_t id;
+    int width, height;
+    std::vector<Level> levels;
+    TextureFile(const std::string& path, uint32_t id);
+    ~TextureFile();
+    // Texel of a mip level, clamped to its edges
+    glm::vec3 texel(int level, int x, int y) const;
+};
+
+// Texture block lookups of one thread
+struct TextureStats {
+    // Blocks found in the thread's own table, in the shared cache, or decoded
+    uint64_t hits;
+    uint64_t shared;
+    uint64_t decoded;
+    uint64_t evicted;
+    TextureStats() : hits(0), shared(0), decoded(0), evicted(0) {};
+    void add(const TextureStats& other);
+};
+
+/**
+ * Process-wide cache of texture files by path and of their decoded blocks, least recently used
+ * blocks are evicted once the budget is exceeded. Blocks of closed files age out the same way.
+ */
+class TextureCache {
+private:
+    struct Entry {
+        uint64_t key;
+        std::shared_ptr<const TextureBlock> block;
+    };
+    struct Shard {
+        std::mutex lock;
+        std::list<Entry> lru;
+        std::unordered_map<uint64_t, std::list<Entry>::iterator> index;
+        size_t bytes;
+    };
+    Shard shards[TEXTURE_CACHE_SHARDS];
+    size_t budget;
+    std::mutex filesLock;
+    std::unordered_map<std::string, std::weak_ptr<TextureFile>> files;
+    uint32_t nextId;
+    TextureCache();
+public:
+    static TextureCache& instance();
+    std::shared_ptr<TextureFile> open(const std::string& path);
+    std::shared_ptr<const TextureBlock> block(const TextureFile& file, int level, int block);
+    // Bytes of decoded blocks to keep, shared evenly by the shards
+    void setBudget(size_t bytes) { budget = bytes; }
+    // Lookup counters of the calling thread, renderers collect and reset them
+    static TextureStats& stats();
+};
+
+// Handle to a shared texture file. Texture coordinates run from -1 to 1 across the image.
 class Texture {
 private:
-    unsigned char* data;
-    unsigned int width, height;
+    std::shared_ptr<TextureFile> file;
+    glm::vec3 bilinear(int level, glm::vec2 uv) const;
 public:
     Texture(const char* imagepath);
-    ~Texture();
-    glm::vec3 getTexture(double u, double v);
+    // Unfiltered lookup in the full resolution image
+    glm::vec3 getTexture(double u, double v) const;
+    /**
+     * Trilinear lookup between the two mip levels closest to the footprint
+     * @param uv
+     * @param footprint width of the ray footprint in texture coordinates, 0 for the full resolution
+     * @return
+     */
+    glm::vec3 sample(glm::vec2 uv, float footprint) const;
 };
 
 #endif //GRAPHICS_TEXTURE_H
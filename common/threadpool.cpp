@@ -0,0 +1,107 @@
+#include "threadpool.h"
+
+#include <chrono>
+#include <thread>
+
+struct worker_arg {
+    ThreadPool* pool;
+    int id;
+};
+
+ThreadPool::ThreadPool(int threads) : queued(0), pending(0), next(0), stopping(false) {
+  if (threads <= 0) threads = (int)std::thread::hardware_concurrency();
+  if (threads <= 0) threads = 1;
+  for (int i = 0; i < threads; ++i) {
+    workers.push_back(std::unique_ptr<Worker>(new Worker()));
+    workers.back()->busy = 0.0;
+  }
+  for (int i = 0; i < threads; ++i) {
+    pthread_create(&workers[i]->thread, NULL, run, (void*)new worker_arg{this, i});
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    stopping = true;
+  }
+  wake.notify_all();
+  for (auto & w: workers) {
+    pthread_join(w->thread, NULL);
+  }
+}
+
+void* ThreadPool::run(void *arg) {
+  worker_arg* data = (worker_arg*)arg;
+  data->pool->loop(data->id);
+  delete data;
+  return NULL;
+}
+
+void ThreadPool::submit(Task task, int worker) {
+  if (worker < 0) worker = (int)(next++ % workers.size());
+  pending++;
+  {
+    std::lock_guard<std::mutex> guard(workers[worker]->lock);
+    workers[worker]->tasks.push_back(std::move(task));
+  }
+  queued++;
+  {
+    std::lock_guard<std::mutex> guard(lock);
+  }
+  wake.notify_all();
+}
+
+void ThreadPool::wait() {
+  std::unique_lock<std::mutex> guard(lock);
+  done.wait(guard, [&] { return pending == 0; });
+}
+
+void ThreadPool::resetBusyTime() {
+  for (auto & w: workers) {
+    w->busy = 0.0;
+  }
+}
+
+bool ThreadPool::pop(int worker, Task &task) {
+  {
+    Worker& own = *workers[worker];
+    std::lock_guard<std::mutex> guard(own.lock);
+    if (!own.tasks.empty()) {
+      task = std::move(own.tasks.front());
+      own.tasks.pop_front();
+      queued--;
+      return true;
+    }
+  }
+  for (size_t i = 1; i < workers.size(); ++i) {
+    Worker& victim = *workers[(worker + i) % workers.size()];
+    std::lock_guard<std::mutex> guard(victim.lock);
+    if (!victim.tasks.empty()) {
+      task = std::move(victim.tasks.back());
+      victim.tasks.pop_back();
+      queued--;
+      return true;
+    }
+  }
+  return false;
+}
+
+void ThreadPool::loop(int worker) {
+  while (true) {
+    Task task;
+    if (pop(worker, task)) {
+      auto start = std::chrono::steady_clock::now();
+      task(worker);
+      workers[worker]->busy += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+      if (--pending == 0) {
+        std::lock_guard<std::mutex> guard(lock);
+        done.notify_all();
+      }
+      continue;
+    }
+    std::unique_lock<std::mutex> guard(lock);
+    wake.wait(guard, [&] { return stopping || queued > 0; });
+    if (stopping && queued == 0) return;
+  }
+}
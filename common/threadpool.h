@@ -0,0 +1,50 @@
+#ifndef GRAPHICS_THREADPOOL_H
+#define GRAPHICS_THREADPOOL_H
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <pthread.h>
+
+// Persistent pool of worker threads. Every worker owns a deque of tasks: it pops from
+// the front of its own deque and steals from the back of the others when it runs dry.
+class ThreadPool {
+public:
+    typedef std::function<void(int worker)> Task;
+private:
+    struct Worker {
+        pthread_t thread;
+        std::mutex lock;
+        std::deque<Task> tasks;
+        double busy;
+    };
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::mutex lock;
+    std::condition_variable wake;
+    std::condition_variable done;
+    std::atomic<size_t> queued;
+    std::atomic<size_t> pending;
+    std::atomic<size_t> next;
+    bool stopping;
+    static void* run(void* arg);
+    void loop(int worker);
+    bool pop(int worker, Task& task);
+public:
+    // threads <= 0 uses one thread per hardware thread
+    ThreadPool(int threads = 0);
+    ~ThreadPool();
+    int size() const { return (int)workers.size(); }
+    // Queue a task on the given worker, or round-robin when worker < 0
+    void submit(Task task, int worker = -1);
+    // Block until every submitted task has finished
+    void wait();
+    // Seconds each worker spent running tasks since the last reset
+    double busyTime(int worker) const { return workers[worker]->busy; }
+    void resetBusyTime();
+};
+
+#endif //GRAPHICS_THREADPOOL_H
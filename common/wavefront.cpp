@@ -0,0 +1,284 @@
+#include "wavefront.h"
+#include "raytracing.h"
+
+#include <algorithm>
+#include <numeric>
+#include <functional>
+
+void RayQueue::clear() {
+  for (int k = 0; k < 3; ++k) {
+    origin[k].clear();
+    direction[k].clear();
+  }
+  n.clear();
+  width.clear();
+  spread.clear();
+  parent.clear();
+  source.clear();
+}
+
+void RayQueue::push(const Ray &ray, uint32_t parent, const Object *source) {
+  for (int k = 0; k < 3; ++k) {
+    origin[k].push_back(ray.origin[k]);
+    direction[k].push_back(ray.direction[k]);
+  }
+  n.push_back(ray.n);
+  width.push_back(ray.width);
+  spread.push_back(ray.spread);
+  this->parent.push_back(parent);
+  this->source.push_back(source);
+}
+
+// The stored direction is already normalized, so it is copied rather than passed through the constructor
+Ray RayQueue::get(size_t i) const {
+  Ray ray;
+  ray.origin = glm::vec3(origin[0][i], origin[1][i], origin[2][i]);
+  ray.direction = glm::vec3(direction[0][i], direction[1][i], direction[2][i]);
+  ray.n = n[i];
+  ray.width = width[i];
+  ray.spread = spread[i];
+  return ray;
+}
+
+int RayQueue::octant(size_t i) const {
+  return (direction[0][i] < 0.0f ? 1 : 0) | (direction[1][i] < 0.0f ? 2 : 0) | (direction[2][i] < 0.0f ? 4 : 0);
+}
+
+void Bounce::clear() {
+  rays.clear();
+  hits.clear();
+  hit.clear();
+  color.clear();
+  reflected.clear();
+  refracted.clear();
+  shadowFirst.clear();
+  shadowCount.clear();
+}
+
+void Wavefront::render(const RenderJob &job, const Tile &tile, int first, int count, glm::vec3* sums) {
+  eye = job.eye;
+  bounces.resize(DEPTH_MAX + 1);
+  std::vector<std::pair<int, int>> pixels;
+  for (int y = tile.y0; y < tile.y1; ++y) {
+    for (int x = tile.x0; x < tile.x1; ++x) {
+      pixels.push_back(std::make_pair(x, y));
+    }
+  }
+  size_t batch = std::max(1, WAVEFRONT_RAYS / count);
+  for (size_t begin = 0; begin < pixels.size(); begin += batch) {
+    size_t end = std::min(pixels.size(), begin + batch);
+    for (auto & bounce: bounces) {
+      bounce.clear();
+    }
+    // The same eye samples as World::sampleSum
+    RayQueue& camera = bounces[0].rays;
+    for (size_t p = begin; p < end; ++p) {
+      int x = pixels[p].first;
+      int y = pixels[p].second;
+      glm::vec3 target = world.pixelTarget(job, x, y);
+      for (int k = 0; k < count; ++k) {
+        glm::vec3 dist_eye = world.eyeSample(job, x, y, first + k);
+        camera.push(world.cameraRay(job, dist_eye, target), (uint32_t)(p - begin), nullptr);
+      }
+    }
+
+    size_t depth = 0;
+    for (; depth <= DEPTH_MAX && bounces[depth].rays.size() > 0; ++depth) {
+      extend(depth);
+      if (world.singlePrecision) shade<float>(depth);
+      else shade<double>(depth);
+      shadow(depth);
+    }
+    while (depth-- > 0) {
+      if (world.singlePrecision) resolve<float>(depth);
+      else resolve<double>(depth);
+    }
+
+    for (size_t p = begin; p < end; ++p) {
+      glm::vec3 color = glm::vec3(0);
+      for (int k = 0; k < count; ++k) {
+        color += bounces[0].color[(p - begin) * count + k];
+      }
+      sums[p] = color;
+    }
+  }
+}
+
+/**
+ * Closest hits of every ray of a bounce. Rays are sorted by direction octant and the object they
+ * leave from, then traced in packets of SIMD_WIDTH rays of one octant.
+ * @param depth
+ */
+void Wavefront::extend(size_t depth) {
+  Bounce& bounce = bounces[depth];
+  const RayQueue& rays = bounce.rays;
+  size_t n = rays.size();
+  bounce.hits.resize(n);
+  bounce.hit.assign(n, 0);
+  bounce.color.assign(n, glm::vec3(0));
+  bounce.reflected.assign(n, -1);
+  bounce.refracted.assign(n, -1);
+  bounce.shadowFirst.assign(n, 0);
+  bounce.shadowCount.assign(n, 0);
+  if (depth == 0) rayStats.primary += n;
+  else rayStats.secondary += n;
+
+  order.resize(n);
+  std::iota(order.begin(), order.end(), 0);
+  std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+    int oa = rays.octant(a), ob = rays.octant(b);
+    if (oa != ob) return oa < ob;
+    if (rays.source[a] != rays.source[b]) return std::less<const Object*>()(rays.source[a], rays.source[b]);
+    return a < b;
+  });
+
+  Ray packet[SIMD_WIDTH];
+  Hit hits[SIMD_WIDTH];
+  for (size_t i = 0; i < n;) {
+    int octant = rays.octant(order[i]);
+    int count = 0;
+    while (count < SIMD_WIDTH && i + count < n && rays.octant(order[i + count]) == octant) {
+      packet[count] = rays.get(order[i + count]);
+      count++;
+    }
+    int mask = world.intersectPacket(packet, count, hits);
+    for (int l = firstLane(mask); l >= 0; mask &= mask - 1, l = firstLane(mask)) {
+      bounce.hits[order[i + l]] = hits[l];
+      bounce.hit[order[i + l]] = 1;
+    }
+    i += count;
+  }
+}
+
+/**
+ * Local lighting of every hit, sorted by object. Queues a shadow query for every light that
+ * would contribute and the reflected and refracted rays for the next bounce.
+ * @param depth
+ */
+template <typename Real>
+void Wavefront::shade(size_t depth) {
+  Bounce& bounce = bounces[depth];
+  Bounce* next = depth < DEPTH_MAX ? &bounces[depth + 1] : nullptr;
+  order.clear();
+  for (uint32_t i = 0; i < bounce.rays.size(); ++i) {
+    if (bounce.hit[i]) order.push_back(i);
+  }
+  std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+    const Hit& ha = bounce.hits[a];
+    const Hit& hb = bounce.hits[b];
+    if (ha.object != hb.object) return std::less<const Object*>()(ha.object, hb.object);
+    if (ha.primitive != hb.primitive) return ha.primitive < hb.primitive;
+    return a < b;
+  });
+
+  shadows.clear();
+  bool budgeted = world.lightBudget != 0 && world.lightBudget < world.lights.size();
+  for (uint32_t i: order) {
+    Hit& hit = bounce.hits[i];
+    Ray ray = bounce.rays.get(i);
+    const Object* obj = hit.object;
+    obj->surface(ray, hit);
+    bounce.color[i] = world.ambientColor<SHADE_ALL>(hit);
+    glm::vec3 N = hit.shadingNormal;
+    glm::vec3 V = glm::normalize(eye - hit.point);
+    bounce.shadowFirst[i] = (uint32_t)shadows.size();
+    ShadowQuery query;
+    query.vertex = i;
+    query.pdf = 1.0f;
+    query.blocked = false;
+    for (size_t k = 0; budgeted && k < world.lightBudget; ++k) {
+      query.light = world.lightTree.sample(hit.point, World::lightSample(hit.point, k), query.pdf);
+      query.contribution = world.lightContribution<Real>(query.light, hit, N, V);
+      if (query.contribution != glm::vec3(0)) shadows.push_back(query);
+    }
+    glm::vec3 contributions[SIMD_WIDTH];
+    for (size_t first = 0; !budgeted && first < world.lights.size(); first += SIMD_WIDTH) {
+      int lit = world.lightBlock<Real>(first, hit, N, V, contributions);
+      for (int lane = firstLane(lit); lane >= 0; lit &= lit - 1, lane = firstLane(lit)) {
+        query.light = (uint32_t)(first + lane);
+        query.contribution = contributions[lane];
+        shadows.push_back(query);
+      }
+    }
+    bounce.shadowCount[i] = (uint32_t)shadows.size() - bounce.shadowFirst[i];
+
+    if (!next) continue;
+    if (obj->reflective) {
+      bounce.reflected[i] = (int32_t)next->rays.size();
+      next->rays.push(obj->reflect(ray, hit), i, obj);
+    }
+    if (obj->refractive) {
+      bounce.refracted[i] = (int32_t)next->rays.size();
+      next->rays.push(obj->refract(ray, hit), i, obj);
+    }
+  }
+}
+
+/**
+ * Traces the shadow queries of a bounce grouped by light, so the per-light occluder cache stays warm,
+ * then adds the unblocked contributions to their vertices in light order.
+ * @param depth
+ */
+void Wavefront::shadow(size_t depth) {
+  Bounce& bounce = bounces[depth];
+  // Counting sort by light, stable so the vertices of one light stay in shading order
+  std::vector<uint32_t> offsets(world.lights.size() + 1, 0);
+  for (auto const & query: shadows) {
+    offsets[query.light + 1]++;
+  }
+  std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+  order.resize(shadows.size());
+  for (uint32_t q = 0; q < shadows.size(); ++q) {
+    order[offsets[shadows[q].light]++] = q;
+  }
+  for (uint32_t q: order) {
+    ShadowQuery& query = shadows[q];
+    query.blocked = !world.reachable(query.light, bounce.hits[query.vertex].point);
+  }
+
+  bool budgeted = world.lightBudget != 0 && world.lightBudget < world.lights.size();
+  for (size_t i = 0; i < bounce.rays.size(); ++i) {
+    if (!bounce.hit[i]) continue;
+    uint32_t first = bounce.shadowFirst[i];
+    uint32_t end = first + bounce.shadowCount[i];
+    glm::vec3& c = bounce.color[i];
+    if (!budgeted) {
+      for (uint32_t q = first; q < end; ++q) {
+        if (!shadows[q].blocked) c += shadows[q].contribution;
+      }
+      continue;
+    }
+    glm::vec3 sum = glm::vec3(0);
+    for (uint32_t q = first; q < end; ++q) {
+      if (!shadows[q].blocked) sum += shadows[q].contribution / shadows[q].pdf;
+    }
+    c = c + sum / (float)world.lightBudget;
+  }
+}
+
+// Combines the local color of every vertex with the colors of its reflected and refracted rays, as World::shade does
+template <typename Real>
+void Wavefront::resolve(size_t depth) {
+  Bounce& bounce = bounces[depth];
+  for (size_t i = 0; i < bounce.rays.size(); ++i) {
+    if (!bounce.hit[i]) {
+      bounce.color[i] = BACKGROUND_COLOR;
+      continue;
+    }
+    const Object* obj = bounce.hits[i].object;
+    glm::vec3 c = bounce.color[i];
+    Real weightSum = 1.0;
+    if (obj->reflective) {
+      glm::vec3 reflected = bounce.reflected[i] >= 0 ? bounces[depth + 1].color[bounce.reflected[i]] : BACKGROUND_COLOR;
+      c += reflected * (Real)obj->reflectWeight;
+      weightSum += (Real)obj->reflectWeight;
+    }
+    if (obj->refractive) {
+      glm::vec3 refracted = bounce.refracted[i] >= 0 ? bounces[depth + 1].color[bounce.refracted[i]] : BACKGROUND_COLOR;
+      Real refractWeight = 4.0f;
+      c += refracted * refractWeight;
+      weightSum += refractWeight;
+    }
+    bounce.color[i] = c / weightSum;
+  }
+}
@@ -0,0 +1,94 @@
+#ifndef GRAPHICS_WAVEFRONT_H
+#define GRAPHICS_WAVEFRONT_H
+
+#include <vector>
+#include <cstdint>
+
+#include <glm/glm.hpp>
+
+#include "object.h"
+
+// Eye samples in flight per batch, whole pixels are batched together
+#define WAVEFRONT_RAYS 4096
+
+class World;
+struct RenderJob;
+struct Tile;
+
+// Rays of one bounce in structure-of-arrays layout
+struct RayQueue {
+    std::vector<float> origin[3];
+    std::vector<float> direction[3];
+    std::vector<double> n;
+    std::vector<float> width;
+    std::vector<float> spread;
+    // Path vertex of the previous bounce that spawned the ray, or the pixel for camera rays
+    std::vector<uint32_t> parent;
+    // Object the ray leaves from, nullptr for camera rays
+    std::vector<const Object*> source;
+    size_t size() const { return n.size(); }
+    void clear();
+    void push(const Ray& ray, uint32_t parent, const Object* source);
+    Ray get(size_t i) const;
+    int octant(size_t i) const;
+};
+
+// The path vertices of one bounce: its rays, what they hit and the color seen along them
+struct Bounce {
+    RayQueue rays;
+    std::vector<Hit> hits;
+    std::vector<uint8_t> hit;
+    std::vector<glm::vec3> color;
+    // Index of the reflected and refracted ray in the next bounce, -1 when there is none
+    std::vector<int32_t> reflected;
+    std::vector<int32_t> refracted;
+    // First shadow query of every vertex, queries of a vertex are contiguous
+    std::vector<uint32_t> shadowFirst;
+    std::vector<uint32_t> shadowCount;
+    void clear();
+};
+
+// Unshadowed contribution of one light to one path vertex, kept when the shadow ray is clear
+struct ShadowQuery {
+    uint32_t vertex;
+    uint32_t light;
+    glm::vec3 contribution;
+    float pdf;
+    bool blocked;
+};
+
+/**
+ * Breadth-first renderer. The eye samples of a batch of pixels advance one bounce at a time
+ * through the extend (closest hit), shade (local lighting and new rays) and shadow (any-hit)
+ * stages. Each stage first sorts its queue, by direction octant and source object for extend,
+ * by hit object for shade and by light for shadow, so consecutive rays touch the same data.
+ * The colors are combined bottom-up in the same order as World::trace, so both agree exactly.
+ */
+class Wavefront {
+private:
+    const World& world;
+    glm::vec3 eye;
+    std::vector<Bounce> bounces;
+    std::vector<ShadowQuery> shadows;
+    std::vector<uint32_t> order;
+    void extend(size_t depth);
+    // Shade and resolve compute in the precision of the world's trace kernel
+    template <typename Real>
+    void shade(size_t depth);
+    void shadow(size_t depth);
+    template <typename Real>
+    void resolve(size_t depth);
+public:
+    Wavefront(const World& world) : world(world) {};
+    /**
+     * Sums of eye samples [first, first + count) of every pixel of the tile
+     * @param job
+     * @param tile
+     * @param first
+     * @param count
+     * @param sums one per pixel of the tile, row by row
+     */
+    void render(const RenderJob& job, const Tile& tile, int first, int count, glm::vec3* sums);
+};
+
+#endif //GRAPHICS_WAVEFRONT_H
@@ -1,15 +1,141 @@
 // Include standard headers
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <vector>
+#include <algorithm>
 
 #include <glm/glm.hpp>
 #include <common/raytracing.h>
 #include <common/objloader.hpp>
+#include <common/scenecache.h>
+#include <common/instance.h>
 
-int main(void)
+// One view per line: eye, direction and up vectors, view width, image size and output path,
+// optionally followed by the scene time. Blank lines and lines starting with # are skipped.
+// An output path ending in .ppm is written as PPM, any other as PNG at the --level given.
+static bool readViews(const char* path, std::vector<View>& views) {
+  FILE* fp = fopen(path, "r");
+  if (!fp) return false;
+  char line[1024];
+  int number = 0;
+  bool ok = true;
+  while (ok && fgets(line, sizeof(line), fp)) {
+    number++;
+    glm::vec3 eye, direction, up;
+    double view_width;
+    int width, height;
+    float time = 0.0f;
+    char output[1024];
+    if (line[strspn(line, " \t\r\n")] == '\0' || line[strspn(line, " \t")] == '#') continue;
+    ok = sscanf(line, "%f %f %f %f %f %f %f %f %f %lf %d %d %1023s %f", &eye.x, &eye.y, &eye.z,
+                &direction.x, &direction.y, &direction.z, &up.x, &up.y, &up.z,
+                &view_width, &width, &height, output, &time) >= 13 && width > 0 && height > 0;
+    if (!ok) fprintf(stderr, "%s:%d: expected eye, direction, up, view width, width, height and output\n", path, number);
+    else views.push_back(View(eye, direction, up, view_width, width, height, output, time));
+  }
+  fclose(fp);
+  return ok;
+}
+
+// Whole decimal number, false on anything else
+static bool readLong(const char* text, long& value) {
+  char* end;
+  value = strtol(text, &end, 10);
+  return end != text && *end == '\0';
+}
+
+int main(int argc, char** argv)
 {
   World world;
+  SceneCache scenes;
+  const char* batch = nullptr;
+  const char* extension = "png";
+  int turntable = 0;
+  int frames = 0;
+  for (int i = 1; i < argc; ++i) {
+    if ((!strcmp(argv[i], "-t") || !strcmp(argv[i], "--threads")) && i + 1 < argc) {
+      world.setThreadCount(atoi(argv[++i]));
+    }
+    else if (!strcmp(argv[i], "--adaptive") && i + 3 < argc) {
+      long minSamples, maxSamples;
+      char* end;
+      bool ok = readLong(argv[i + 1], minSamples) && readLong(argv[i + 2], maxSamples);
+      float threshold = strtof(argv[i + 3], &end);
+      if (!ok || end == argv[i + 3] || *end != '\0' || minSamples < 1 || maxSamples < minSamples || maxSamples > 1 << 20 || !(threshold >= 0.0f)) {
+        fprintf(stderr, "--adaptive takes a minimum of 1 or more samples, a maximum of at least the minimum and a threshold of 0 or more, not %s %s %s\n",
+                argv[i + 1], argv[i + 2], argv[i + 3]);
+        return 1;
+      }
+      world.setAdaptiveSampling((int)minSamples, (int)maxSamples, threshold);
+      i += 3;
+    }
+    else if (!strcmp(argv[i], "--lights") && i + 1 < argc) {
+      // Shadow rays per hit, sampled from the light tree; 0 shades every light
+      long budget;
+      if (!readLong(argv[++i], budget) || budget < 0) {
+        fprintf(stderr, "--lights takes a number of shadow rays per hit, 0 or more, not %s\n", argv[i]);
+        return 1;
+      }
+      world.setLightBudget((size_t)budget);
+    }
+    else if (!strcmp(argv[i], "--window") && i + 1 < argc) {
+      world.setOutputWindow(atoi(argv[++i]));
+    }
+    else if (!strcmp(argv[i], "--level") && i + 1 < argc) {
+      long level;
+      if (!readLong(argv[++i], level) || level < -1 || level > 9) {
+        fprintf(stderr, "--level takes a zlib compression level from -1 to 9, not %s\n", argv[i]);
+        return 1;
+      }
+      extension = "png";
+      world.setOutputFormat(ImageFormat::PNG, (int)level);
+    }
+    else if (!strcmp(argv[i], "--ppm")) {
+      extension = "ppm";
+      world.setOutputFormat(ImageFormat::PPM);
+    }
+    else if (!strcmp(argv[i], "--wavefront")) {
+      world.setWavefront(true);
+    }
+    else if (!strcmp(argv[i], "--float")) {
+      world.setSinglePrecision(true);
+    }
+    else if (!strcmp(argv[i], "--samples") && i + 1 < argc) {
+      world.setSamplesPerPixel(std::max(1, atoi(argv[++i])));
+    }
+    else if (!strcmp(argv[i], "--checkpoint") && i + 1 < argc) {
+      world.setCheckpoint(argv[++i]);
+    }
+    else if (!strcmp(argv[i], "--texture-cache") && i + 1 < argc) {
+      TextureCache::instance().setBudget((size_t)atoi(argv[++i]) << 20);
+    }
+    else if ((!strcmp(argv[i], "-p") || !strcmp(argv[i], "--processes")) && i + 1 < argc) {
+      world.setProcesses(atoi(argv[++i]));
+    }
+    else if (!strcmp(argv[i], "--scene-cache") && i + 1 < argc) {
+      scenes.setDirectory(argv[++i]);
+    }
+    else if (!strcmp(argv[i], "--batch") && i + 1 < argc) {
+      batch = argv[++i];
+    }
+    else if (!strcmp(argv[i], "--turntable") && i + 1 < argc) {
+      turntable = atoi(argv[++i]);
+    }
+    else if (!strcmp(argv[i], "--frames") && i + 1 < argc) {
+      frames = atoi(argv[++i]);
+    }
+  }
+  // Batch views are read before the scene is built, any view at a non-zero time animates it
+  std::vector<View> batchViews;
+  if (batch && !readViews(batch, batchViews)) {
+    fprintf(stderr, "Could not read the views in %s\n", batch);
+    return 1;
+  }
+  bool animated = frames > 0;
+  for (const View& v : batchViews) {
+    if (v.time != 0.0f) animated = true;
+  }
   Sphere s1 = Sphere(glm::vec3(0.0f), 10.0,
                      glm::vec3(0.1f),
                      glm::vec3(0.7f),
@@ -60,7 +186,7 @@ int main(void)
                             glm::vec3(0.0),
                             glm::vec3(0.0),
                             78.6f, 1.0, true, false);
-  ((Object*)&mirror1)->reflectWeight = 10.0;
+  mirror1.reflectWeight = 10.0;
   auto mirror2_vertices = std::vector<glm::vec3>{
       glm::vec3(-50.0f, -10.0f, 50.0f),
       glm::vec3(-50.0f, 50.0f, 50.0f),
@@ -75,38 +201,50 @@ int main(void)
                             glm::vec3(0.0),
                             78.6f, 1.0, true, false);
 
-  ((Object*)&mirror2)->reflectWeight = 10.0;
+  mirror2.reflectWeight = 10.0;
 
-  std::vector<glm::vec3> polygon_vertices;
-  std::vector<glm::vec3> polygon_normals;
-  assert(loadOBJ("/home/lastone817/raytracing/hw5/polygon.obj", polygon_vertices, polygon_normals));
-  std::vector<glm::vec3> scale_vertices;
-  for(auto const & p : polygon_vertices) {
-    glm::mat4 transform = glm::translate(glm::vec3(40.0, 0.0, 0.0)) * glm::scale(glm::vec3(3.0));
-    scale_vertices.push_back(glm::vec3(transform * glm::vec4(p, 1.0)));
-  }
-  Polygon p1 = Polygon(scale_vertices, polygon_normals,
-                       glm::vec3(0.1745f, 0.01175f, 0.01175f),
+  glm::mat4 transform = glm::translate(glm::vec3(40.0, 0.0, 0.0)) * glm::scale(glm::vec3(3.0));
+  Polygon p1 = Polygon(glm::vec3(0.1745f, 0.01175f, 0.01175f),
                        glm::vec3(0.61424f, 0.04136f, 0.04136f),
                        glm::vec3(0.727811f, 0.626959f, 0.626959f),
                        10.0, 1.0, true, false);
+  // An animated polygon is only scaled, its placement comes from the instance. Instances stay rigid
+  // since the distance thresholds of the objects do not scale with them.
+  assert(scenes.loadPolygon("/home/lastone817/raytracing/hw5/polygon.obj", animated ? glm::scale(glm::vec3(3.0)) : transform, p1));
+
+  // Over time 0 to 1 the polygon spins once about its center and the green sphere bounces twice
+  Animation spin, bounce;
+  for (int k = 0; k <= 3; ++k) {
+    spin.add(k / 3.0f, glm::vec3(40.0f, 0.0f, 0.0f), glm::angleAxis((float)(2.0 * M_PI * k / 3), glm::vec3(0, 1, 0)));
+  }
+  for (int k = 0; k <= 4; ++k) {
+    bounce.add(k / 4.0f, glm::vec3(0.0f, k % 2 ? 8.0f : 0.0f, 0.0f));
+  }
+  Instance spinning(&p1, spin);
+  Instance bouncing(&s2, bounce);
 
   Texture texture = Texture("/home/lastone817/raytracing/hw5/texture.bmp");
   Texture bumpmap = Texture("/home/lastone817/raytracing/hw5/normal.bmp");
   Texture crystal = Texture("/home/lastone817/raytracing/hw5/crystal.bmp");
 
-  ((Object*)&s4)->texture = &texture;
-  ((Object*)&s4)->bumpmap = &bumpmap;
-  ((Object*)&s3)->bumpmap = &crystal;
+  s4.texture = &texture;
+  s4.bumpmap = &bumpmap;
+  s3.bumpmap = &crystal;
 
-  world.addObject((Object*)&s1);
-  world.addObject((Object*)&s2);
-  world.addObject((Object*)&s3);
-  world.addObject((Object*)&s4);
-  world.addObject((Object*)&p1);
-  world.addObject((Object*)&floor);
-  world.addObject((Object*)&mirror1);
-  world.addObject((Object*)&mirror2);
+  world.addObject(&s1);
+  world.addObject(&s3);
+  world.addObject(&s4);
+  world.addObject(&floor);
+  world.addObject(&mirror1);
+  world.addObject(&mirror2);
+  if (animated) {
+    world.addObject(&bouncing);
+    world.addObject(&spinning);
+  }
+  else {
+    world.addObject(&s2);
+    world.addObject(&p1);
+  }
 
   for (int i = -3; i <= 3; ++i) {
     for (int j = -3; j <= 3; ++j) {
@@ -126,6 +264,39 @@ int main(void)
   world.addLight(l2);
   Light l3 = Light(glm::vec3(0.0f + 0 * 5.0, 50.0f, 0.0f + 0 * 5.0), 5000.0f);
   world.addLight(l3);
-  world.createImageFromView(glm::vec3(140.0f, 40.0f, -140.0f), glm::vec3(-140.0f, -40.0f, 140.0f), glm::vec3(0,1,0), 80, 3200, 2400);
+  View view(glm::vec3(140.0f, 40.0f, -140.0f), glm::vec3(-140.0f, -40.0f, 140.0f), glm::vec3(0,1,0), 80, 3200, 2400, "");
+  if (batch) {
+    world.renderBatch(batchViews);
+  }
+  else if (frames > 0) {
+    std::vector<View> views;
+    for (int i = 0; i < frames; ++i) {
+      char output[64];
+      snprintf(output, sizeof(output), "./anim%03d.%s", i, extension);
+      View frame = view;
+      frame.output = output;
+      frame.time = (float)i / frames;
+      views.push_back(frame);
+    }
+    world.renderBatch(views);
+  }
+  else if (turntable > 0) {
+    // The camera circles the vertical axis through the origin, frames go to ./frame000.png and on
+    std::vector<View> views;
+    for (int i = 0; i < turntable; ++i) {
+      glm::mat4 rotation = glm::rotate((float)(2.0 * M_PI * i / turntable), glm::vec3(0, 1, 0));
+      View frame = view;
+      frame.eye = glm::vec3(rotation * glm::vec4(view.eye, 1.0f));
+      frame.direction = glm::vec3(rotation * glm::vec4(view.direction, 0.0f));
+      char output[64];
+      snprintf(output, sizeof(output), "./frame%03d.%s", i, extension);
+      frame.output = output;
+      views.push_back(frame);
+    }
+    world.renderBatch(views);
+  }
+  else {
+    world.createImageFromView(view.eye, view.direction, view.up, view.view_width, view.width, view.height);
+  }
   return 0;
 }